@@ -46,121 +46,405 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <assert.h>
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include "picoev.h"
 
-//#include "nuon.h"
+#include "nuon.h"
 
 #define HOST 0 /* 0x7f000001 for localhost */
 #define PORT 23456
 #define MAX_FDS 1024
 #define TIMEOUT_SECS 10
+#define MAX_QUERY (1024 * 1024) /* longest query a client may send */
+#define HIGH_WATER (1024 * 1024) /* stop reading while more output is queued */
+#define MAX_IOV 64
+#define MAX_WORKERS 256
+#define COMPACT_BATCH 256 /* vertices reclaimed per hold of the write lock */
+#define COMPACT_IDLE_US 100000
+
+/* queries are terminated by a ';' outside of string literals, every
+   response is terminated by an empty line */
+#define QUERY_DELIM ';'
+#define RESPONSE_END "\n"
+
+typedef struct conn conn_t;
+
+struct conn {
+  Buffer in;
+  Output out;
+  size_t scanned; /* bytes of `in` already searched for a delimiter */
+  int quoted;     /* scanner is inside a string literal */
+  int escaped;    /* previous byte was a backslash inside a literal */
+  Cursor cursor;  /* the match at the head of `in` that stopped halfway */
+  size_t stmt;    /* where that statement ends in `in` */
+};
+
+typedef struct worker worker_t;
+
+/* a thread running its own loop and listener */
+struct worker {
+  pthread_t thread;
+  int cpu;
+  int listen_sock;
+};
+
+static Graph* nuon;
 
-// Graph nuon;
+/* startup failures are fatal */
+static void die(const char* what)
+{
+  perror(what);
+  exit(EXIT_FAILURE);
+}
 
-static void setup_sock(int fd)
+static int setup_sock(int fd)
 {
-  int on = 1, r;
+  int on = 1;
 
-  r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
-  assert(r == 0);
-  r = fcntl(fd, F_SETFL, O_NONBLOCK);
-  assert(r == 0);
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) != 0) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, O_NONBLOCK);
 }
 
-static void close_conn(picoev_loop* loop, int fd)
+static void close_conn(picoev_loop* loop, int fd, conn_t* conn)
 {
   picoev_del(loop, fd);
   close(fd);
-  printf("closed: %d\n", fd);
+  buffer_free(&conn->in);
+  output_free(&conn->out);
+  free(conn);
+}
+
+/* returns the offset of the next delimiter in conn->in, or -1 */
+static ssize_t find_delim(conn_t* conn)
+{
+  for (; conn->scanned < conn->in.len; conn->scanned++) {
+    unsigned char c = conn->in.data[conn->scanned];
+    if (conn->escaped) {
+      conn->escaped = 0;
+    } else if (conn->quoted) {
+      if (c == '\\') {
+        conn->escaped = 1;
+      } else if (c == '"') {
+        conn->quoted = 0;
+      }
+    } else if (c == '"') {
+      conn->quoted = 1;
+    } else if (c == QUERY_DELIM) {
+      return conn->scanned++;
+    }
+  }
+  return -1;
+}
+
+/* runs the complete queries in the input buffer, holding back the rest
+   while the client is not draining its results. a match whose output
+   reaches the high water mark stops there, and is run again from its
+   cursor once the output has drained, with the graph unlocked between */
+static void run_queries(conn_t* conn)
+{
+  size_t start = 0;
+  ssize_t end;
+
+  conn->cursor.limit = HIGH_WATER;
+  while (conn->out.len <= HIGH_WATER) {
+    if (conn->cursor.more) {
+      end = conn->stmt;
+    } else if ((end = find_delim(conn)) == -1) {
+      break;
+    }
+    conn->in.data[end] = 0;
+    parse_resume(nuon, conn->in.data + start, &conn->out, &conn->cursor);
+    if (conn->cursor.more) {
+      conn->stmt = end;
+      break;
+    }
+    output_append(&conn->out, RESPONSE_END, sizeof(RESPONSE_END) - 1);
+    start = end + 1;
+  }
+  buffer_consume(&conn->in, start);
+  conn->scanned -= start;
+  conn->stmt -= conn->cursor.more ? start : 0;
+}
+
+/* writes as much of the output chain as the socket takes, returns -1 on a
+   fatal error */
+static int flush_conn(picoev_loop* loop, int fd, conn_t* conn)
+{
+  struct iovec iov[MAX_IOV];
+  OutputBlock* b;
+  ssize_t r;
+  int n;
+
+  while (conn->out.len != 0) {
+    for (n = 0, b = conn->out.head; b != NULL && n < MAX_IOV; b = b->next) {
+      if (b->len != b->off) {
+        iov[n].iov_base = b->data + b->off;
+        iov[n].iov_len = b->len - b->off;
+        n++;
+      }
+    }
+    r = picoev_writev(loop, fd, iov, n);
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    output_consume(&conn->out, r);
+  }
+  return 0;
 }
 
 static void rw_callback(picoev_loop* loop, int fd, int events, void* cb_arg)
 {
+  conn_t* conn = cb_arg;
+  size_t pending;
+
   if ((events & PICOEV_TIMEOUT) != 0) {
     
     /* timeout */
-    close_conn(loop, fd);
+    close_conn(loop, fd, conn);
+    return;
     
-  } else if ((events & PICOEV_READ) != 0) {
+  }
+
+  /* any progress keeps the connection alive */
+  picoev_set_timeout(loop, fd, TIMEOUT_SECS);
+
+  if ((events & PICOEV_READ) != 0) {
     
-    /* update timeout, and read */
-    char buf[1024];
+    /* read until the socket is drained (required when the backend is
+       edge-triggered), or until the client has too much output pending */
     ssize_t r;
-    picoev_set_timeout(loop, fd, TIMEOUT_SECS);
-    r = read(fd, buf, sizeof(buf));
-    switch (r) {
-    case 0: /* connection closed by peer */
-      close_conn(loop, fd);
-      break;
-    case -1: /* error */
-      if (errno == EAGAIN || errno == EWOULDBLOCK) { /* try again later */
-  break;
-      } else { /* fatal error */
-  close_conn(loop, fd);
+    while (conn->out.len <= HIGH_WATER) {
+      if (buffer_reserve(&conn->in, 4096) != 0) {
+        close_conn(loop, fd, conn);
+        return;
       }
-      break;
-    default: /* got some data, send back */
-      // parse(&nuon, buf);
-      if (write(fd, buf, r) != r) {
-        close_conn(loop, fd);
+      r = picoev_read(loop, fd, conn->in.data + conn->in.len,
+                      conn->in.cap - conn->in.len);
+      if (r == 0) { /* connection closed by peer */
+        close_conn(loop, fd, conn);
+        return;
+      }
+      if (r == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) { /* fatal error */
+          close_conn(loop, fd, conn);
+          return;
+        }
+        break; /* else try again later */
+      }
+      conn->in.len += r;
+      run_queries(conn);
+      if (conn->in.len > MAX_QUERY) {
+        close_conn(loop, fd, conn);
+        return;
       }
-      break;
     }
   }
+
+  /* send results, then run queries that were held back while the output
+     was above the high water mark */
+  do {
+    if (flush_conn(loop, fd, conn) != 0) {
+      close_conn(loop, fd, conn);
+      return;
+    }
+    pending = conn->out.len;
+    run_queries(conn);
+  } while (conn->out.len != pending);
+
+  /* stop reading from clients that do not drain their results, and wait
+     for the socket to become writable while output is queued */
+  picoev_set_events(loop, fd,
+                    (conn->out.len <= HIGH_WATER ? PICOEV_READ : 0)
+                    | (conn->out.len != 0 ? PICOEV_WRITE : 0));
 }
 
 static void accept_callback(picoev_loop* loop, int fd, int events, void* cb_arg)
 {
-  int newfd = accept(fd, NULL, NULL);
-  if (newfd != -1) {
-    printf("connected: %d\n", newfd);
-    setup_sock(newfd);
-    picoev_add(loop, newfd, PICOEV_READ, TIMEOUT_SECS, rw_callback, NULL);
+  int newfd;
+  conn_t* conn;
+
+  (void)events;
+  (void)cb_arg;
+
+  while ((newfd = picoev_accept(loop, fd)) != -1) {
+    if ((conn = calloc(1, sizeof(conn_t))) == NULL) {
+      close(newfd);
+      continue;
+    }
+    if (setup_sock(newfd) != 0) {
+      free(conn);
+      close(newfd);
+      continue;
+    }
+    picoev_add(loop, newfd, PICOEV_READ, TIMEOUT_SECS, rw_callback, conn);
   }
 }
 
-int main(void)
+/* binds a listening socket to the port; every worker binds its own and the
+   kernel spreads incoming connections across them */
+static int listen_port(void)
 {
-  picoev_loop* loop;
   int listen_sock, flag;
-  
-  /* listen to port */
-  assert((listen_sock = socket(AF_INET, SOCK_STREAM, 0)) != -1);
-  flag = 1;
-  assert(setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag))
-   == 0);
   struct sockaddr_in listen_addr;
+
+  if ((listen_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    die("socket");
+  }
+  flag = 1;
+  if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) != 0) {
+    die("setsockopt(SO_REUSEADDR)");
+  }
+  if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) != 0) {
+    die("setsockopt(SO_REUSEPORT)");
+  }
+  memset(&listen_addr, 0, sizeof(listen_addr));
   listen_addr.sin_family = AF_INET;
   listen_addr.sin_port = htons(PORT);
   listen_addr.sin_addr.s_addr = htonl(HOST);
-  assert(bind(listen_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr))
-   == 0);
-  assert(listen(listen_sock, 5) == 0);
-  setup_sock(listen_sock);
-  
-  /* init picoev */
-  picoev_init(MAX_FDS);
+  if (bind(listen_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) != 0) {
+    die("bind");
+  }
+  if (listen(listen_sock, SOMAXCONN) != 0) {
+    die("listen");
+  }
+  if (setup_sock(listen_sock) != 0) {
+    die("setup_sock");
+  }
+
+  return listen_sock;
+}
+
+static void* worker_main(void* arg)
+{
+  worker_t* worker = arg;
+  picoev_loop* loop;
+
+#ifdef __linux__
+  /* pin the worker so its loop, connections and buffers stay on one core */
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(worker->cpu, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+
   /* create loop */
-  loop = picoev_create_loop(60);
+  if ((loop = picoev_create_loop(60)) == NULL) {
+    die("picoev_create_loop");
+  }
   /* add listen socket */
-  picoev_add(loop, listen_sock, PICOEV_READ, 0, accept_callback, NULL);
+  picoev_add(loop, worker->listen_sock, PICOEV_READ, 0, accept_callback, NULL);
   /* loop */
-  printf("Welcome to NUON.\nListening for TCP connections on port %d\n...", PORT);
   while (1) {
     picoev_loop_once(loop, 10);
   }
   /* cleanup */
   picoev_destroy_loop(loop);
+
+  return NULL;
+}
+
+/* reclaims deleted edges and vertices in small batches, so queries get the
+   lock in between and a delete never waits for the cleanup */
+static void* compactor_main(void* arg)
+{
+  Graph* g = arg;
+  int pending;
+
+  while (1) {
+    pthread_rwlock_rdlock(&g->lock);
+    pending = graph_compact(g, 0);
+    pthread_rwlock_unlock(&g->lock);
+    while (pending) {
+      pthread_rwlock_wrlock(&g->lock);
+      pending = graph_compact(g, COMPACT_BATCH);
+      pthread_rwlock_unlock(&g->lock);
+      sched_yield();
+    }
+    /* bring the csr of labels written since the last pass up to date,
+       readers share the lock with the rebuild but ingesters don't */
+    graph_lockShared(g, GRAPH_READ);
+    snapshot_release(graph_snapshot(g));
+    graph_unlockShared(g);
+    usleep(COMPACT_IDLE_US);
+  }
+
+  return NULL;
+}
+
+int main(void)
+{
+  pthread_t compactor;
+  worker_t workers[MAX_WORKERS];
+  int num_workers, i;
+  char* env;
+  
+  /* one worker per core, unless told otherwise */
+  if ((env = getenv("NUON_WORKERS")) != NULL) {
+    num_workers = atoi(env);
+  } else {
+    num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_workers < 1) {
+    num_workers = 1;
+  } else if (num_workers > MAX_WORKERS) {
+    num_workers = MAX_WORKERS;
+  }
+
+  /* the database */
+  if ((nuon = graph_init()) == NULL) {
+    die("graph_init");
+  }
+
+  /* init picoev, shared by the loops of all workers */
+  picoev_init(MAX_FDS);
+
+  /* listen to port */
+  for (i = 0; i < num_workers; i++) {
+    workers[i].cpu = i;
+    workers[i].listen_sock = listen_port();
+  }
+
+  printf("Welcome to NUON.\nListening for TCP connections on port %d with %d workers\n...", PORT, num_workers);
+  fflush(stdout);
+
+  /* pthread_create reports its error instead of setting errno */
+  for (i = 0; i < num_workers; i++) {
+    if ((errno = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) != 0) {
+      die("pthread_create");
+    }
+  }
+  if ((errno = pthread_create(&compactor, NULL, compactor_main, nuon)) != 0) {
+    die("pthread_create");
+  }
+  for (i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  /* cleanup */
   picoev_deinit();
   
   return 0;
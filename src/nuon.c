@@ -46,15 +46,22 @@
  */
 
 
+#include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "nuon.h"
 
 int height ();
-map_node_t* map_node_init (int, const char*, void*);
-void map_node_destroy (map_node_t *);
+map_node_t* map_node_init (map_t*, int, const char*, size_t, uint64, void*);
+void map_node_destroy (map_t*, map_node_t *);
 int nuonStrlen (unsigned char * str);
 int nuonStrncmp (unsigned char* k0, unsigned char* k1);
 
@@ -76,1379 +83,5058 @@ int nuonStrncmp (unsigned char* k0, unsigned char* k1)
   return (res ? res : kl0 == kl1 ? 0 : kl0 < kl1 ? -1 : 1);
 }
 
-map_t* map_init ()
+void buffer_init (Buffer* b)
 {
-  map_t* m = malloc(sizeof(map_t));
+  b->data = NULL;
+  b->len = 0;
+  b->cap = 0;
+}
 
-  if ( m ) {
-    int i;
-    memset(m, 0, sizeof(map_t));
-    m->height = 0;
-    m->head = map_node_init(MAX, NULL, NULL);
+/* make room for at least n more bytes */
+int buffer_reserve (Buffer* b, size_t n)
+{
+  size_t cap = b->cap ? b->cap : 256;
+  unsigned char* data;
+
+  if ( b->len + n <= b->cap ) {
+    return 0;
   }
 
-  return m;
+  while ( cap < b->len + n ) {
+    cap *= 2;
+  }
+
+  data = realloc(b->data, cap);
+
+  if ( !data ) {
+    return -1;
+  }
+
+  b->data = data;
+  b->cap = cap;
+
+  return 0;
 }
 
-/* initialize a node */
-map_node_t* map_node_init (int height, const char* k, void* v)
+int buffer_append (Buffer* b, const void* p, size_t n)
 {
-  int klen = k ? strlen(k) : 0;
-  int h = height;
-  int i;
-  map_node_t* n = malloc(sizeof(map_node_t));
+  if ( buffer_reserve(b, n) ) {
+    return -1;
+  }
 
-  if ( n ) {
-    if ( k && v ) {
-      n->key = malloc(klen + 1);
-      n->data = v;
-    } else {
-      n->key = NULL;
-      n->data = NULL;
-    }
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
 
-    if ( n->key ) {
-      n->key[klen] = 0; 
-      memcpy(n->key, k, klen);
-    }
+  return 0;
+}
 
-    n->height = h;
-    n->next = malloc(sizeof(map_node_t*)*h);
-    
-    if ( n->next ) {
-      for ( i = 0; i < h; i++ ) {
-        n->next[i] = NULL;
-      }
-    }
+/* drop n bytes from the front */
+void buffer_consume (Buffer* b, size_t n)
+{
+  if ( n >= b->len ) {
+    b->len = 0;
+    return;
   }
-  return n;
+
+  memmove(b->data, b->data + n, b->len - n);
+  b->len -= n;
 }
 
-int map_remove (map_t* m, const char* k)
+void buffer_free (Buffer* b)
 {
-  int klen = strlen(k);
-  int h = m->height;
-  int i = 0;
-  map_node_t* update[MAX];
-  map_node_t* iter = m->head;
-  map_node_t* del;
+  free(b->data);
+  buffer_init(b);
+}
 
-  while ( --h >= 0 ) {
-    while ( iter->next[h] && nuonStrncmp((unsigned char *)k, iter->next[h]->key) < 0 ) {
-      iter = iter->next[h];
-    }
+void output_init (Output* o)
+{
+  o->head = NULL;
+  o->tail = NULL;
+  o->spare = NULL;
+  o->len = 0;
+}
 
-    update[h] = iter;
+/* returns a block with free space at the tail of the chain */
+static OutputBlock* output_tail (Output* o)
+{
+  OutputBlock* b;
+
+  if ( o->tail && o->tail->len < OUTPUT_BLOCK_SIZE ) {
+    return o->tail;
   }
 
-  del = update[0]->next[0];
+  if ( o->spare ) {
+    b = o->spare;
+    o->spare = NULL;
+  } else {
+    b = malloc(sizeof(OutputBlock));
+    if ( !b ) {
+      return NULL;
+    }
+  }
 
-  if ( iter->next[0] && !nuonStrncmp((unsigned char *)k, iter->next[0]->key) ) {
-    h = m->height;
+  b->next = NULL;
+  b->len = 0;
+  b->off = 0;
 
-    while ( i < h ) {
-      if ( nuonStrncmp((unsigned char *)k, update[i]->next[i]->key) ) {
-        break;
-      }
+  if ( o->tail ) {
+    o->tail->next = b;
+  } else {
+    o->head = b;
+  }
+  o->tail = b;
 
-      update[i]->next[i] = update[i]->next[i]->next[i];
-      i++;
-    }
+  return b;
+}
 
-    while ( m->height > 0 && !m->head->next[m->height-1] ) {
-      (m->height)--;
+int output_append (Output* o, const void* p, size_t n)
+{
+  const unsigned char* src = p;
+  OutputBlock* b;
+  size_t chunk;
+
+  while ( n ) {
+    b = output_tail(o);
+    if ( !b ) {
+      return -1;
     }
-
-    map_node_destroy(del);
+    chunk = OUTPUT_BLOCK_SIZE - b->len;
+    chunk = chunk < n ? chunk : n;
+    memcpy(b->data + b->len, src, chunk);
+    b->len += chunk;
+    o->len += chunk;
+    src += chunk;
+    n -= chunk;
   }
+
   return 0;
 }
 
-int map_set (map_t* m, const char* k, void* v)
+int output_printf (Output* o, const char* fmt, ...)
 {
-  int klen = strlen(k);
-  int vlen = strlen(v);
-  int h = m->height;
-  map_node_t* update[MAX];
-  map_node_t* iter = m->head;
-  map_node_t* n;
-
-  while ( --h >= 0 ) {
-    while ( iter->next[h] && nuonStrncmp((unsigned char *)k, iter->next[h]->key) < 0 ) {
-      iter = iter->next[h];
+  OutputBlock* b = o->tail;
+  va_list ap;
+  char* tmp;
+  int n, r;
+
+  /* format straight into the tail block when it fits */
+  if ( b && b->len < OUTPUT_BLOCK_SIZE ) {
+    va_start(ap, fmt);
+    n = vsnprintf((char *)b->data + b->len, OUTPUT_BLOCK_SIZE - b->len, fmt, ap);
+    va_end(ap);
+    if ( n < 0 ) {
+      return -1;
+    }
+    if ( (size_t)n < OUTPUT_BLOCK_SIZE - b->len ) {
+      b->len += n;
+      o->len += n;
+      return 0;
+    }
+  } else {
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if ( n < 0 ) {
+      return -1;
     }
-
-    update[h] = iter;
-  }
-
-  if ( iter->next[0] && !nuonStrncmp((unsigned char *)k, iter->next[0]->key) ) {
-    free(iter->next[0]->data);
-    iter->next[0]->data = v;
-    return 1;
   }
 
-  h = height();
+  tmp = malloc(n + 1);
 
-  if (h > m->height) {
-    h = ++(m->height);
-    update[h-1] = m->head;
+  if ( !tmp ) {
+    return -1;
   }
 
-  n = map_node_init(h, k, v);
-
-  if ( !n ) {
-    return 0;
-  }
+  va_start(ap, fmt);
+  vsnprintf(tmp, n + 1, fmt, ap);
+  va_end(ap);
 
-  while ( --h >= 0 ) {
-    n->next[h] = update[h]->next[h];
-    update[h]->next[h] = n;
-  }
+  r = output_append(o, tmp, n);
+  free(tmp);
 
-  return 1;
+  return r;
 }
 
-void* map_get (map_t* m, const char* k)
+/* drop n bytes from the head of the chain */
+void output_consume (Output* o, size_t n)
 {
-  map_node_t* iter = m->head;
-  int h = m->height;
-  int klen = strlen(k);
+  OutputBlock* b;
+  size_t chunk;
+
+  while ( n && o->head ) {
+    b = o->head;
+    chunk = b->len - b->off;
+    chunk = chunk < n ? chunk : n;
+    b->off += chunk;
+    o->len -= chunk;
+    n -= chunk;
+
+    if ( b->off < b->len ) {
+      continue;
+    }
 
-  while (--h >= 0) {
-    while ( iter->next[h] && nuonStrncmp((unsigned char *)k, iter->next[h]->key) < 0 ) {
-      iter = iter->next[h];
+    if ( !b->next ) {
+      /* last block, write into it again from the start */
+      b->len = 0;
+      b->off = 0;
+      continue;
     }
-  }
 
-  if ( !iter->next[0] || nuonStrncmp((unsigned char *)k, iter->next[0]->key) != 0 ) {
-    return NULL;
+    o->head = b->next;
+    if ( o->spare ) {
+      free(b);
+    } else {
+      o->spare = b;
+    }
   }
-
-  return iter->next[0]->data;
 }
 
-void map_iter (map_t* m, void (*on_iter)(map_node_t*))
+void output_free (Output* o)
 {
-  /* iterate through the map and call a callback on each iteration */
-  map_node_t* ptr = m->head;
+  OutputBlock* b;
 
-  while ( ptr ) {
-    (*on_iter)(ptr);
-    ptr = ptr->next[0];
+  while ( o->head ) {
+    b = o->head;
+    o->head = b->next;
+    free(b);
   }
 
-  return;
+  free(o->spare);
+  output_init(o);
 }
 
-void map_node_destroy (map_node_t* n)
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+void* arena_alloc (Arena* a, size_t n)
 {
-  if ( !n ) {
-    return;
-  }
+  ArenaBlock* b = a->head;
+  size_t size;
+  void* p;
 
-  if ( n->key ) {
-    free(n->key);
-  }
+  n = ARENA_ALIGN(n);
 
-  /* data should be freed by host */
+  if ( !b || b->used + n > b->size ) {
+    size = n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+    b = malloc(sizeof(ArenaBlock) + size);
 
-  if ( n->next ) {
-    free(n->next);
+    if ( !b ) {
+      return NULL;
+    }
+
+    b->size = size;
+    b->used = 0;
+    b->next = a->head;
+    a->head = b;
   }
 
-  free(n);
+  p = b->data + b->used;
+  b->used += n;
+
+  return p;
 }
 
-int height ()
+/* release everything but the oldest block, which is kept for the next
+   query */
+void arena_reset (Arena* a)
 {
-  static int bits = 0;
-  static int reset = 0;
-
-  int h, found = 0;
-
-  for ( h = 0; !found; h++ ) {
-    if ( reset == 0 ) {
-      bits = rand();
-      reset = MAX;
-    }
+  ArenaBlock* b;
 
-    found = bits & 1;
-    bits = bits >> 1;
-    --reset;
+  if ( !a->head ) {
+    return;
   }
 
-  if ( h >= MAX ) {
-    h = MAX - 1;
+  while ( a->head->next ) {
+    b = a->head;
+    a->head = b->next;
+    free(b);
   }
 
-  return h;
+  a->head->used = 0;
 }
 
-Property* property_init (unsigned char*, unsigned char*);
-void property_destroy (Property*);
-void vertex_destroy (Vertex*);
-Edge* edge_init (Vertex*, Vertex*, unsigned char*);
-VertexContainer* graph_vertexContainerInit (Vertex* vertex);
-
-Graph* graph_init (uint64 size)
+void arena_free (Arena* a)
 {
-  Graph* g = malloc(sizeof(Graph));
+  ArenaBlock* b;
 
-  if ( !g ) {
-    return NULL;
+  while ( a->head ) {
+    b = a->head;
+    a->head = b->next;
+    free(b);
   }
+}
 
-  g->vertices = map_init();
+map_t* map_init ()
+{
+  map_t* m = malloc(sizeof(map_t));
 
-  if ( !g->vertices ) {
-    free(g);
-    return NULL;
+  if ( m ) {
+    memset(m, 0, sizeof(map_t));
+    m->height = 0;
+    m->head = map_node_init(NULL, MAP_HEAD_LEVELS, NULL, 0, 0, NULL);
+    if ( !m->head ) {
+      free(m);
+      return NULL;
+    }
   }
 
-  return g;
+  return m;
 }
 
-Vertex* graph_vertexInit (void)
+/* fnv-1a with a final avalanche so both the slot (high bits) and the
+   control byte (low 7 bits) are well mixed */
+static uint64 map_hash (const unsigned char* k, size_t klen)
 {
-  Vertex* v = malloc(sizeof(Vertex));
+  uint64 h = 14695981039346656037ULL;
+  size_t i;
 
-  if ( !v ) {
-    return NULL;
+  for ( i = 0; i < klen; i++ ) {
+    h ^= k[i];
+    h *= 1099511628211ULL;
   }
 
-  v->idx = 0;
-  v->edges = NULL;
-  v->properties = NULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
 
-  return v;
+  return h;
 }
 
-Property* property_init (unsigned char* key, unsigned char* val)
+/* orders like nuonStrncmp, without rescanning either key */
+static int map_cmp (const unsigned char* k, size_t klen, map_node_t* n)
 {
-  Property* p = malloc(sizeof(Property));
-  int kl = strlen((const char *)key);
-  int vl = strlen((const char *)val);
+  size_t l = klen < n->klen ? klen : n->klen;
+  int res = memcmp(k, MAP_NODE_KEY(n), l);
+  return (res ? res : klen == n->klen ? 0 : klen < n->klen ? -1 : 1);
+}
 
-  if ( !p ) {
-    return NULL;
+/* bitmask of the control bytes in a group equal to b */
+static unsigned int map_match (const unsigned char* group, unsigned char b)
+{
+#ifdef __SSE2__
+  __m128i g = _mm_loadu_si128((const __m128i *)group);
+  return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)b)));
+#else
+  unsigned int mask = 0;
+  int i;
+
+  for ( i = 0; i < MAP_GROUP; i++ ) {
+    if ( group[i] == b ) {
+      mask |= 1u << i;
+    }
   }
 
-  p->key = malloc(kl + 1);
+  return mask;
+#endif
+}
 
-  if ( !p->key ) {
-    free(p);
-    return NULL;
-  }
+/* first group of the probe sequence, groups are probed triangularly so
+   every group is visited once the table wraps */
+static size_t map_index_start (map_index_t* ix, uint64 hash)
+{
+  return (size_t)(hash >> 7) & (ix->cap - 1) & ~(size_t)(MAP_GROUP - 1);
+}
 
-  p->val = malloc(vl + 1);
+/* slot holding key k, or -1 */
+static long map_index_slot (map_index_t* ix, const unsigned char* k, size_t klen, uint64 hash)
+{
+  size_t pos, step = 0;
+  unsigned int mask;
+  map_node_t* n;
+  int bit;
 
-  if ( !p->val ) {
-    free(p->key);
-    free(p);
-    return NULL;
+  if ( !ix->cap ) {
+    return -1;
   }
 
-  strncpy((char *)p->key, (char *)key, kl);
-  strncpy((char *)p->val, (char *)val, vl);
+  pos = map_index_start(ix, hash);
+
+  for ( ;; ) {
+    mask = map_match(ix->ctrl + pos, hash & 0x7f);
+
+    while ( mask ) {
+      bit = __builtin_ctz(mask);
+      n = ix->slots[pos + bit];
+      if ( n->hash == hash && n->klen == klen && !memcmp(MAP_NODE_KEY(n), k, klen) ) {
+        return (long)(pos + bit);
+      }
+      mask &= mask - 1;
+    }
 
-  p->key[kl] = 0;
-  p->val[vl] = 0;
+    if ( map_match(ix->ctrl + pos, MAP_EMPTY) ) {
+      return -1;
+    }
 
-  p->next = NULL;
+    step += MAP_GROUP;
+    pos = (pos + step) & (ix->cap - 1);
+  }
+}
 
-  return p;
+static map_node_t* map_index_find (map_index_t* ix, const unsigned char* k, size_t klen, uint64 hash)
+{
+  long i = map_index_slot(ix, k, klen, hash);
+  return (i < 0 ? NULL : ix->slots[i]);
 }
 
-Edge* edge_init (Vertex* from, Vertex* to, unsigned char* label)
+/* caller has made sure the node is not indexed yet and there is room */
+static void map_index_insert (map_index_t* ix, map_node_t* n)
 {
-  Edge* e = malloc(sizeof(Edge));
-  int len = strlen((const char *)label);
+  size_t pos = map_index_start(ix, n->hash), step = 0;
+  unsigned int mask;
 
-  if ( !e ) {
-    return NULL;
+  for ( ;; ) {
+    mask = map_match(ix->ctrl + pos, MAP_EMPTY) | map_match(ix->ctrl + pos, MAP_DELETED);
+    if ( mask ) {
+      break;
+    }
+    step += MAP_GROUP;
+    pos = (pos + step) & (ix->cap - 1);
   }
 
-  e->label = malloc(len + 1);
+  pos += __builtin_ctz(mask);
 
-  if ( !e->label ) {
-    free(e);
-    return NULL;
+  if ( ix->ctrl[pos] == MAP_EMPTY ) {
+    ix->used++;
   }
 
-  strncpy((char *)e->label, (char *)label, len);
-  e->label[len] = 0;
-
-  e->from = from;
-  e->to = to;
-  e->next = NULL;
-
-  return e;
+  ix->ctrl[pos] = n->hash & 0x7f;
+  ix->slots[pos] = n;
+  ix->count++;
 }
 
-void property_destroy (Property* property)
+static void map_index_erase (map_index_t* ix, map_node_t* n)
 {
-  if ( !property ) {
+  long i = map_index_slot(ix, MAP_NODE_KEY(n), n->klen, n->hash);
+  size_t group;
+
+  if ( i < 0 ) {
     return;
   }
 
-  if (property->key) {
-    free(property->key);
-  }
+  /* a probe never continues past a group with an empty slot, so the slot
+     can be emptied outright instead of leaving a tombstone */
+  group = (size_t)i & ~(size_t)(MAP_GROUP - 1);
 
-  if (property->val) {
-    free(property->val);
+  if ( map_match(ix->ctrl + group, MAP_EMPTY) ) {
+    ix->ctrl[i] = MAP_EMPTY;
+    ix->used--;
+  } else {
+    ix->ctrl[i] = MAP_DELETED;
   }
 
-  free(property);
+  ix->slots[i] = NULL;
+  ix->count--;
 }
 
-void vertex_destroy (Vertex* vertex)
+/* make room for one more node, keeping the table at most 7/8 full.
+   tombstones are dropped by rehashing, growing only when live nodes
+   need it */
+static int map_index_reserve (map_index_t* ix)
 {
-  Property* piter;
-  Edge* eiter;
-  Property* pdel = NULL;
-  Edge* edel = NULL;
+  map_index_t old = *ix;
+  size_t cap, i;
 
-  if ( !vertex ) {
-    return;
+  if ( (ix->used + 1) * 8 <= ix->cap * 7 ) {
+    return 0;
   }
 
-  piter = vertex->properties;
-  eiter = vertex->edges;
+  cap = ix->cap ? ix->cap : MAP_GROUP;
 
-  while (piter) {
-    pdel = piter;
-    piter = piter->next;
-    property_destroy(pdel);
+  if ( (ix->count + 1) * 16 > cap * 7 ) {
+    cap *= 2;
   }
 
-  while (eiter) {
-    edel = eiter;
-    eiter = eiter->next;
-    free(edel);
-  }
+  ix->ctrl = malloc(cap);
+  ix->slots = malloc(sizeof(map_node_t*) * cap);
 
-  free(vertex);
-}
+  if ( !ix->ctrl || !ix->slots ) {
+    free(ix->ctrl);
+    free(ix->slots);
+    *ix = old;
+    return -1;
+  }
 
-Vertex* graph_setVertex (Graph* graph, unsigned char* key, Vertex* vertex)
-{
-  Vertex* v;
+  memset(ix->ctrl, MAP_EMPTY, cap);
+  ix->cap = cap;
+  ix->used = 0;
+  ix->count = 0;
 
-  if ( vertex ) {
-    v = vertex;
-  } else {
-    v = graph_vertexInit();
+  for ( i = 0; i < old.cap; i++ ) {
+    if ( !(old.ctrl[i] & 0x80) ) {
+      map_index_insert(ix, old.slots[i]);
+    }
   }
 
-  map_set(graph->vertices, (const char *)key, v);
+  free(old.ctrl);
+  free(old.slots);
 
-  return v;
+  return 0;
 }
 
-Vertex* graph_getVertex (Graph* graph, unsigned char* key)
+static size_t map_node_size (int height, size_t klen)
 {
-  Vertex* v = (Vertex *)map_get(graph->vertices, (const char *)key);
-  
-  if ( v ) {
-    return v;
-  }
-
-  return NULL;
+  size_t size = sizeof(map_node_t) + sizeof(map_node_t*) * height + klen + 1;
+  return (size + MAP_CLASS - 1) & ~(size_t)(MAP_CLASS - 1);
 }
 
-void graph_removeVertex (Graph* graph, unsigned char* key)
+/* take a block of size bytes (a multiple of MAP_CLASS) from the free list
+   of its size, or from the current slab */
+static void* map_alloc (map_t* m, size_t size)
 {
-  map_remove(graph->vertices, (const char*)key);
-}
+  size_t c = size / MAP_CLASS - 1;
+  map_slab_t* s;
+  void* p;
 
-void graph_vertexAddEdge (Vertex* from, Vertex* to, unsigned char* label)
-{
-  Edge* iter = from->edges;
+  if ( c >= MAP_CLASSES ) {
+    return malloc(size);
+  }
 
-  if ( !iter ) {
-    from->edges = edge_init(from, to, label);
-    return;
+  if ( (p = m->free[c]) ) {
+    m->free[c] = *(void **)p;
+    return p;
   }
 
-  while ( iter->next ) {
-    iter = iter->next;
+  /* the tail of the old slab is given up, it is smaller than a class */
+  if ( m->left < size ) {
+    s = malloc(MAP_SLAB_SIZE);
+    if ( !s ) {
+      return NULL;
+    }
+    s->next = m->slabs;
+    m->slabs = s;
+    m->bump = (char *)s + MAP_CLASS;
+    m->left = MAP_SLAB_SIZE - MAP_CLASS;
   }
 
-  iter->next = edge_init(from, to, label);
-  return;
-}
+  p = m->bump;
+  m->bump += size;
+  m->left -= size;
 
-void graph_vertexRemoveEdge (Vertex* vertex, unsigned char* label)
-{
-  /* remove either a single instance of the edge, or all the instances */
-  /* maybe give the option, or have the user specify a count */
-  return;
+  return p;
 }
 
-void graph_vertexSetProperty (Vertex* vertex, unsigned char* key, unsigned char* val)
+static void map_release (map_t* m, void* p, size_t size)
 {
-  Property* iter = vertex->properties;
-  int exists = 0;
-  int kl = strlen((const char *)key);
+  size_t c = size / MAP_CLASS - 1;
 
-  if ( !iter ) {
-    vertex->properties = property_init(key, val);
+  if ( c >= MAP_CLASSES ) {
+    free(p);
     return;
   }
 
-  while (iter->next) {
-    if (!nuonStrncmp(iter->next->key, key)) {
-      exists = 1;
-      break;
+  *(void **)p = m->free[c];
+  m->free[c] = p;
+}
+
+/* initialize a node, the head of a list (m == NULL) is malloc'd on its own
+   so its tower can grow */
+map_node_t* map_node_init (map_t* m, int height, const char* k, size_t klen, uint64 hash, void* v)
+{
+  size_t size = map_node_size(height, klen);
+  map_node_t* n = m ? map_alloc(m, size) : malloc(size);
+  int i;
+
+  if ( n ) {
+    n->data = v;
+    n->klen = (unsigned int)klen;
+    n->hash = hash;
+    n->height = height;
+
+    for ( i = 0; i < height; i++ ) {
+      n->next[i] = NULL;
     }
-    iter = iter->next;
-  }
 
-  if (exists) {
-    Property* del = iter->next;
-    iter->next = del->next;
-    property_destroy(del);
-  } else {
-    if (!nuonStrncmp(iter->key, key)) {
-      vertex->properties = property_init(key, val);
-      vertex->properties->next = iter->next;
-      property_destroy(iter);
-      return;
+    if ( k ) {
+      memcpy(MAP_NODE_KEY(n), k, klen);
     }
+    MAP_NODE_KEY(n)[klen] = 0;
   }
-
-  iter->next = property_init(key, val);
-
-  return;
+  return n;
 }
 
-unsigned char* graph_vertexGetProperty (Vertex* vertex, unsigned char* key)
+/* make room for levels up to h in the head. only the map points at the
+   head, so it can move */
+static int map_growHead (map_t* m, int h)
 {
-  Property* iter = vertex->properties;
-  int kl = strlen((const char *)key);
+  map_node_t* head;
+  int n = m->head->height, i;
 
-  while ( iter ) {
-    if (!nuonStrncmp(iter->key, key)) {
-      break;
-    }
-    iter = iter->next;
+  if ( h <= n ) {
+    return 0;
   }
 
-  if ( iter ) {
-    return iter->val;
+  while ( n < h ) {
+    n *= 2;
   }
 
-  return NULL;
+  if ( n > MAX ) {
+    n = MAX;
+  }
+
+  head = realloc(m->head, map_node_size(n, 0));
+
+  if ( !head ) {
+    return -1;
+  }
+
+  for ( i = head->height; i < n; i++ ) {
+    head->next[i] = NULL;
+  }
+
+  head->height = n;
+  MAP_NODE_KEY(head)[0] = 0;
+  m->head = head;
+
+  return 0;
 }
 
-void graph_vertexRemoveProperty (Vertex* vertex, unsigned char* key)
+int map_remove (map_t* m, const char* k)
 {
-  Property *iter, *del = NULL;
-  int kl = strlen((const char *)key);
+  size_t klen = strlen(k);
+  int h = m->height;
+  int i = 0;
+  map_node_t* update[MAX];
+  map_node_t* iter = m->head;
+  map_node_t* del;
 
-  if ( !vertex->properties ) {
-    return;
+  del = map_index_find(&m->index, (const unsigned char *)k, klen, map_hash((const unsigned char *)k, klen));
+
+  if ( !del ) {
+    return 0;
   }
 
-  iter = vertex->properties;
+  while ( --h >= 0 ) {
+    while ( iter->next[h] && map_cmp((const unsigned char *)k, klen, iter->next[h]) < 0 ) {
+      iter = iter->next[h];
+    }
 
-  /* if it's the first one to be deleted */
-  if ( !nuonStrncmp(iter->key, key)) {
-    del = iter;
-    vertex->properties = iter->next;
-    property_destroy(del);
-    return;
+    update[h] = iter;
   }
 
-  while ( iter->next ) {
-    if ( !nuonStrncmp(iter->next->key, key) ) {
+  h = m->height;
+
+  while ( i < h ) {
+    if ( update[i]->next[i] != del ) {
       break;
     }
-    iter = iter->next;
+
+    update[i]->next[i] = del->next[i];
+    i++;
   }
 
-  if ( iter->next ) {
-    del = iter->next;
-    iter->next = del->next;
-    property_destroy(del);
+  while ( m->height > 0 && !m->head->next[m->height-1] ) {
+    (m->height)--;
   }
 
-  return;
-}
+  map_index_erase(&m->index, del);
+  map_node_destroy(m, del);
 
-VertexContainer* graph_vertexContainerInit (Vertex* vertex)
+  return 0;
+}
+
+int map_set (map_t* m, const char* k, void* v)
+{
+  size_t klen = strlen(k);
+  uint64 hash = map_hash((const unsigned char *)k, klen);
+  int h, nh;
+  map_node_t* update[MAX];
+  map_node_t* iter;
+  map_node_t* n;
+
+  n = map_index_find(&m->index, (const unsigned char *)k, klen, hash);
+
+  if ( n ) {
+    n->data = v;
+    return 1;
+  }
+
+  if ( map_index_reserve(&m->index) ) {
+    return 0;
+  }
+
+  /* growing may move the head, so it happens before the search */
+  nh = height();
+
+  if ( nh > m->height ) {
+    if ( map_growHead(m, m->height + 1) ) {
+      return 0;
+    }
+    nh = ++(m->height);
+  }
+
+  h = m->height;
+  iter = m->head;
+
+  while ( --h >= 0 ) {
+    while ( iter->next[h] && map_cmp((const unsigned char *)k, klen, iter->next[h]) < 0 ) {
+      iter = iter->next[h];
+    }
+
+    update[h] = iter;
+  }
+
+  h = nh;
+  n = map_node_init(m, h, k, klen, hash, v);
+
+  if ( !n ) {
+    return 0;
+  }
+
+  while ( --h >= 0 ) {
+    n->next[h] = update[h]->next[h];
+    update[h]->next[h] = n;
+  }
+
+  map_index_insert(&m->index, n);
+
+  return 1;
+}
+
+/* point lookups go through the hash index, the list is only walked by
+   ordered scans */
+void* map_get (map_t* m, const char* k)
+{
+  size_t klen = strlen(k);
+  map_node_t* n;
+
+  n = map_index_find(&m->index, (const unsigned char *)k, klen, map_hash((const unsigned char *)k, klen));
+
+  return (n ? n->data : NULL);
+}
+
+void map_iter (map_t* m, void (*on_iter)(map_node_t*))
+{
+  /* iterate through the map and call a callback on each iteration */
+  map_node_t* ptr = m->head;
+
+  while ( ptr ) {
+    (*on_iter)(ptr);
+    ptr = ptr->next[0];
+  }
+
+  return;
+}
+
+void map_node_destroy (map_t* m, map_node_t* n)
+{
+  if ( !n ) {
+    return;
+  }
+
+  /* data should be freed by host */
+
+  map_release(m, n, map_node_size(n->height, n->klen));
+}
+
+/* xorshift64* with its state per thread, so towers can be drawn from
+   any worker without sharing (or racing on) one generator */
+static __thread uint64 rng_state;
+
+static uint64 rng_next ()
+{
+  uint64 x = rng_state;
+
+  if ( !x ) {
+    /* the address of the state differs per thread */
+    x = ((uint64)(size_t)&rng_state * 0x9e3779b97f4a7c15ULL) | 1;
+  }
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  rng_state = x;
+
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* every level above the first is kept with probability
+   1 / 2^MAP_BRANCH_BITS, drawing MAP_BRANCH_BITS random bits per level */
+int height ()
+{
+  uint64 bits = rng_next();
+  int left = 64, h = 1;
+
+  while ( h < MAX - 1 ) {
+    if ( left < MAP_BRANCH_BITS ) {
+      bits = rng_next();
+      left = 64;
+    }
+
+    if ( bits & ((1u << MAP_BRANCH_BITS) - 1) ) {
+      break;
+    }
+
+    bits >>= MAP_BRANCH_BITS;
+    left -= MAP_BRANCH_BITS;
+    h++;
+  }
+
+  return h;
+}
+
+/* process wide table of interned strings (labels, property keys, edge
+   labels). ids start at 1 and a string keeps its id for the life of the
+   process, so names can be read without the lock once an id is known */
+static struct {
+  pthread_rwlock_t lock;
+  map_t* ids;
+  unsigned char** names[SYM_CHUNKS];
+  sym_t count;
+} symtab = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+sym_t sym_lookup (const unsigned char* s)
+{
+  void* id = NULL;
+
+  pthread_rwlock_rdlock(&symtab.lock);
+  if ( symtab.ids ) {
+    id = map_get(symtab.ids, (const char *)s);
+  }
+  pthread_rwlock_unlock(&symtab.lock);
+
+  return (sym_t)(size_t)id;
+}
+
+/* called with the table locked for writing */
+static sym_t sym_add (const unsigned char* s)
+{
+  sym_t id = symtab.count + 1;
+  unsigned char*** chunk = &symtab.names[id >> SYM_CHUNK_BITS];
+  size_t len = strlen((const char *)s);
+  unsigned char* name;
+
+  if ( !symtab.ids && !(symtab.ids = map_init()) ) {
+    return SYM_NONE;
+  }
+
+  if ( (id >> SYM_CHUNK_BITS) >= SYM_CHUNKS ) {
+    return SYM_NONE;
+  }
+
+  if ( !*chunk && !(*chunk = malloc(sizeof(unsigned char*) * SYM_CHUNK)) ) {
+    return SYM_NONE;
+  }
+
+  name = malloc(len + 1);
+
+  if ( !name ) {
+    return SYM_NONE;
+  }
+
+  memcpy(name, s, len + 1);
+
+  if ( !map_set(symtab.ids, (const char *)s, (void *)(size_t)id) ) {
+    free(name);
+    return SYM_NONE;
+  }
+
+  (*chunk)[id & (SYM_CHUNK - 1)] = name;
+  symtab.count = id;
+
+  return id;
+}
+
+sym_t sym_intern (const unsigned char* s)
+{
+  sym_t id = sym_lookup(s);
+
+  if ( id ) {
+    return id;
+  }
+
+  pthread_rwlock_wrlock(&symtab.lock);
+
+  /* another writer may have added it since the lookup */
+  if ( symtab.ids ) {
+    id = (sym_t)(size_t)map_get(symtab.ids, (const char *)s);
+  }
+
+  if ( !id ) {
+    id = sym_add(s);
+  }
+
+  pthread_rwlock_unlock(&symtab.lock);
+
+  return id;
+}
+
+const unsigned char* sym_name (sym_t id)
+{
+  return symtab.names[id >> SYM_CHUNK_BITS][id & (SYM_CHUNK - 1)];
+}
+
+/* roaring style bitmaps: values are split on their high 16 bits into
+   containers, each a sorted array of the low halves or, once that would
+   pass BITMAP_ARRAY_MAX values, a bitset of all 65536 */
+void bitmap_init (Bitmap* b)
+{
+  b->containers = NULL;
+  b->len = 0;
+  b->cap = 0;
+}
+
+static void container_free (BitmapContainer* c)
+{
+  free(c->array);
+  free(c->bits);
+  c->array = NULL;
+  c->bits = NULL;
+  c->card = 0;
+  c->cap = 0;
+}
+
+void bitmap_free (Bitmap* b)
+{
+  unsigned int i;
+
+  for ( i = 0; i < b->len; i++ ) {
+    container_free(&b->containers[i]);
+  }
+
+  free(b->containers);
+  bitmap_init(b);
+}
+
+/* first position in a sorted array that is not below v */
+static unsigned int array_lower (const unsigned short* a, unsigned int n, unsigned short v)
+{
+  unsigned int lo = 0, hi = n, mid;
+
+  while ( lo < hi ) {
+    mid = lo + (hi - lo) / 2;
+    if ( a[mid] < v ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/* first container whose key is not below key */
+static unsigned int bitmap_lower (const Bitmap* b, unsigned int key)
+{
+  unsigned int lo = 0, hi = b->len, mid;
+
+  while ( lo < hi ) {
+    mid = lo + (hi - lo) / 2;
+    if ( b->containers[mid].key < key ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+static int container_toBits (BitmapContainer* c)
+{
+  uint64* bits = calloc(BITMAP_WORDS, sizeof(uint64));
+  unsigned int i;
+
+  if ( !bits ) {
+    return -1;
+  }
+
+  for ( i = 0; i < c->card; i++ ) {
+    bits[c->array[i] >> 6] |= 1ULL << (c->array[i] & 63);
+  }
+
+  free(c->array);
+  c->array = NULL;
+  c->cap = 0;
+  c->bits = bits;
+
+  return 0;
+}
+
+static int container_toArray (BitmapContainer* c)
+{
+  unsigned short* array = malloc(sizeof(unsigned short) * (c->card ? c->card : 1));
+  unsigned int w, n = 0;
+  uint64 word;
+
+  if ( !array ) {
+    return -1;
+  }
+
+  for ( w = 0; w < BITMAP_WORDS; w++ ) {
+    for ( word = c->bits[w]; word; word &= word - 1 ) {
+      array[n++] = (w << 6) | __builtin_ctzll(word);
+    }
+  }
+
+  free(c->bits);
+  c->bits = NULL;
+  c->array = array;
+  c->cap = c->card ? c->card : 1;
+
+  return 0;
+}
+
+/* 1 if added, 0 if it was there, -1 when out of memory */
+static int container_add (BitmapContainer* c, unsigned short low)
+{
+  unsigned short* array;
+  unsigned int i, cap;
+  uint64 bit = 1ULL << (low & 63);
+
+  if ( c->bits ) {
+    if ( c->bits[low >> 6] & bit ) {
+      return 0;
+    }
+    c->bits[low >> 6] |= bit;
+    c->card++;
+    return 1;
+  }
+
+  i = array_lower(c->array, c->card, low);
+
+  if ( i < c->card && c->array[i] == low ) {
+    return 0;
+  }
+
+  if ( c->card == BITMAP_ARRAY_MAX ) {
+    return container_toBits(c) ? -1 : container_add(c, low);
+  }
+
+  if ( c->card == c->cap ) {
+    cap = c->cap ? c->cap * 2 : 4;
+    cap = cap > BITMAP_ARRAY_MAX ? BITMAP_ARRAY_MAX : cap;
+    array = realloc(c->array, sizeof(unsigned short) * cap);
+    if ( !array ) {
+      return -1;
+    }
+    c->array = array;
+    c->cap = cap;
+  }
+
+  memmove(&c->array[i + 1], &c->array[i], sizeof(unsigned short) * (c->card - i));
+  c->array[i] = low;
+  c->card++;
+
+  return 1;
+}
+
+/* 1 if removed, 0 if it wasn't there */
+static int container_remove (BitmapContainer* c, unsigned short low)
+{
+  uint64 bit = 1ULL << (low & 63);
+  unsigned int i;
+
+  if ( c->bits ) {
+    if ( !(c->bits[low >> 6] & bit) ) {
+      return 0;
+    }
+    c->bits[low >> 6] &= ~bit;
+    c->card--;
+    /* a failed conversion just leaves it a bitset. going back only well
+       below the switch keeps a set that hovers around it from flipping */
+    if ( c->card < BITMAP_ARRAY_MIN ) {
+      container_toArray(c);
+    }
+    return 1;
+  }
+
+  i = array_lower(c->array, c->card, low);
+
+  if ( i == c->card || c->array[i] != low ) {
+    return 0;
+  }
+
+  memmove(&c->array[i], &c->array[i + 1], sizeof(unsigned short) * (c->card - i - 1));
+  c->card--;
+
+  return 1;
+}
+
+static int container_contains (const BitmapContainer* c, unsigned short low)
+{
+  unsigned int i;
+
+  if ( c->bits ) {
+    return (c->bits[low >> 6] >> (low & 63)) & 1;
+  }
+
+  i = array_lower(c->array, c->card, low);
+
+  return (i < c->card && c->array[i] == low);
+}
+
+/* make room for a container at position i */
+static BitmapContainer* bitmap_insertAt (Bitmap* b, unsigned int i, unsigned int key)
+{
+  BitmapContainer* containers;
+  unsigned int cap;
+
+  if ( b->len == b->cap ) {
+    cap = b->cap ? b->cap * 2 : 4;
+    containers = realloc(b->containers, sizeof(BitmapContainer) * cap);
+    if ( !containers ) {
+      return NULL;
+    }
+    b->containers = containers;
+    b->cap = cap;
+  }
+
+  memmove(&b->containers[i + 1], &b->containers[i], sizeof(BitmapContainer) * (b->len - i));
+  b->len++;
+
+  b->containers[i].key = key;
+  b->containers[i].card = 0;
+  b->containers[i].cap = 0;
+  b->containers[i].array = NULL;
+  b->containers[i].bits = NULL;
+
+  return &b->containers[i];
+}
+
+static void bitmap_removeAt (Bitmap* b, unsigned int i)
+{
+  container_free(&b->containers[i]);
+  memmove(&b->containers[i], &b->containers[i + 1], sizeof(BitmapContainer) * (b->len - i - 1));
+  b->len--;
+}
+
+int bitmap_add (Bitmap* b, unsigned int v)
+{
+  unsigned int i = bitmap_lower(b, v >> 16);
+  BitmapContainer* c;
+
+  if ( i < b->len && b->containers[i].key == v >> 16 ) {
+    c = &b->containers[i];
+  } else if ( !(c = bitmap_insertAt(b, i, v >> 16)) ) {
+    return -1;
+  }
+
+  if ( container_add(c, v & 0xffff) < 0 ) {
+    if ( !c->card ) {
+      bitmap_removeAt(b, i);
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+void bitmap_remove (Bitmap* b, unsigned int v)
+{
+  unsigned int i = bitmap_lower(b, v >> 16);
+
+  if ( i == b->len || b->containers[i].key != v >> 16 ) {
+    return;
+  }
+
+  if ( container_remove(&b->containers[i], v & 0xffff) && !b->containers[i].card ) {
+    bitmap_removeAt(b, i);
+  }
+}
+
+int bitmap_contains (const Bitmap* b, unsigned int v)
+{
+  unsigned int i = bitmap_lower(b, v >> 16);
+
+  if ( i == b->len || b->containers[i].key != v >> 16 ) {
+    return 0;
+  }
+
+  return container_contains(&b->containers[i], v & 0xffff);
+}
+
+unsigned int bitmap_count (const Bitmap* b)
+{
+  unsigned int i, n = 0;
+
+  for ( i = 0; i < b->len; i++ ) {
+    n += b->containers[i].card;
+  }
+
+  return n;
+}
+
+void bitmap_iterInit (BitmapIter* it, const Bitmap* b)
+{
+  it->b = b;
+  it->c = 0;
+  it->i = 0;
+}
+
+/* decode up to n values into buf in ascending order, returns how many */
+unsigned int bitmap_iterRead (BitmapIter* it, unsigned int* buf, unsigned int n)
+{
+  const BitmapContainer* c;
+  unsigned int k = 0, i = it->i, base, card;
+  uint64 word;
+
+  /* position kept in locals, stores to buf could alias the iterator */
+  while ( k < n && it->c < it->b->len ) {
+    c = &it->b->containers[it->c];
+    base = c->key << 16;
+
+    if ( !c->bits ) {
+      card = c->card;
+      while ( k < n && i < card ) {
+        buf[k++] = base | c->array[i++];
+      }
+    } else {
+      /* whole words at a time, i only lands mid word when buf fills */
+      while ( k < n && i < BITMAP_WORDS * 64 ) {
+        word = c->bits[i >> 6] & (~0ULL << (i & 63));
+        while ( word && k < n ) {
+          buf[k++] = base | (i & ~63u) | __builtin_ctzll(word);
+          word &= word - 1;
+        }
+        i = word ? (i & ~63u) | __builtin_ctzll(word) : (i | 63) + 1;
+      }
+    }
+
+    if ( k < n ) {
+      it->c++;
+      i = 0;
+    }
+  }
+
+  it->i = i;
+
+  return k;
+}
+
+/* move the iterator forward to the first value >= v. it never moves back,
+   so a seek behind the current position does nothing */
+void bitmap_iterSeek (BitmapIter* it, unsigned int v)
+{
+  const BitmapContainer* c;
+  unsigned int key = v >> 16, low = v & 0xffff, lo, hi, mid;
+
+  while ( it->c < it->b->len && it->b->containers[it->c].key < key ) {
+    it->c++;
+    it->i = 0;
+  }
+
+  if ( it->c == it->b->len || it->b->containers[it->c].key > key ) {
+    return;
+  }
+
+  c = &it->b->containers[it->c];
+
+  if ( c->bits ) {
+    it->i = it->i > low ? it->i : low;
+    return;
+  }
+
+  /* first array slot holding low or more */
+  lo = it->i;
+  hi = c->card;
+  while ( lo < hi ) {
+    mid = lo + (hi - lo) / 2;
+    if ( c->array[mid] < low ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  it->i = lo;
+}
+
+/* next value in ascending order, 0 once the bitmap is exhausted */
+int bitmap_iterNext (BitmapIter* it, unsigned int* v)
+{
+  return bitmap_iterRead(it, v, 1);
+}
+
+void vertex_destroy (Vertex*);
+VertexContainer* graph_vertexContainerInit (Arena*, Vertex*);
+
+static int graph_initLocks (Graph* g)
+{
+  pthread_mutex_t* m[] = { &g->vertexlock, &g->labellock, &g->stamplock, &g->statslock, &g->snaplock, &g->gate.lock };
+  int i, n = sizeof(m) / sizeof(m[0]);
+
+  for ( i = 0; i < n && !pthread_mutex_init(m[i], NULL); i++ );
+
+  if ( i == n && !pthread_cond_init(&g->gate.cond, NULL) ) {
+    if ( !pthread_rwlock_init(&g->lock, NULL) ) {
+      return 0;
+    }
+    pthread_cond_destroy(&g->gate.cond);
+  }
+
+  while ( i-- ) {
+    pthread_mutex_destroy(m[i]);
+  }
+
+  return -1;
+}
+
+Graph* graph_init ()
+{
+  Graph* g = malloc(sizeof(Graph));
+
+  if ( !g ) {
+    return NULL;
+  }
+
+  if ( graph_initLocks(g) ) {
+    free(g);
+    return NULL;
+  }
+
+  g->gate.side = GRAPH_READ;
+  g->gate.active = 0;
+  g->gate.waiting[GRAPH_READ] = 0;
+  g->gate.waiting[GRAPH_INGEST] = 0;
+
+  g->chunks = NULL;
+  g->nchunks = 0;
+  g->nvertices = 0;
+  g->labels = NULL;
+  g->nlabels = 0;
+  g->indexes = NULL;
+  g->version = 0;
+  g->stamps = NULL;
+  g->nstamps = 0;
+  g->snapshot = NULL;
+  g->lstats = NULL;
+  g->nlstats = 0;
+  g->estats = NULL;
+  g->nestats = 0;
+  bitmap_init(&g->sorted);
+  bitmap_init(&g->graveyard);
+  bitmap_init(&g->dirty);
+
+  return g;
+}
+
+/* takes the graph lock for reading and passes the gate on the given side.
+   either side may be in any number at a time, and once the other side is
+   waiting no more are let in, so neither starves */
+void graph_lockShared (Graph* g, int side)
+{
+  pthread_rwlock_rdlock(&g->lock);
+  pthread_mutex_lock(&g->gate.lock);
+
+  g->gate.waiting[side]++;
+
+  while ( g->gate.active
+          ? g->gate.side != side || g->gate.waiting[!side]
+          : g->gate.side != side && g->gate.waiting[!side] ) {
+    pthread_cond_wait(&g->gate.cond, &g->gate.lock);
+  }
+
+  g->gate.waiting[side]--;
+  g->gate.side = side;
+  g->gate.active++;
+
+  pthread_mutex_unlock(&g->gate.lock);
+}
+
+void graph_unlockShared (Graph* g)
+{
+  pthread_mutex_lock(&g->gate.lock);
+
+  /* the last one out hands the gate over if the other side is waiting */
+  if ( !--g->gate.active ) {
+    if ( g->gate.waiting[!g->gate.side] ) {
+      g->gate.side = !g->gate.side;
+    }
+    pthread_cond_broadcast(&g->gate.cond);
+  }
+
+  pthread_mutex_unlock(&g->gate.lock);
+  pthread_rwlock_unlock(&g->lock);
+}
+
+/* take the next id, adding a chunk to the vertex table when the last one
+   is full. called with vertexlock held */
+static Vertex* vertex_append (Graph* g)
+{
+  vid_t id = g->nvertices;
+  size_t chunk = id >> VERTEX_CHUNK_BITS;
+  Vertex** chunks;
+  Vertex* v;
+
+  if ( id >= VID_DEAD ) {
+    return NULL;
+  }
+
+  if ( chunk == g->nchunks ) {
+    if ( !(g->nchunks & (g->nchunks - 1)) ) {
+      chunks = realloc(g->chunks, sizeof(Vertex*) * (g->nchunks ? g->nchunks * 2 : 1));
+      if ( !chunks ) {
+        return NULL;
+      }
+      g->chunks = chunks;
+    }
+
+    g->chunks[chunk] = malloc(sizeof(Vertex) * VERTEX_CHUNK);
+
+    if ( !g->chunks[chunk] ) {
+      return NULL;
+    }
+
+    g->nchunks++;
+  }
+
+  v = &g->chunks[chunk][id & (VERTEX_CHUNK - 1)];
+  v->id = id;
+  v->label = SYM_NONE;
+  v->nprops = 0;
+  v->propcap = 0;
+  v->props = NULL;
+  v->adj = NULL;
+  v->nadj = 0;
+  v->in = NULL;
+  v->nin = 0;
+  v->dead = 0;
+
+  g->nvertices++;
+
+  return v;
+}
+
+Vertex* graph_addVertex (Graph* g)
+{
+  Vertex* v;
+
+  pthread_mutex_lock(&g->vertexlock);
+  v = vertex_append(g);
+  pthread_mutex_unlock(&g->vertexlock);
+
+  return v;
+}
+
+Vertex* graph_vertexById (Graph* g, vid_t id)
+{
+  if ( id >= g->nvertices ) {
+    return NULL;
+  }
+
+  return &g->chunks[id >> VERTEX_CHUNK_BITS][id & (VERTEX_CHUNK - 1)];
+}
+
+/* store a copy of val, inline when it is short enough */
+static int property_setVal (Property* p, const unsigned char* val)
+{
+  size_t len = strlen((const char *)val);
+  unsigned char* copy = NULL;
+
+  if ( len >= PROP_INLINE ) {
+    copy = malloc(len + 1);
+    if ( !copy ) {
+      return -1;
+    }
+    memcpy(copy, val, len + 1);
+  }
+
+  if ( p->len >= PROP_INLINE ) {
+    free(p->val.ptr);
+  }
+
+  if ( copy ) {
+    p->val.ptr = copy;
+  } else {
+    memcpy(p->val.buf, val, len + 1);
+  }
+
+  p->len = len;
+
+  return 0;
+}
+
+static Property* vertex_findProperty (Vertex* v, sym_t key)
+{
+  unsigned int i;
+
+  if ( v->propcap > PROP_HASHED ) {
+    for ( i = PROP_SLOT(key, v->propcap); v->props[i].key; i = (i + 1) & (v->propcap - 1) ) {
+      if ( v->props[i].key == key ) {
+        return &v->props[i];
+      }
+    }
+    return NULL;
+  }
+
+  for ( i = 0; i < v->nprops; i++ ) {
+    if ( v->props[i].key == key ) {
+      return &v->props[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* move the properties into cap slots. up to PROP_HASHED slots they are
+   kept in insertion order, past that they are hashed on the key with
+   linear probing and the table is kept at most half full */
+static int vertex_resizeProperties (Vertex* v, unsigned int cap)
+{
+  Property* props = calloc(cap, sizeof(Property));
+  unsigned int i, j;
+
+  if ( !props ) {
+    return -1;
+  }
+
+  if ( cap > PROP_HASHED ) {
+    for ( i = 0; i < v->propcap; i++ ) {
+      if ( !v->props[i].key ) {
+        continue;
+      }
+      for ( j = PROP_SLOT(v->props[i].key, cap); props[j].key; j = (j + 1) & (cap - 1) );
+      props[j] = v->props[i];
+    }
+  } else if ( v->nprops ) {
+    memcpy(props, v->props, sizeof(Property) * v->nprops);
+  }
+
+  free(v->props);
+  v->props = props;
+  v->propcap = cap;
+
+  return 0;
+}
+
+/* append a target to a bucket, opening a bigger block when the tail is
+   full */
+static int adjacency_push (Adjacency* a, vid_t to)
+{
+  AdjBlock* b = a->tail;
+  unsigned int cap;
+
+  if ( !b || b->len == b->cap ) {
+    cap = b ? b->cap * 2 : ADJ_BLOCK_MIN;
+    cap = cap > ADJ_BLOCK_MAX ? ADJ_BLOCK_MAX : cap;
+    b = malloc(sizeof(AdjBlock) + sizeof(vid_t) * cap);
+    if ( !b ) {
+      return -1;
+    }
+    b->next = NULL;
+    b->len = 0;
+    b->cap = cap;
+    if ( a->tail ) {
+      a->tail->next = b;
+    } else {
+      a->head = b;
+    }
+    a->tail = b;
+  }
+
+  b->to[b->len++] = to;
+  a->count++;
+
+  return 0;
+}
+
+void vertex_destroy (Vertex* vertex)
+{
+  AdjBlock* biter;
+  AdjBlock* bdel = NULL;
+  unsigned int i;
+
+  if ( !vertex ) {
+    return;
+  }
+
+  for ( i = 0; i < VERTEX_PROPSLOTS(vertex); i++ ) {
+    if ( vertex->props[i].key && vertex->props[i].len >= PROP_INLINE ) {
+      free(vertex->props[i].val.ptr);
+    }
+  }
+
+  free(vertex->props);
+
+  for ( i = 0; i < vertex->nadj + vertex->nin; i++ ) {
+    biter = i < vertex->nadj ? vertex->adj[i].head : vertex->in[i - vertex->nadj].head;
+    while (biter) {
+      bdel = biter;
+      biter = biter->next;
+      free(bdel);
+    }
+  }
+
+  free(vertex->adj);
+  free(vertex->in);
+
+  /* the vertex itself is a slot in the vertex table */
+  vertex->adj = NULL;
+  vertex->nadj = 0;
+  vertex->in = NULL;
+  vertex->nin = 0;
+  vertex->props = NULL;
+  vertex->nprops = 0;
+  vertex->propcap = 0;
+}
+
+static Adjacency* adjacency_find (Adjacency* adj, unsigned int n, sym_t label)
+{
+  unsigned int i;
+
+  for ( i = 0; i < n; i++ ) {
+    if ( adj[i].label == label ) {
+      return &adj[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* bucket for label in a vertex's out or in list, added when missing */
+static Adjacency* adjacency_get (Adjacency** adj, unsigned int* n, sym_t label)
+{
+  Adjacency* a = adjacency_find(*adj, *n, label);
+
+  if ( a ) {
+    return a;
+  }
+
+  /* the bucket array doubles whenever its length reaches a power of two */
+  if ( !(*n & (*n - 1)) ) {
+    a = realloc(*adj, sizeof(Adjacency) * (*n ? *n * 2 : 1));
+    if ( !a ) {
+      return NULL;
+    }
+    *adj = a;
+  }
+
+  a = &(*adj)[(*n)++];
+  a->label = label;
+  a->count = 0;
+  a->head = NULL;
+  a->tail = NULL;
+
+  return a;
+}
+
+Adjacency* graph_vertexEdges (Vertex* vertex, sym_t label)
+{
+  return adjacency_find(vertex->adj, vertex->nadj, label);
+}
+
+Adjacency* graph_vertexInEdges (Vertex* vertex, sym_t label)
+{
+  return adjacency_find(vertex->in, vertex->nin, label);
+}
+
+/* first position in a sorted bucket that is not below id */
+static unsigned int adjacency_search (Adjacency* a, vid_t id)
+{
+  unsigned int lo = 0, hi = a->head ? a->head->len : 0, mid;
+
+  while ( lo < hi ) {
+    mid = lo + (hi - lo) / 2;
+    if ( (a->head->to[mid] & ~VID_DEAD) < id ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/* put id in its place in a sorted bucket. returns 1 when it is already
+   there, and the position in *at either way. a deleted entry for id is
+   brought back */
+static int adjacency_insert (Adjacency* a, vid_t id, unsigned int* at)
+{
+  AdjBlock* b = a->head;
+  unsigned int i = adjacency_search(a, id);
+  unsigned int cap;
+
+  *at = i;
+
+  if ( b && i < b->len && b->to[i] == id ) {
+    return 1;
+  }
+
+  if ( b && i < b->len && b->to[i] == (id | VID_DEAD) ) {
+    b->to[i] = id;
+    a->count++;
+    return 0;
+  }
+
+  /* one block that keeps doubling, so the whole bucket can be searched */
+  if ( !b || b->len == b->cap ) {
+    cap = b ? b->cap * 2 : ADJ_BLOCK_MIN;
+    b = realloc(b, sizeof(AdjBlock) + sizeof(vid_t) * cap);
+    if ( !b ) {
+      return -1;
+    }
+    if ( !a->head ) {
+      b->next = NULL;
+      b->len = 0;
+    }
+    b->cap = cap;
+    a->head = a->tail = b;
+  }
+
+  memmove(&b->to[i + 1], &b->to[i], sizeof(vid_t) * (b->len - i));
+  b->to[i] = id;
+  b->len++;
+  a->count++;
+
+  return 0;
+}
+
+static void adjacency_removeAt (Adjacency* a, unsigned int i)
+{
+  AdjBlock* b = a->head;
+
+  memmove(&b->to[i], &b->to[i + 1], sizeof(vid_t) * (b->len - i - 1));
+  b->len--;
+  a->count--;
+}
+
+/* planner statistics. each (label, key) has a hyperloglog sketch of the
+   values set on it, and each edge label a histogram of live degrees on
+   both sides. they are kept current by the writers, under the graph lock */
+static Hll* stats_sketch (Graph* g, sym_t label, sym_t key, int create)
+{
+  LabelStats* ls;
+  Hll** keys;
+  sym_t n;
+
+  if ( label >= g->nlstats ) {
+    if ( !create ) {
+      return NULL;
+    }
+    n = g->nlstats ? g->nlstats : 16;
+    while ( n <= label ) {
+      n *= 2;
+    }
+    ls = realloc(g->lstats, sizeof(LabelStats) * n);
+    if ( !ls ) {
+      return NULL;
+    }
+    memset(ls + g->nlstats, 0, sizeof(LabelStats) * (n - g->nlstats));
+    g->lstats = ls;
+    g->nlstats = n;
+  }
+
+  ls = &g->lstats[label];
+
+  if ( key >= ls->nkeys ) {
+    if ( !create ) {
+      return NULL;
+    }
+    n = ls->nkeys ? ls->nkeys : 16;
+    while ( n <= key ) {
+      n *= 2;
+    }
+    keys = realloc(ls->keys, sizeof(Hll*) * n);
+    if ( !keys ) {
+      return NULL;
+    }
+    memset(keys + ls->nkeys, 0, sizeof(Hll*) * (n - ls->nkeys));
+    ls->keys = keys;
+    ls->nkeys = n;
+  }
+
+  if ( !ls->keys[key] && create ) {
+    ls->keys[key] = calloc(1, sizeof(Hll));
+  }
+
+  return ls->keys[key];
+}
+
+/* the top HLL_BITS of the hash pick a register, which keeps the longest
+   run of leading zeros seen in the rest */
+static void hll_add (Hll* h, const unsigned char* val)
+{
+  uint64 x = map_hash(val, strlen((const char *)val));
+  unsigned int i = (unsigned int)(x >> (64 - HLL_BITS));
+  unsigned char rank;
+
+  /* a stop bit past the end bounds the run */
+  x = (x << HLL_BITS) | (1ULL << (HLL_BITS - 1));
+  rank = (unsigned char)(__builtin_clzll(x) + 1);
+
+  if ( rank > h->regs[i] ) {
+    h->regs[i] = rank;
+  }
+}
+
+static double hll_count (Hll* h)
+{
+  double m = HLL_REGS, sum = 0, e;
+  unsigned int i, zeros = 0;
+
+  for ( i = 0; i < HLL_REGS; i++ ) {
+    sum += 1.0 / (double)(1ULL << h->regs[i]);
+    zeros += !h->regs[i];
+  }
+
+  e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+  /* small counts are better served by linear counting */
+  if ( e <= 2.5 * m && zeros ) {
+    e = m * log(m / zeros);
+  }
+
+  return e;
+}
+
+/* a value was set on the vertex, counted under its first label */
+static void stats_property (Graph* g, Vertex* v, sym_t key, const unsigned char* val)
+{
+  Hll* h;
+
+  if ( !v->label ) {
+    return;
+  }
+
+  pthread_mutex_lock(&g->statslock);
+
+  if ( (h = stats_sketch(g, v->label, key, 1)) ) {
+    hll_add(h, val);
+  }
+
+  pthread_mutex_unlock(&g->statslock);
+}
+
+static EdgeStats* stats_edges (Graph* g, sym_t label)
+{
+  EdgeStats* es;
+  sym_t n;
+
+  if ( label >= g->nestats ) {
+    n = g->nestats ? g->nestats : 16;
+    while ( n <= label ) {
+      n *= 2;
+    }
+    es = realloc(g->estats, sizeof(EdgeStats) * n);
+    if ( !es ) {
+      return NULL;
+    }
+    memset(es + g->nestats, 0, sizeof(EdgeStats) * (n - g->nestats));
+    g->estats = es;
+    g->nestats = n;
+  }
+
+  return &g->estats[label];
+}
+
+/* a vertex's live degree on one side of label moved from before to after */
+static void stats_degree (Graph* g, sym_t label, int in, unsigned int before, unsigned int after)
+{
+  EdgeStats* es;
+  unsigned long* hist;
+
+  if ( before == after ) {
+    return;
+  }
+
+  pthread_mutex_lock(&g->statslock);
+
+  if ( !(es = stats_edges(g, label)) ) {
+    pthread_mutex_unlock(&g->statslock);
+    return;
+  }
+
+  hist = in ? es->in : es->out;
+
+  if ( before ) {
+    hist[31 - __builtin_clz(before)]--;
+  }
+
+  if ( after ) {
+    hist[31 - __builtin_clz(after)]++;
+  }
+
+  /* every edge is counted once, on its out side */
+  if ( !in ) {
+    es->edges += after;
+    es->edges -= before;
+  }
+
+  pthread_mutex_unlock(&g->statslock);
+}
+
+unsigned long graph_labelCount (Graph* g, sym_t label)
+{
+  Bitmap* members = graph_labelMembers(g, label);
+
+  return members ? bitmap_count(members) : 0;
+}
+
+/* estimated distinct values of key among the label's vertices, 0 when
+   none was ever set */
+double graph_distinct (Graph* g, sym_t label, sym_t key)
+{
+  Hll* h = stats_sketch(g, label, key, 0);
+
+  return h ? hll_count(h) : 0;
+}
+
+/* average edges of label per vertex having any, leaving it (out) or
+   reaching it (in) */
+double graph_fanout (Graph* g, sym_t label, int in)
+{
+  EdgeStats* es;
+  unsigned long* hist;
+  unsigned long vertices = 0;
+  int i;
+
+  if ( label >= g->nestats ) {
+    return 0;
+  }
+
+  es = &g->estats[label];
+  hist = in ? es->in : es->out;
+
+  for ( i = 0; i < DEGREE_BUCKETS; i++ ) {
+    vertices += hist[i];
+  }
+
+  return vertices ? (double)es->edges / vertices : 0;
+}
+
+/* record a write to the edges of label */
+static int graph_stampLabel (Graph* g, sym_t label)
+{
+  unsigned long* stamps;
+  sym_t n;
+
+  pthread_mutex_lock(&g->stamplock);
+
+  if ( label >= g->nstamps ) {
+    n = g->nstamps ? g->nstamps : 16;
+    while ( n <= label ) {
+      n *= 2;
+    }
+    stamps = realloc(g->stamps, sizeof(unsigned long) * n);
+    if ( !stamps ) {
+      pthread_mutex_unlock(&g->stamplock);
+      return -1;
+    }
+    memset(stamps + g->nstamps, 0, sizeof(unsigned long) * (n - g->nstamps));
+    g->stamps = stamps;
+    g->nstamps = n;
+  }
+
+  g->stamps[label] = ++g->version;
+
+  pthread_mutex_unlock(&g->stamplock);
+
+  return 0;
+}
+
+/* the edge goes in the out bucket of from and the in bucket of to */
+void graph_vertexAddEdge (Graph* g, Vertex* from, Vertex* to, sym_t label)
+{
+  Adjacency* out;
+  Adjacency* in;
+  unsigned int at, unused;
+
+  /* stamped up front, a stamp without an edge only costs a rebuild */
+  if ( graph_stampLabel(g, label) ) {
+    return;
+  }
+
+  if ( from->dead || to->dead ) {
+    return;
+  }
+
+  out = adjacency_get(&from->adj, &from->nadj, label);
+
+  if ( !out ) {
+    return;
+  }
+
+  if ( bitmap_contains(&g->sorted, label) ) {
+    /* a repeat is dropped, both sides already hold it */
+    if ( adjacency_insert(out, to->id, &at) ) {
+      return;
+    }
+    in = adjacency_get(&to->in, &to->nin, label);
+    if ( !in || adjacency_insert(in, from->id, &unused) < 0 ) {
+      adjacency_removeAt(out, at);
+      return;
+    }
+  } else {
+    if ( adjacency_push(out, to->id) ) {
+      return;
+    }
+    in = adjacency_get(&to->in, &to->nin, label);
+    if ( !in || adjacency_push(in, from->id) ) {
+      /* keep both sides in step */
+      out->tail->len--;
+      out->count--;
+      return;
+    }
+  }
+
+  stats_degree(g, label, 0, out->count - 1, out->count);
+  stats_degree(g, label, 1, in->count - 1, in->count);
+}
+
+/* whether from has an edge of label to to. sorted buckets are binary
+   searched, otherwise the shorter of the two sides is walked */
+int graph_hasEdge (Graph* g, Vertex* from, Vertex* to, sym_t label)
+{
+  Adjacency* out = graph_vertexEdges(from, label);
+  Adjacency* in = graph_vertexInEdges(to, label);
+  Adjacency* a;
+  AdjBlock* b;
+  vid_t id;
+  unsigned int i;
+
+  if ( !out || !in || from->dead || to->dead ) {
+    return 0;
+  }
+
+  if ( out->count <= in->count ) {
+    a = out;
+    id = to->id;
+  } else {
+    a = in;
+    id = from->id;
+  }
+
+  /* compaction frees the blocks of a bucket left empty */
+  if ( !a->count || !a->head ) {
+    return 0;
+  }
+
+  /* deleted entries carry VID_DEAD, so they never compare equal */
+  if ( bitmap_contains(&g->sorted, label) ) {
+    i = adjacency_search(a, id);
+    return i < a->head->len && a->head->to[i] == id;
+  }
+
+  for ( b = a->head; b; b = b->next ) {
+    for ( i = 0; i < b->len; i++ ) {
+      if ( b->to[i] == id ) {
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* mark the first live entry for id in a bucket as deleted */
+static int adjacency_kill (Graph* g, Adjacency* a, vid_t id)
+{
+  AdjBlock* b;
+  unsigned int i;
+
+  if ( !a || !a->count ) {
+    return -1;
+  }
+
+  if ( bitmap_contains(&g->sorted, a->label) ) {
+    i = adjacency_search(a, id);
+    if ( i < a->head->len && a->head->to[i] == id ) {
+      a->head->to[i] |= VID_DEAD;
+      a->count--;
+      return 0;
+    }
+    return -1;
+  }
+
+  for ( b = a->head; b; b = b->next ) {
+    for ( i = 0; i < b->len; i++ ) {
+      if ( b->to[i] == id ) {
+        b->to[i] |= VID_DEAD;
+        a->count--;
+        return 0;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/* drop the deleted entries of a bucket, sliding the live ones forward and
+   freeing the blocks left empty at the end */
+static void adjacency_squeeze (Adjacency* a)
+{
+  AdjBlock* wb = a->head;
+  AdjBlock* rb;
+  AdjBlock* bdel;
+  unsigned int ri, wi = 0;
+
+  /* nothing live is left, the whole chain goes */
+  if ( !a->count ) {
+    rb = a->head;
+    a->head = NULL;
+    a->tail = NULL;
+    while ( rb ) {
+      bdel = rb;
+      rb = rb->next;
+      free(bdel);
+    }
+    return;
+  }
+
+  for ( rb = a->head; rb; rb = rb->next ) {
+    for ( ri = 0; ri < rb->len; ri++ ) {
+      if ( rb->to[ri] & VID_DEAD ) {
+        continue;
+      }
+      if ( wi == wb->cap ) {
+        wb->len = wi;
+        wb = wb->next;
+        wi = 0;
+      }
+      wb->to[wi++] = rb->to[ri];
+    }
+  }
+
+  rb = wb->next;
+  wb->len = wi;
+  wb->next = NULL;
+  a->tail = wb;
+
+  while ( rb ) {
+    bdel = rb;
+    rb = rb->next;
+    free(bdel);
+  }
+}
+
+/* delete one from -> to edge of label. both entries are only marked, the
+   compactor reclaims them later */
+int graph_vertexRemoveEdge (Graph* g, Vertex* from, Vertex* to, sym_t label)
+{
+  Adjacency* out = graph_vertexEdges(from, label);
+  Adjacency* in = graph_vertexInEdges(to, label);
+
+  if ( from->dead || to->dead ) {
+    return -1;
+  }
+
+  if ( adjacency_kill(g, out, to->id) ) {
+    return -1;
+  }
+
+  stats_degree(g, label, 0, out->count + 1, out->count);
+
+  if ( !adjacency_kill(g, in, from->id) ) {
+    stats_degree(g, label, 1, in->count + 1, in->count);
+  }
+
+  graph_stampLabel(g, label);
+  bitmap_add(&g->dirty, from->id);
+  bitmap_add(&g->dirty, to->id);
+
+  return 0;
+}
+
+/* mark a vertex deleted. its edges and properties stay in place until the
+   compactor gets to it, readers skip it meanwhile */
+void graph_deleteVertex (Graph* g, Vertex* v)
+{
+  unsigned int i;
+
+  if ( v->dead ) {
+    return;
+  }
+
+  v->dead = 1;
+
+  for ( i = 0; i < v->nadj; i++ ) {
+    graph_stampLabel(g, v->adj[i].label);
+  }
+
+  for ( i = 0; i < v->nin; i++ ) {
+    graph_stampLabel(g, v->in[i].label);
+  }
+
+  bitmap_add(&g->graveyard, v->id);
+}
+
+static void csr_release (Csr* c)
+{
+  if ( __sync_sub_and_fetch(&c->refs, 1) ) {
+    return;
+  }
+
+  free(c->offsets);
+  free(c->targets);
+  free(c);
+}
+
+/* flatten the out buckets of label: one pass sizes every row, the second
+   copies the live entries into place */
+static Csr* csr_build (Graph* g, sym_t label)
+{
+  Csr* c = malloc(sizeof(Csr));
+  vid_t id, n = g->nvertices;
+  size_t total = 0, pos;
+  unsigned int i;
+  Adjacency* a;
+  AdjBlock* b;
+  Vertex* v;
+
+  if ( !c ) {
+    return NULL;
+  }
+
+  c->label = label;
+  c->stamp = g->stamps[label];
+  c->nvertices = n;
+  c->refs = 1;
+  c->targets = NULL;
+  c->offsets = malloc(sizeof(size_t) * (n + 1));
+
+  if ( !c->offsets ) {
+    free(c);
+    return NULL;
+  }
+
+  /* edges still pointing at deleted vertices are left out */
+  for ( id = 0; id < n; id++ ) {
+    c->offsets[id] = total;
+    v = graph_vertexById(g, id);
+    a = v->dead ? NULL : graph_vertexEdges(v, label);
+    for ( b = a ? a->head : NULL; b; b = b->next ) {
+      for ( i = 0; i < b->len; i++ ) {
+        total += !(b->to[i] & VID_DEAD) && !graph_vertexById(g, b->to[i])->dead;
+      }
+    }
+  }
+
+  c->offsets[n] = total;
+  c->targets = malloc(sizeof(vid_t) * (total ? total : 1));
+
+  if ( !c->targets ) {
+    csr_release(c);
+    return NULL;
+  }
+
+  for ( id = 0; id < n; id++ ) {
+    if ( c->offsets[id] == c->offsets[id + 1] ) {
+      continue;
+    }
+    pos = c->offsets[id];
+    a = graph_vertexEdges(graph_vertexById(g, id), label);
+    for ( b = a->head; b; b = b->next ) {
+      for ( i = 0; i < b->len; i++ ) {
+        if ( !(b->to[i] & VID_DEAD) && !graph_vertexById(g, b->to[i])->dead ) {
+          c->targets[pos++] = b->to[i];
+        }
+      }
+    }
+  }
+
+  return c;
+}
+
+void snapshot_release (Snapshot* s)
+{
+  sym_t i;
+
+  if ( !s || __sync_sub_and_fetch(&s->refs, 1) ) {
+    return;
+  }
+
+  for ( i = 0; i < s->ncsr; i++ ) {
+    if ( s->csr[i] ) {
+      csr_release(s->csr[i]);
+    }
+  }
+
+  free(s->csr);
+  free(s);
+}
+
+/* labels untouched since old was taken keep their csr, the rest are
+   flattened again */
+static Snapshot* snapshot_build (Graph* g, Snapshot* old)
+{
+  Snapshot* s = malloc(sizeof(Snapshot));
+  sym_t i;
+
+  if ( !s ) {
+    return NULL;
+  }
+
+  s->version = g->version;
+  s->ncsr = g->nstamps;
+  s->refs = 1;
+  s->csr = calloc(s->ncsr ? s->ncsr : 1, sizeof(Csr*));
+
+  if ( !s->csr ) {
+    free(s);
+    return NULL;
+  }
+
+  for ( i = 0; i < s->ncsr; i++ ) {
+    if ( !g->stamps[i] ) {
+      continue;
+    }
+    if ( old && i < old->ncsr && old->csr[i] && old->csr[i]->stamp == g->stamps[i] ) {
+      __sync_add_and_fetch(&old->csr[i]->refs, 1);
+      s->csr[i] = old->csr[i];
+      continue;
+    }
+    if ( !(s->csr[i] = csr_build(g, i)) ) {
+      snapshot_release(s);
+      return NULL;
+    }
+  }
+
+  return s;
+}
+
+/* current snapshot, rebuilt first when edges were written since it was
+   taken. the caller holds the graph lock as a reader or a writer, not as
+   an ingester, for this call only. after that the snapshot stays valid
+   until it is released */
+Snapshot* graph_snapshot (Graph* g)
+{
+  Snapshot* s;
+
+  pthread_mutex_lock(&g->snaplock);
+
+  s = g->snapshot;
+
+  if ( !s || s->version != g->version ) {
+    s = snapshot_build(g, g->snapshot);
+    if ( s ) {
+      snapshot_release(g->snapshot);
+      g->snapshot = s;
+    } else {
+      /* out of memory, a stale copy is better than none */
+      s = g->snapshot;
+    }
+  }
+
+  if ( s ) {
+    __sync_add_and_fetch(&s->refs, 1);
+  }
+
+  pthread_mutex_unlock(&g->snaplock);
+
+  return s;
+}
+
+/* the last snapshot taken, without rebuilding it */
+static Snapshot* snapshot_peek (Graph* g)
+{
+  Snapshot* s;
+
+  pthread_mutex_lock(&g->snaplock);
+
+  if ( (s = g->snapshot) ) {
+    __sync_add_and_fetch(&s->refs, 1);
+  }
+
+  pthread_mutex_unlock(&g->snaplock);
+
+  return s;
+}
+
+/* the csr of label in s if no edge of that label was written since it
+   was built. the caller holds the graph lock so that stays true */
+static Csr* snapshot_current (Graph* g, Snapshot* s, sym_t label)
+{
+  Csr* c;
+
+  if ( !s || label >= s->ncsr || label >= g->nstamps || !(c = s->csr[label]) ) {
+    return NULL;
+  }
+
+  return c->stamp == g->stamps[label] ? c : NULL;
+}
+
+/* targets of the label's edges out of id, as of the snapshot */
+const vid_t* snapshot_edges (Snapshot* s, vid_t id, sym_t label, size_t* n)
+{
+  Csr* c;
+
+  *n = 0;
+
+  if ( label >= s->ncsr || !(c = s->csr[label]) || id >= c->nvertices ) {
+    return NULL;
+  }
+
+  *n = c->offsets[id + 1] - c->offsets[id];
+
+  return c->targets + c->offsets[id];
+}
+
+/* first position in the posting that is not below id */
+static unsigned int posting_find (Posting* p, vid_t id)
+{
+  unsigned int lo = 0, hi = p->len, mid;
+
+  while ( lo < hi ) {
+    mid = lo + (hi - lo) / 2;
+    if ( p->ids[mid] < id ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+static int posting_add (Posting* p, vid_t id)
+{
+  unsigned int i, cap;
+  vid_t* ids;
+
+  /* new vertices get the highest id, so this is nearly always an append */
+  i = (p->len && p->ids[p->len - 1] >= id) ? posting_find(p, id) : p->len;
+
+  if ( i < p->len && p->ids[i] == id ) {
+    return 0;
+  }
+
+  if ( p->len == p->cap ) {
+    cap = p->cap ? p->cap * 2 : 4;
+    ids = realloc(p->ids, sizeof(vid_t) * cap);
+    if ( !ids ) {
+      return -1;
+    }
+    p->ids = ids;
+    p->cap = cap;
+  }
+
+  memmove(&p->ids[i + 1], &p->ids[i], sizeof(vid_t) * (p->len - i));
+  p->ids[i] = id;
+  p->len++;
+
+  return 0;
+}
+
+static PropIndex* graph_findIndex (Graph* g, sym_t label, sym_t key)
+{
+  PropIndex* ix;
+
+  for ( ix = g->indexes; ix; ix = ix->next ) {
+    if ( ix->label == label && ix->key == key ) {
+      return ix;
+    }
+  }
+
+  return NULL;
+}
+
+static int index_add (PropIndex* ix, const unsigned char* val, vid_t id)
+{
+  Posting* p;
+  int r = -1;
+
+  pthread_mutex_lock(&ix->lock);
+
+  if ( !(p = map_get(ix->values, (const char *)val)) && (p = calloc(1, sizeof(Posting))) ) {
+    if ( !map_set(ix->values, (const char *)val, p) ) {
+      free(p);
+      p = NULL;
+    }
+  }
+
+  if ( p ) {
+    r = posting_add(p, id);
+  }
+
+  pthread_mutex_unlock(&ix->lock);
+
+  return r;
+}
+
+static void index_remove (PropIndex* ix, const unsigned char* val, vid_t id)
+{
+  Posting* p = map_get(ix->values, (const char *)val);
+  unsigned int i;
+
+  if ( !p ) {
+    return;
+  }
+
+  i = posting_find(p, id);
+
+  if ( i == p->len || p->ids[i] != id ) {
+    return;
+  }
+
+  memmove(&p->ids[i], &p->ids[i + 1], sizeof(vid_t) * (p->len - i - 1));
+  p->len--;
+
+  if ( !p->len ) {
+    map_remove(ix->values, (const char *)val);
+    free(p->ids);
+    free(p);
+  }
+}
+
+void graph_vertexSetProperty (Graph* g, Vertex* vertex, sym_t key, unsigned char* val)
+{
+  PropIndex* ix = vertex->label ? graph_findIndex(g, vertex->label, key) : NULL;
+  Property* p = vertex_findProperty(vertex, key);
+  unsigned int cap, i;
+
+  if ( p ) {
+    if ( ix ) {
+      index_remove(ix, PROPERTY_VAL(p), vertex->id);
+    }
+    /* keeps the old value if the copy fails */
+    property_setVal(p, val);
+    if ( ix ) {
+      index_add(ix, PROPERTY_VAL(p), vertex->id);
+    }
+    stats_property(g, vertex, key, PROPERTY_VAL(p));
+    return;
+  }
+
+  if ( vertex->propcap > PROP_HASHED ? (vertex->nprops + 1) * 2 > vertex->propcap : vertex->nprops == vertex->propcap ) {
+    cap = vertex->propcap ? vertex->propcap * 2 : 2;
+    while ( cap > PROP_HASHED && (vertex->nprops + 1) * 2 > cap ) {
+      cap *= 2;
+    }
+    if ( vertex_resizeProperties(vertex, cap) ) {
+      return;
+    }
+  }
+
+  if ( vertex->propcap > PROP_HASHED ) {
+    for ( i = PROP_SLOT(key, vertex->propcap); vertex->props[i].key; i = (i + 1) & (vertex->propcap - 1) );
+    p = &vertex->props[i];
+  } else {
+    p = &vertex->props[vertex->nprops];
+  }
+
+  p->len = 0;
+
+  if ( property_setVal(p, val) ) {
+    return;
+  }
+
+  p->key = key;
+  vertex->nprops++;
+
+  if ( ix ) {
+    index_add(ix, val, vertex->id);
+  }
+
+  stats_property(g, vertex, key, val);
+
+  return;
+}
+
+unsigned char* graph_vertexGetProperty (Vertex* vertex, sym_t key)
+{
+  Property* p = vertex_findProperty(vertex, key);
+
+  if ( p ) {
+    return PROPERTY_VAL(p);
+  }
+
+  return NULL;
+}
+
+void graph_vertexRemoveProperty (Graph* g, Vertex* vertex, sym_t key)
+{
+  PropIndex* ix = vertex->label ? graph_findIndex(g, vertex->label, key) : NULL;
+  Property* p = vertex_findProperty(vertex, key);
+  Property* props = vertex->props;
+  unsigned int mask = vertex->propcap - 1;
+  unsigned int i, j, h;
+
+  if ( !p ) {
+    return;
+  }
+
+  if ( ix ) {
+    index_remove(ix, PROPERTY_VAL(p), vertex->id);
+  }
+
+  if ( p->len >= PROP_INLINE ) {
+    free(p->val.ptr);
+  }
+
+  i = p - props;
+  vertex->nprops--;
+
+  if ( vertex->propcap <= PROP_HASHED ) {
+    memmove(&props[i], &props[i + 1], sizeof(Property) * (vertex->nprops - i));
+    return;
+  }
+
+  /* close the gap by shifting back the entries of the probe run that
+     can't be reached from their home slot anymore */
+  for ( j = (i + 1) & mask; props[j].key; j = (j + 1) & mask ) {
+    h = PROP_SLOT(props[j].key, vertex->propcap);
+    if ( i <= j ? (h <= i || h > j) : (h <= i && h > j) ) {
+      props[i] = props[j];
+      i = j;
+    }
+  }
+
+  props[i].key = SYM_NONE;
+  props[i].len = 0;
+
+  return;
+}
+
+/* add v to the members of label, the first label a vertex gets is the
+   one its properties are indexed under. called with labellock held */
+static int label_add (Graph* g, Vertex* v, sym_t label)
+{
+  Bitmap* labels;
+  sym_t n;
+
+  if ( label >= g->nlabels ) {
+    n = g->nlabels ? g->nlabels : 16;
+    while ( n <= label ) {
+      n *= 2;
+    }
+    labels = realloc(g->labels, sizeof(Bitmap) * n);
+    if ( !labels ) {
+      return -1;
+    }
+    for ( ; g->nlabels < n; g->nlabels++ ) {
+      bitmap_init(&labels[g->nlabels]);
+    }
+    g->labels = labels;
+  }
+
+  if ( bitmap_add(&g->labels[label], v->id) ) {
+    return -1;
+  }
+
+  if ( !v->label ) {
+    v->label = label;
+  }
+
+  return 0;
+}
+
+int graph_addLabel (Graph* g, Vertex* v, sym_t label)
+{
+  int r;
+
+  pthread_mutex_lock(&g->labellock);
+  r = label_add(g, v, label);
+  pthread_mutex_unlock(&g->labellock);
+
+  return r;
+}
+
+Bitmap* graph_labelMembers (Graph* g, sym_t label)
+{
+  if ( label >= g->nlabels || !g->labels[label].len ) {
+    return NULL;
+  }
+
+  return &g->labels[label];
+}
+
+/* index every vertex already carrying the label, the property setters
+   keep it current from then on */
+int graph_createIndex (Graph* g, sym_t label, sym_t key)
+{
+  PropIndex* ix = graph_findIndex(g, label, key);
+  Bitmap* members = graph_labelMembers(g, label);
+  BitmapIter it;
+  Property* p;
+  Vertex* v;
+  vid_t id;
+
+  if ( ix ) {
+    return 0;
+  }
+
+  ix = malloc(sizeof(PropIndex));
+
+  if ( !ix ) {
+    return -1;
+  }
+
+  if ( pthread_mutex_init(&ix->lock, NULL) ) {
+    free(ix);
+    return -1;
+  }
+
+  ix->values = map_init();
+
+  if ( !ix->values ) {
+    pthread_mutex_destroy(&ix->lock);
+    free(ix);
+    return -1;
+  }
+
+  ix->label = label;
+  ix->key = key;
+
+  if ( members ) {
+    bitmap_iterInit(&it, members);
+    while ( bitmap_iterNext(&it, &id) ) {
+      v = graph_vertexById(g, id);
+      if ( v->label == label && (p = vertex_findProperty(v, key)) ) {
+        index_add(ix, PROPERTY_VAL(p), id);
+      }
+    }
+  }
+
+  ix->next = g->indexes;
+  g->indexes = ix;
+
+  return 0;
+}
+
+static int vid_cmp (const void* a, const void* b)
+{
+  vid_t x = *(const vid_t *)a;
+  vid_t y = *(const vid_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* gather a bucket into one block in id order, dropping repeats and
+   deleted entries */
+static int adjacency_sort (Adjacency* a)
+{
+  AdjBlock* b;
+  AdjBlock* biter;
+  AdjBlock* bdel;
+  unsigned int i, n = 0, cap = ADJ_BLOCK_MIN;
+
+  if ( !a || !a->head ) {
+    return 0;
+  }
+
+  while ( cap < a->count ) {
+    cap *= 2;
+  }
+
+  b = malloc(sizeof(AdjBlock) + sizeof(vid_t) * cap);
+
+  if ( !b ) {
+    return -1;
+  }
+
+  for ( biter = a->head; biter; ) {
+    for ( i = 0; i < biter->len; i++ ) {
+      if ( !(biter->to[i] & VID_DEAD) ) {
+        b->to[n++] = biter->to[i];
+      }
+    }
+    bdel = biter;
+    biter = biter->next;
+    free(bdel);
+  }
+
+  qsort(b->to, n, sizeof(vid_t), vid_cmp);
+
+  for ( i = 1, a->count = n ? 1 : 0; i < n; i++ ) {
+    if ( b->to[i] != b->to[a->count - 1] ) {
+      b->to[a->count++] = b->to[i];
+    }
+  }
+
+  b->next = NULL;
+  b->len = a->count;
+  b->cap = cap;
+  a->head = a->tail = b;
+
+  return 0;
+}
+
+/* from now on keep the buckets of label sorted, converting the ones that
+   exist. a repeated edge is kept once */
+int graph_sortEdges (Graph* g, sym_t label)
+{
+  Adjacency *out, *in;
+  unsigned int nout, nin;
+  Vertex* v;
+  vid_t id;
+
+  if ( bitmap_contains(&g->sorted, label) ) {
+    return 0;
+  }
+
+  for ( id = 0; id < g->nvertices; id++ ) {
+    v = graph_vertexById(g, id);
+    out = graph_vertexEdges(v, label);
+    in = graph_vertexInEdges(v, label);
+    nout = out ? out->count : 0;
+    nin = in ? in->count : 0;
+    if ( adjacency_sort(out) || adjacency_sort(in) ) {
+      return -1;
+    }
+    /* repeats were dropped */
+    stats_degree(g, label, 0, nout, out ? out->count : 0);
+    stats_degree(g, label, 1, nin, in ? in->count : 0);
+  }
+
+  /* rows in the snapshot change order */
+  if ( graph_stampLabel(g, label) ) {
+    return -1;
+  }
+
+  return bitmap_add(&g->sorted, label);
+}
+
+/* unhook a deleted vertex: its entries in the neighbours' buckets are
+   marked, it leaves its labels and indexes, then what it holds is freed */
+static void graph_bury (Graph* g, Vertex* v)
+{
+  PropIndex* ix;
+  Property* p;
+  Adjacency *a, *na;
+  AdjBlock* b;
+  Vertex* n;
+  unsigned int i, j;
+  sym_t l;
+
+  for ( i = 0; i < v->nadj + v->nin; i++ ) {
+    a = i < v->nadj ? &v->adj[i] : &v->in[i - v->nadj];
+    for ( b = a->head; b; b = b->next ) {
+      for ( j = 0; j < b->len; j++ ) {
+        if ( b->to[j] & VID_DEAD ) {
+          continue;
+        }
+        n = graph_vertexById(g, b->to[j]);
+        /* the neighbour holds the other side */
+        na = i < v->nadj ? graph_vertexInEdges(n, a->label) : graph_vertexEdges(n, a->label);
+        if ( !adjacency_kill(g, na, v->id) ) {
+          stats_degree(g, a->label, i < v->nadj, na->count + 1, na->count);
+        }
+        bitmap_add(&g->dirty, n->id);
+      }
+    }
+  }
+
+  for ( i = 0; i < v->nadj + v->nin; i++ ) {
+    a = i < v->nadj ? &v->adj[i] : &v->in[i - v->nadj];
+    stats_degree(g, a->label, i >= v->nadj, a->count, 0);
+  }
+
+  for ( l = 0; l < g->nlabels; l++ ) {
+    bitmap_remove(&g->labels[l], v->id);
+  }
+
+  for ( ix = g->indexes; ix; ix = ix->next ) {
+    if ( ix->label == v->label && (p = vertex_findProperty(v, ix->key)) ) {
+      index_remove(ix, PROPERTY_VAL(p), v->id);
+    }
+  }
+
+  vertex_destroy(v);
+}
+
+/* reclaim up to budget deleted or dirty vertices, with the caller holding
+   the graph for writing. returns nonzero while work is left, so a budget
+   of 0 only checks and is fine under the read lock */
+int graph_compact (Graph* g, unsigned int budget)
+{
+  BitmapIter it;
+  Vertex* v;
+  vid_t id;
+  unsigned int i;
+
+  for ( ; budget; budget-- ) {
+    /* burying marks entries in the neighbours, so it goes first */
+    bitmap_iterInit(&it, &g->graveyard);
+    if ( bitmap_iterNext(&it, &id) ) {
+      graph_bury(g, graph_vertexById(g, id));
+      bitmap_remove(&g->graveyard, id);
+      continue;
+    }
+
+    bitmap_iterInit(&it, &g->dirty);
+    if ( !bitmap_iterNext(&it, &id) ) {
+      break;
+    }
+
+    v = graph_vertexById(g, id);
+    for ( i = 0; i < v->nadj; i++ ) {
+      adjacency_squeeze(&v->adj[i]);
+    }
+    for ( i = 0; i < v->nin; i++ ) {
+      adjacency_squeeze(&v->in[i]);
+    }
+    bitmap_remove(&g->dirty, id);
+  }
+
+  return g->graveyard.len || g->dirty.len;
+}
+
+VertexContainer* graph_vertexContainerInit (Arena* arena, Vertex* vertex)
+{
+  if ( !vertex->nprops || vertex->dead ) {
+    return NULL;
+  }
+
+  VertexContainer* v = arena_alloc(arena, sizeof(VertexContainer));
+
+  if ( !v ) {
+    return NULL;
+  }
+
+  v->vertex = vertex;
+  v->next = NULL;
+  return v;
+}
+
+/* append a vertex to a result list, vertices without properties are
+   left out */
+static void graph_appendVertex (Arena* arena, VertexContainer** head, VertexContainer** tail, Vertex* v)
+{
+  VertexContainer* cont = graph_vertexContainerInit(arena, v);
+
+  if ( cont && !*head ) {
+    *head = cont;
+    *tail = cont;
+  } else if ( cont ) {
+    (*tail)->next = cont;
+    *tail = cont;
+  }
+}
+
+#define SCAN_BATCH 256
+
+/* one key = val equality of a match, with its posting when the pair is
+   indexed on the label, and the vertices it is estimated to keep */
+typedef struct {
+  sym_t key;
+  unsigned char* val;
+  size_t vlen;
+  Posting* posting;
+  double rows;
+  int order;
+} match_pred_t;
+
+/* most selective first, ties in query order */
+static int match_predCmp (const void* a, const void* b)
+{
+  const match_pred_t* x = a;
+  const match_pred_t* y = b;
+
+  if ( x->rows != y->rows ) {
+    return x->rows < y->rows ? -1 : 1;
+  }
+
+  return x->order - y->order;
+}
+
+/* a posting is exact. otherwise the label's members are assumed to be
+   spread evenly over the distinct values of the key */
+static double plan_rows (Graph* g, sym_t label, match_pred_t* pred, double members)
+{
+  double distinct;
+
+  if ( pred->posting ) {
+    return pred->posting->len;
+  }
+
+  if ( !label ) {
+    return members;
+  }
+
+  distinct = graph_distinct(g, label, pred->key);
+
+  return distinct > 1 ? members / distinct : members;
+}
+
+/* seek through the postings, or scan the label when fetching the
+   shortest posting by id costs more than testing every member. postings
+   to intersect are moved to the front, keeping their order. returns how
+   many there are, 0 for a scan */
+static int plan_access (match_pred_t* preds, match_pred_t* tmp, int count, double members)
+{
+  int i, n = 0, lead = -1;
+
+  for ( i = 0; i < count && lead < 0; i++ ) {
+    if ( preds[i].posting ) {
+      lead = i;
+    }
+  }
+
+  if ( lead < 0 || preds[lead].posting->len * (double)PLAN_SEEK_COST >= members ) {
+    return 0;
+  }
+
+  for ( i = 0; i < count; i++ ) {
+    if ( preds[i].posting ) {
+      tmp[n++] = preds[i];
+    }
+  }
+
+  lead = n;
+
+  for ( i = 0; i < count; i++ ) {
+    if ( !preds[i].posting ) {
+      tmp[n++] = preds[i];
+    }
+  }
+
+  memcpy(preds, tmp, sizeof(match_pred_t) * count);
+
+  return lead;
+}
+
+static int match_test (Vertex* v, match_pred_t* preds, int n)
+{
+  Property* prop;
+  int i;
+
+  for ( i = 0; i < n; i++ ) {
+    prop = vertex_findProperty(v, preds[i].key);
+    if ( !prop || prop->len != preds[i].vlen || memcmp(PROPERTY_VAL(prop), preds[i].val, preds[i].vlen) ) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* first position at or after from holding an id >= id, galloping out
+   from from and then bisecting */
+static unsigned int posting_seek (Posting* p, unsigned int from, vid_t id)
+{
+  unsigned int lo = from, hi, step = 1, mid;
+
+  if ( from >= p->len || p->ids[from] >= id ) {
+    return from;
+  }
+
+  while ( lo + step < p->len && p->ids[lo + step] < id ) {
+    lo += step;
+    step <<= 1;
+  }
+
+  hi = lo + step < p->len ? lo + step : p->len;
+
+  /* ids[lo] < id, and id <= ids[hi] when hi < len */
+  while ( hi - lo > 1 ) {
+    mid = lo + (hi - lo) / 2;
+    if ( p->ids[mid] < id ) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return hi;
+}
+
+/* a node pattern ready to test vertices against: its label, its pairs
+   most selective first, and the vertices it is estimated to match */
+typedef struct {
+  sym_t label;
+  match_pred_t* preds;
+  int count;
+  double size;  /* members of the label, or every vertex */
+  double rows;
+} match_filter_t;
+
+/* resolve the label, keys and postings of a node pattern and order its
+   pairs. -1 when nothing can match: an unknown label or key, or an
+   indexed value no vertex holds */
+static int match_compile (Graph* g, Arena* arena, unsigned char* label, unsigned char** keys, unsigned char** vals, int count, match_filter_t* f)
+{
+  PropIndex* ix;
+  int j;
+
+  f->label = SYM_NONE;
+  f->preds = NULL;
+  f->count = count;
+
+  if ( label && *label ) {
+    f->label = sym_lookup(label);
+    if ( !f->label || !graph_labelMembers(g, f->label) ) {
+      return -1;
+    }
+  }
+
+  if ( count && !(f->preds = arena_alloc(arena, sizeof(match_pred_t) * count)) ) {
+    return -1;
+  }
+
+  f->size = f->label ? graph_labelCount(g, f->label) : g->nvertices;
+  f->rows = f->size;
+
+  for ( j = 0; j < count; j++ ) {
+    /* a key nobody has ever set can't match anything */
+    if ( !(f->preds[j].key = sym_lookup(keys[j])) ) {
+      return -1;
+    }
+
+    f->preds[j].val = vals[j];
+    f->preds[j].vlen = strlen((const char *)vals[j]);
+    f->preds[j].posting = NULL;
+    f->preds[j].order = j;
+
+    if ( f->label && (ix = graph_findIndex(g, f->label, f->preds[j].key)) ) {
+      /* no vertex has the value, so none has all of them */
+      if ( !(f->preds[j].posting = map_get(ix->values, (const char *)vals[j])) ) {
+        return -1;
+      }
+    }
+
+    f->preds[j].rows = plan_rows(g, f->label, &f->preds[j], f->size);
+
+    /* pairs are taken to be independent */
+    if ( f->size > 0 ) {
+      f->rows *= f->preds[j].rows / f->size;
+    }
+  }
+
+  if ( count > 1 ) {
+    qsort(f->preds, count, sizeof(match_pred_t), match_predCmp);
+  }
+
+  return 0;
+}
+
+/* whether a vertex met on the way (say across an edge) fits the pattern.
+   like every match it has to be live and hold properties */
+static int match_accept (Graph* g, match_filter_t* f, Vertex* v)
+{
+  if ( v->dead || !v->nprops ) {
+    return 0;
+  }
+
+  if ( f->label && !bitmap_contains(&g->labels[f->label], v->id) ) {
+    return 0;
+  }
+
+  return match_test(v, f->preds, f->count);
+}
+
+/* a resumable walk over the vertices of a node pattern, in id order */
+typedef struct {
+  match_filter_t f;
+  int npost;              /* leading pairs answered by their postings */
+  unsigned int* cursor;   /* position in each of those postings */
+  BitmapIter it;          /* the label's members, when not seeking */
+  vid_t next;             /* next id, when scanning every vertex */
+} match_scan_t;
+
+/* vertices that carry the label (when one is given) and every one of the
+   key = val pairs, from id `from` on. pairs are tested most selective
+   first. when the plan seeks, indexed pairs are answered by intersecting
+   their postings, smallest first, and the others are checked on what is
+   left; otherwise the label's members (or every vertex) are scanned once
+   for all pairs. -1 when nothing can match */
+static int match_scanInit (Graph* g, Arena* arena, unsigned char* label, unsigned char** keys, unsigned char** vals, int count, vid_t from, match_scan_t* s)
+{
+  match_pred_t* tmp = NULL;
+
+  if ( match_compile(g, arena, label, keys, vals, count, &s->f) ) {
+    return -1;
+  }
+
+  s->cursor = NULL;
+  s->next = from;
+
+  if ( count ) {
+    tmp = arena_alloc(arena, sizeof(match_pred_t) * count);
+    s->cursor = arena_alloc(arena, sizeof(unsigned int) * count);
+    if ( !tmp || !s->cursor ) {
+      return -1;
+    }
+    memset(s->cursor, 0, sizeof(unsigned int) * count);
+  }
+
+  s->npost = plan_access(s->f.preds, tmp, count, s->f.size);
+
+  if ( s->npost ) {
+    s->cursor[0] = posting_seek(s->f.preds[0].posting, 0, from);
+  } else if ( s->f.label ) {
+    bitmap_iterInit(&s->it, &g->labels[s->f.label]);
+    bitmap_iterSeek(&s->it, from);
+  }
+
+  return 0;
+}
+
+/* the next matches, up to n of them. 0 once the walk is over */
+static unsigned int match_scanRead (Graph* g, match_scan_t* s, Vertex** out, unsigned int n)
+{
+  match_pred_t* preds = s->f.preds;
+  unsigned int* cursor = s->cursor;
+  Posting* lead;
+  Vertex* v;
+  unsigned int i, m, k = 0;
+  int j, count = s->f.count;
+  vid_t id, ids[SCAN_BATCH];
+
+  if ( s->npost ) {
+    lead = preds[0].posting;
+    while ( k < n && cursor[0] < lead->len ) {
+      id = lead->ids[cursor[0]++];
+      for ( j = 1; j < s->npost; j++ ) {
+        cursor[j] = posting_seek(preds[j].posting, cursor[j], id);
+        /* a shorter posting ran out, nothing further can match */
+        if ( cursor[j] == preds[j].posting->len ) {
+          cursor[0] = lead->len;
+          return k;
+        }
+        if ( preds[j].posting->ids[cursor[j]] != id ) {
+          break;
+        }
+      }
+      if ( j < s->npost ) {
+        continue;
+      }
+      v = graph_vertexById(g, id);
+      if ( match_test(v, preds + s->npost, count - s->npost) ) {
+        out[k++] = v;
+      }
+    }
+  } else if ( s->f.label ) {
+    while ( k < n && (m = bitmap_iterRead(&s->it, ids, n - k < SCAN_BATCH ? n - k : SCAN_BATCH)) ) {
+      for ( i = 0; i < m; i++ ) {
+        v = graph_vertexById(g, ids[i]);
+        if ( match_test(v, preds, count) ) {
+          out[k++] = v;
+        }
+      }
+    }
+  } else {
+    while ( k < n && s->next < g->nvertices ) {
+      v = graph_vertexById(g, s->next++);
+      if ( match_test(v, preds, count) ) {
+        out[k++] = v;
+      }
+    }
+  }
+
+  return k;
+}
+
+/* every vertex matching a node pattern, in id order */
+VertexContainer* graph_matchVertices (Graph* g, Arena* arena, unsigned char* label, unsigned char** keys, unsigned char** vals, int count)
+{
+  VertexContainer *head = NULL, *tail = NULL;
+  match_scan_t s;
+  Vertex* batch[SCAN_BATCH];
+  unsigned int i, n;
+
+  if ( match_scanInit(g, arena, label, keys, vals, count, 0, &s) ) {
+    return NULL;
+  }
+
+  while ( (n = match_scanRead(g, &s, batch, SCAN_BATCH)) ) {
+    for ( i = 0; i < n; i++ ) {
+      graph_appendVertex(arena, &head, &tail, batch[i]);
+    }
+  }
+
+  return head;
+}
+
+VertexContainer* graph_getVertices (Graph* g, Arena* arena, unsigned char* label, unsigned char* key, unsigned char* val)
+{
+  return graph_matchVertices(g, arena, label, key ? &key : NULL, key ? &val : NULL, key ? 1 : 0);
+}
+
+static int token_isWhite (unsigned char);
+static int token_isAlpha (unsigned char);
+static int token_keyword (const unsigned char*, int, Symbol*);
+static void token_skipWhite (unsigned char**);
+
+static int token_isWhite (unsigned char c)
+{
+  return (c == ' ' || c == '\n' || c == '\t' || c == '\r');
+}
+
+static int token_isAlpha (unsigned char c)
+{
+  return ((c >= 65 && c <= 90) || (c >= 97 && c <= 122));
+}
+
+static void token_skipWhite (unsigned char** c)
+{
+  while ( **c && token_isWhite(**c) ) {
+    (*c)++;
+  }
+}
+
+/* keywords are all upper or all lower case */
+static int token_keyword (const unsigned char* p, int len, Symbol* sym)
+{
+  switch (len) {
+    case 2:
+      if ( (p[0] == 'a' && p[1] == 's') || (p[0] == 'A' && p[1] == 'S') ) {
+        *sym = as_sym;
+        return 1;
+      }
+      if ( (p[0] == 'o' && p[1] == 'n') || (p[0] == 'O' && p[1] == 'N') ) {
+        *sym = on_sym;
+        return 1;
+      }
+      break;
+    case 3:
+      if ( !memcmp(p, "set", 3) || !memcmp(p, "SET", 3) ) {
+        *sym = set_sym;
+        return 1;
+      }
+      break;
+    case 5:
+      if ( !memcmp(p, "match", 5) || !memcmp(p, "MATCH", 5) ) {
+        *sym = match;
+        return 1;
+      }
+      if ( !memcmp(p, "index", 5) || !memcmp(p, "INDEX", 5) ) {
+        *sym = index_sym;
+        return 1;
+      }
+      break;
+    case 6:
+      if ( p[0] == 'c' || p[0] == 'C' ) {
+        if ( !memcmp(p, "create", 6) || !memcmp(p, "CREATE", 6) ) {
+          *sym = create;
+          return 1;
+        }
+      } else if ( !memcmp(p, "return", 6) || !memcmp(p, "RETURN", 6) ) {
+        *sym = return_sym;
+        return 1;
+      } else if ( !memcmp(p, "delete", 6) || !memcmp(p, "DELETE", 6) ) {
+        *sym = delete_sym;
+        return 1;
+      }
+      break;
+  }
+
+  return 0;
+}
+
+/* copy a slice out as a NUL terminated string, decoding backslash escapes
+   of string literals: \n is a newline, any other escaped byte stands for
+   itself. truncates to cap - 1 bytes, returns the length */
+int slice_copy (const Slice* s, unsigned char* dst, int cap)
+{
+  int i, j = 0;
+
+  for ( i = 0; i < s->len && j < cap - 1; i++ ) {
+    if ( s->escaped && s->ptr[i] == '\\' && i + 1 < s->len ) {
+      if ( s->ptr[++i] == 'n' ) {
+        dst[j++] = '\n';
+        continue;
+      }
+    }
+    dst[j++] = s->ptr[i];
+  }
+
+  dst[j] = 0;
+
+  return j;
+}
+
+/* decoded copy of a slice in the arena */
+unsigned char* slice_dup (Arena* a, const Slice* s)
+{
+  unsigned char* dst = arena_alloc(a, s->len + 1);
+
+  if ( dst ) {
+    slice_copy(s, dst, s->len + 1);
+  }
+
+  return dst;
+}
+
+/* reads the next token, pointing into the program instead of copying it.
+   returns 0 at the end of input or on an unknown character */
+int token (unsigned char** i, Token* token)
+{
+  unsigned char* start;
+
+  token->data.ptr = NULL;
+  token->data.len = 0;
+  token->data.escaped = 0;
+
+  token_skipWhite(i);
+
+  switch (**i) {
+    case '(':
+      (*i)++;
+      token->sym = lparen;
+      break;
+    case ')':
+      (*i)++;
+      token->sym = rparen; 
+      break;
+    case '.':
+      (*i)++;
+      token->sym = period;
+      break;
+    case '=':
+      (*i)++;
+      token->sym = equals;
+      break;
+    case '[':
+      (*i)++;
+      token->sym = lbrack; 
+      break;
+    case ']':
+      (*i)++;
+      token->sym = rbrack; 
+      break;
+    case '{':
+      (*i)++;
+      token->sym = lbrace; 
+      break;
+    case '}':
+      (*i)++;
+      token->sym = rbrace; 
+      break;
+    case ':':
+      (*i)++;
+      token->sym = colon; 
+      break;
+    case ',':
+      (*i)++;
+      token->sym = comma;
+      break;
+    case '-':
+      (*i)++;
+      token->sym = dash;
+      break;
+    case '>':
+      (*i)++;
+      token->sym = grthan;
+      break;
+    case '"':
+      start = ++(*i);
+
+      while ( **i && **i != '"' ) {
+        /* backslashes escape quotes, decoded by slice_copy */
+        if ( **i == '\\' && *(*i + 1) ) {
+          token->data.escaped = 1;
+          (*i)++;
+        }
+        (*i)++;
+      }
+
+      if ( !**i ) {
+        /* unterminated string */
+        return 0;
+      }
+
+      token->sym = string;
+      token->data.ptr = start;
+      token->data.len = (int)(*i - start);
+      (*i)++;
+      break;
+    default:
+      if ( !token_isAlpha(**i) ) {
+        return 0;
+      }
+
+      start = *i;
+
+      while ( token_isAlpha(**i) ) {
+        (*i)++;
+      }
+
+      if ( !token_keyword(start, (int)(*i - start), &token->sym) ) {
+        token->sym = ident;
+        token->data.ptr = start;
+        token->data.len = (int)(*i - start);
+      }
+      break;
+  }
+
+  return 1;
+}
+
+typedef struct {
+  /* current token, NULL at the end of input */
+  Token* tok;
+  Token tokbuf;
+
+  char cmd[10];
+
+  /* program pointer */
+  unsigned char** prog;
+
+  /* current data */
+  Slice cache;
+  /* previous data */
+  Slice prev;
+
+  /* for execution */
+  node_data_t *node_root, *node_curr;
+  edge_data_t *edge_root, *edge_curr;
+
+  /* updating nodes */
+  node_set_data_t *update_node_root, *update_node_curr;
+  edge_set_data_t *update_edge_root, *update_edge_curr;
+
+  /* query state, reset once the query has run */
+  Arena* arena;
+
+  /* query results and errors */
+  Output* out;
+
+  /* where a match resumes, NULL to run it whole */
+  Cursor* cursor;
+
+  /* error recovery */
+  jmp_buf err;
+
+} __Global;
+
+/* for error reporting */
+const char* symstr[] = {
+  "(",      ")",       "[",
+  "]",      "{",       "}",
+  ":",      "create",  "match",
+  "ident",  "string",  "set",
+  ",",      "-",       ">",
+  "return", ".",       "=",
+  "as",     "index",   "on",
+  "delete"
+};
+
+static void getsym (__Global*);
+static void setcmd (__Global*, const char* cmd);
+static void error (__Global*, const char *, const char *, int);
+static void* need (__Global*, void*);
+
+static int peek (__Global*, Symbol);
+static int accept (__Global*, Symbol);
+static int expect (__Global*, Symbol);
+
+static void _create (__Global*);
+static void _match (__Global*);
+static void _nodeList (__Global*);
+static void _matchNodeList (__Global*);
+static void _node (__Global*);
+static void _type (__Global*);
+static void _data (__Global*);
+static void _keyValueList(__Global*);
+static void _expr (Graph*, __Global*);
+static void _identList (__Global*);
+static void _return (__Global*);
+static void _set (__Global*);
+static void _setList (__Global*);
+static void _property (__Global*);
+static void _edge (__Global*);
+static void _index (Graph*, __Global*);
+static void _delete (__Global*);
+
+static void error (__Global* data, const char* err, const char* s, int len)
+{
+  output_printf(data->out, "error: %s%s%.*s\n", err, len ? " " : "", len, s);
+  longjmp(data->err, 1);
+}
+
+/* what an exec_ call could not allocate ends the statement like any other
+   error, and the arena is reset with it */
+static void* need (__Global* data, void* p)
+{
+  if ( !p ) {
+    error(data, "out of memory", "", 0);
+  }
+
+  return p;
+}
+
+static void setcmd (__Global* data, const char* cmd)
+{
+  int len = strlen(cmd);
+  strncpy(data->cmd, cmd, len);
+  data->cmd[len] = 0;
+}
+
+static int accept (__Global* data, Symbol s)
+{
+  if ( data->tok && data->tok->sym == s ) {
+    if ( data->tok->data.ptr ) {
+      if ( data->cache.ptr ) {
+        data->prev = data->cache;
+      }
+      data->cache = data->tok->data;
+    }
+    getsym(data);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int peek (__Global* data, Symbol s)
+{
+  if ( data->tok && data->tok->sym == s ) {
+    return 1;
+  }
+
+  return 0;
+}
+
+static int expect (__Global* data, Symbol s)
+{
+  if ( accept(data, s) ) {
+    return 1;
+  }
+
+  if ( data->tok ) {
+    error(data, "expect: unexpected symbol", symstr[data->tok->sym], strlen(symstr[data->tok->sym]));
+  } else {
+    error(data, "expect: expected symbol", symstr[s], strlen(symstr[s]));
+  }
+
+  return 0;
+}
+
+static void _edge (__Global* data) 
+{
+  expect(data, lbrack);
+  expect(data, ident);
+  expect(data, rbrack);
+  expect(data, dash);
+  expect(data, grthan);
+
+  if ( strncmp(data->cmd, "set", 3) && strncmp(data->cmd, "delete", 6) ) {
+     /***/
+    data->edge_curr = need(data, exec_addEdge(data->arena, data->edge_root, NULL));
+    if ( exec_addLabelToEdge(data->arena, data->edge_curr, &data->cache) ) {
+      error(data, "out of memory", "", 0);
+    }
+    /***/
+
+    if ( !data->edge_root ) {
+      data->edge_root = data->edge_curr;
+    }
+  }
+
+  if ( !strncmp(data->cmd, "create", 6) || !strncmp(data->cmd, "match", 5) ) {
+    /* setCurrentNodeAsLeftNodeToCurrentEdge() */
+    exec_setLeftNode(data->node_curr, data->edge_curr);
+    /***/
+  }
+}
+
+static void _identList (__Global* data)
+{
+  expect(data, ident);
+
+  if ( accept(data, period) ) {
+    expect(data, ident);
+  }
+
+  if ( accept(data, comma) ) {
+    _identList(data);
+  }
+}
+
+static void _return (__Global* data)
+{
+  if ( accept(data, return_sym) ) {
+    _identList(data);
+  }
+}
+
+static void _set (__Global* data)
+{
+  Slice iden, prop, val;
+  Slice left, right, label;
+
+  if ( accept(data, lparen) ) {
+    expect(data, ident);
+    left = data->cache;
+    expect(data, rparen);
+    expect(data, dash);
+    _edge(data);
+    label = data->cache;
+    expect(data, lparen);
+    expect(data, ident);
+    right = data->cache;
+    expect(data, rparen);
+    data->update_edge_curr = need(data, exec_addEdgeUpdate(data->arena, data->update_edge_root, &label, &left, &right));
+    if ( !data->update_edge_root ) {
+      data->update_edge_root = data->update_edge_curr;
+    }
+    return;
+  }
+
+  _property(data);
+
+  iden = data->prev;
+  prop = data->cache;
+
+  expect(data, equals);
+  expect(data, string);
+
+  val = data->cache;
+
+  data->update_node_curr = need(data, exec_addNodeUpdate(data->arena, data->update_node_root, &iden, &prop, &val));
+
+  if ( !data->update_node_root ) {
+    data->update_node_root = data->update_node_curr;
+  }
+}
+
+/* DELETE ident | DELETE (ident)-[label]->(ident), comma separated */
+static void _delete (__Global* data)
+{
+  Slice left, right, label;
+
+  if ( accept(data, lparen) ) {
+    expect(data, ident);
+    left = data->cache;
+    expect(data, rparen);
+    expect(data, dash);
+    _edge(data);
+    label = data->cache;
+    expect(data, lparen);
+    expect(data, ident);
+    right = data->cache;
+    expect(data, rparen);
+    if ( !exec_findNode(data->node_root, &left) || !exec_findNode(data->node_root, &right) ) {
+      error(data, "unidentified variable", (const char *)left.ptr, left.len);
+    }
+    data->update_edge_curr = need(data, exec_addEdgeUpdate(data->arena, data->update_edge_root, &label, &left, &right));
+    if ( !data->update_edge_root ) {
+      data->update_edge_root = data->update_edge_curr;
+    }
+  } else {
+    expect(data, ident);
+    if ( !exec_findNode(data->node_root, &data->cache) ) {
+      error(data, "unidentified variable", (const char *)data->cache.ptr, data->cache.len);
+    }
+    data->update_node_curr = need(data, exec_addNodeUpdate(data->arena, data->update_node_root, &data->cache, NULL, NULL));
+    if ( !data->update_node_root ) {
+      data->update_node_root = data->update_node_curr;
+    }
+  }
+
+  if ( accept(data, comma) ) {
+    _delete(data);
+  }
+}
+
+static void _setList (__Global* data)
+{
+  if ( accept(data, set_sym) ) {
+    setcmd(data, "set");
+    _set(data);
+    _setList(data);
+  }
+}
+
+static void _property (__Global* data)
+{
+  expect(data, ident);
+  expect(data, period);
+  expect(data, ident);
+}
+
+static void _keyValueList (__Global* data)
+{
+  expect(data, ident);
+  expect(data, colon);
+  expect(data, string);
+
+  /* addPropertyToCurrentNode(key: data->prev, val: data->cache) */
+  if ( exec_addProperty(data->arena, data->node_curr, &data->prev, &data->cache) ) {
+    error(data, "out of memory", "", 0);
+  }
+  /***/
+
+  if ( accept(data, comma) ) {
+    _keyValueList(data);
+  }
+}
+
+static void _data (__Global* data)
+{
+  expect(data, lbrace);
+  _keyValueList(data);
+  expect(data, rbrace);
+}
+
+static void _type (__Global* data)
+{
+  expect(data, ident);
+
+  if ( accept(data, as_sym) ) {
+    expect(data, ident);
+    /* addNodeAndSetCurrent(ident: data->prev) */
+    /* addLabelToCurrent(label: data->cache) */
+    data->node_curr = need(data, exec_addNode(data->arena, data->node_root, &data->cache));
+    if ( exec_addLabelToNode(data->arena, data->node_curr, &data->prev) ) {
+      error(data, "out of memory", "", 0);
+    }
+    /* because the new node created may be the first node created */
+    if ( data->node_curr && !data->node_root ) {
+      data->node_root = data->node_curr;
+    }
+    /***/
+    _data(data);
+  } else if ( peek(data, lbrace) ) {
+    data->node_curr = need(data, exec_addNode(data->arena, data->node_root, NULL));
+    if ( exec_addLabelToNode(data->arena, data->node_curr, &data->cache) ) {
+      error(data, "out of memory", "", 0);
+    }
+    /* because the new node created may be the first node created */
+    if ( data->node_curr && !data->node_root ) {
+      data->node_root = data->node_curr;
+    }
+    /***/
+    _data(data);
+  } else {
+    if ( !strncmp(data->cmd, "create", 6) ) {
+      /* setCurrentNode(ident: data->cache) */
+      data->node_curr = exec_findNode(data->node_root, &data->cache);
+      if ( !data->node_curr ) {
+        error(data, "unidentified variable", (const char *)data->cache.ptr, data->cache.len);
+      }
+      /***/
+    } else {
+      data->node_curr = need(data, exec_addNode(data->arena, data->node_root, &data->cache));
+      /* because the new node created may be the first node created */
+      if ( data->node_curr && !data->node_root ) {
+        data->node_root = data->node_curr;
+      }
+      /***/
+    }
+  }
+}
+
+static void _node (__Global* data)
 {
-  if ( !vertex->properties ) {
-    return NULL;
+  expect(data, lparen);
+  _type(data);
+  expect(data, rparen);
+}
+
+static void _nodeList (__Global* data)
+{
+  _node(data);
+
+  if ( accept(data, comma) ) {
+    _nodeList(data);
+    return;
   }
 
-  VertexContainer* v = malloc(sizeof(VertexContainer));
-  v->vertex = vertex;
-  v->next = NULL;
-  return v;
+  if ( !accept(data, dash) ) {
+    return;
+  }
+
+  _edge(data);
+  _node(data);
+
+  /* setCurrentNodeAsRightNodeToCurrentEdge() */
+  exec_setRightNode(data->node_curr, data->edge_curr);
+  /***/
+
+  if ( accept(data, comma) ) {
+    _nodeList(data);
+  }
 }
 
-VertexContainer* graph_getVertices (Graph* g, unsigned char* label, unsigned char* key, unsigned char* val)
+static void _matchNodeList (__Global* data)
 {
-  VertexContainer *head = NULL, *tail = NULL;
-  map_node_t* ptr = g->vertices->head;
-  Vertex* type;
-  Edge* edge_iter;
-  unsigned char* prop = NULL;
-
-  if ( label ) {
-    type = graph_getVertex(g, label);
-    if ( !type ) {
-      return NULL;
+  _node(data);
+
+  if ( accept(data, comma) ) {
+    _matchNodeList(data);
+    return;
+  }
+
+  if ( !accept(data, dash) ) {
+    return;
+  }
+
+  _edge(data);
+  _node(data);
+
+  /* setCurrentNodeAsRightNodeToCurrentEdge() */
+  exec_setRightNode(data->node_curr, data->edge_curr);
+  /***/
+
+  if ( accept(data, comma) ) {
+    _matchNodeList(data);
+  }
+}
+
+static void _index (Graph* g, __Global* data)
+{
+  Slice label;
+
+  expect(data, on_sym);
+
+  /* CREATE INDEX ON -[label]-> keeps those edges sorted */
+  if ( accept(data, dash) ) {
+    expect(data, lbrack);
+    expect(data, ident);
+    label = data->cache;
+    expect(data, rbrack);
+    expect(data, dash);
+    expect(data, grthan);
+    exec_sortEdges(g, need(data, slice_dup(data->arena, &label)), data->out);
+    return;
+  }
+
+  expect(data, ident);
+  label = data->cache;
+  expect(data, lparen);
+  expect(data, ident);
+  expect(data, rparen);
+
+  exec_createIndex(g, need(data, slice_dup(data->arena, &label)), need(data, slice_dup(data->arena, &data->cache)), data->out);
+}
+
+static void _create (__Global* data)
+{
+  setcmd(data, "create");
+  _nodeList(data);
+}
+
+static void _match (__Global* data)
+{
+  setcmd(data, "match");
+  _matchNodeList(data);
+}
+
+static void _expr (Graph* g, __Global* data)
+{
+  node_set_data_t* uroot;
+  edge_set_data_t* eroot;
+
+  if ( accept(data, create) ) {
+    if ( accept(data, index_sym) ) {
+      _index(g, data);
+      return;
     }
-    edge_iter = type->edges;
-    while ( edge_iter ) {
-      if ( prop ) {
-        prop = NULL;
-      }
-      if ( key ) {
-        prop = graph_vertexGetProperty(edge_iter->to, key);
-      }
-      if ( !key || (prop && !nuonStrncmp(prop, val)) ) {
-        if ( !head ) {
-          head = graph_vertexContainerInit(edge_iter->to);
-          tail = head;
-        } else {
-          tail->next = graph_vertexContainerInit(edge_iter->to);
-          tail = tail->next;
-        }
-      }
-      edge_iter = edge_iter->next;
-    } 
-  } else {
-    while ( ptr ) {
-      if ( prop ) {
-        prop = NULL;
-      }
-      if ( ptr->data ) {
-        if ( key ) {
-          prop = graph_vertexGetProperty(ptr->data, key);
-        }
-        if ( !key || (prop && !nuonStrncmp(prop, val)) ) {
-          if ( !head ) {
-            head = graph_vertexContainerInit(ptr->data);
-            tail = head;
-          } else {
-            tail->next = graph_vertexContainerInit(ptr->data);
-            tail = tail->next;
-          }
-        }
-      }
-      ptr = ptr->next[0];
+    _create(data);
+    exec_cmd(g, data->arena, data->cmd, data->node_root, data->edge_root, data->update_node_root, data->update_edge_root, data->out);
+  }
+
+  /* the whole statement is parsed before any of it runs, so it either
+     runs under one lock or not at all */
+  else if ( accept(data, match) ) {
+    _match(data);
+    _setList(data);
+    uroot = data->update_node_root;
+    eroot = data->update_edge_root;
+    if ( accept(data, delete_sym) ) {
+      setcmd(data, "delete");
+      data->update_node_root = NULL;
+      data->update_edge_root = NULL;
+      _delete(data);
+    } else {
+      data->update_node_root = NULL;
+      data->update_edge_root = NULL;
     }
-  } 
+    _return(data);
+    exec_matchUpdate(g, data->arena, data->node_root, data->edge_root, uroot, eroot, data->update_node_root, data->update_edge_root, data->out, data->cursor);
+  }
 
-  return head;
+  else if ( data->tok && data->tok->data.ptr ) {
+    error(data, "unknown command", (const char *)data->tok->data.ptr, data->tok->data.len);
+  }
 }
 
-#define IS_CREATE_TOK(x) !strncmp((const char*)x, "CREATE", 6) || !strncmp((const char*)x, "create", 6)
-#define IS_MATCH_TOK(x) !strncmp((const char*)x, "MATCH", 5) || !strncmp((const char*)x, "match", 5)
-#define IS_RETURN_TOK(x) !strncmp((const char*)x, "RETURN", 6) || !strncmp((const char*)x, "return", 6)
-#define IS_SET_TOK(x) !strncmp((const char*)x, "SET", 3) || !strncmp((const char*)x, "set", 3)
-#define IS_AS_TOK(x) !strncmp((const char*)x, "AS", 2) || !strncmp((const char*)x, "as", 2)
+static void getsym (__Global* data)
+{
+  data->tok = token(data->prog, &data->tokbuf) ? &data->tokbuf : NULL;
+}
 
-int token_isWhite (unsigned char);
-void token_skipWhite (unsigned char**);
+/* every worker thread reuses its own arena from query to query */
+static __thread Arena query_arena;
 
-int token_isWhite (unsigned char c)
+int parse (Graph* g, unsigned char* p, Output* out) 
 {
-  return (c == ' ' || c == '\n' || c == '\t');
+  return parse_resume(g, p, out, NULL);
 }
 
-void token_skipWhite (unsigned char** c)
+int parse_resume (Graph* g, unsigned char* p, Output* out, Cursor* cur)
 {
-  while ( **c && token_isWhite(**c) ) {
-    (*c)++;
+  __Global data;
+
+  data.prog = &p;
+  data.tok = NULL;
+  memset(&data.cache, 0, sizeof(Slice));
+  memset(&data.prev, 0, sizeof(Slice));
+  data.node_root = NULL;
+  data.node_curr = NULL;
+  data.edge_root = NULL;
+  data.edge_curr = NULL;
+  data.update_node_root = NULL;
+  data.update_node_curr = NULL;
+  data.update_edge_root = NULL;
+  data.update_edge_curr = NULL;
+
+  data.arena = &query_arena;
+  data.out = out;
+  data.cursor = cur && cur->limit ? cur : NULL;
+
+  if ( cur ) {
+    cur->more = 0;
+  }
+
+  memset(data.cmd, 0, 10);
+
+  if ( setjmp(data.err) ) {
+    arena_reset(&query_arena);
+    if ( cur ) {
+      cur->stage = 0;
+      cur->from = 0;
+    }
+    return -1;
+  }
+
+  getsym(&data);
+  _expr(g, &data);
+
+  arena_reset(&query_arena);
+
+  if ( cur && !cur->more ) {
+    cur->stage = 0;
+    cur->from = 0;
   }
+
+  return 0;
 }
 
-Token* token (unsigned char** i)
+node_data_t* exec_addNode(Arena* arena, node_data_t* root, Slice* ident) 
 {
-  Token* token = malloc(sizeof(Token));
-  token->data = NULL;
+  node_data_t* node;
+  node_data_t* found;
 
-  token_skipWhite(i);
+  if ( ident && (found = exec_findNode(root, ident)) ) {
+    return found;
+  }
 
-  switch (**i) {
-    case '(':
-      (*i)++;
-      token->sym = lparen;
-      break;
-    case ')':
-      (*i)++;
-      token->sym = rparen; 
-      break;
-    case '.':
-      (*i)++;
-      token->sym = period;
-      break;
-    case '=':
-      (*i)++;
-      token->sym = equals;
-      break;
-    case '[':
-      (*i)++;
-      token->sym = lbrack; 
-      break;
-    case ']':
-      (*i)++;
-      token->sym = rbrack; 
-      break;
-    case '{':
-      (*i)++;
-      token->sym = lbrace; 
-      break;
-    case '}':
-      (*i)++;
-      token->sym = rbrace; 
-      break;
-    case ':':
-      (*i)++;
-      token->sym = colon; 
-      break;
-    case ',':
-      (*i)++;
-      token->sym = comma;
-      break;
-    case '-':
-      (*i)++;
-      token->sym = dash;
-      break;
-    case '>':
-      (*i)++;
-      token->sym = grthan;
-      break;
-    case '"':
-      do {
-        unsigned char* str = malloc(1024);
-        int j = 0;
+  node = arena_alloc(arena, sizeof(node_data_t));
 
-        (*i)++;
+  if ( !node || !(node->ident = ident ? slice_dup(arena, ident) : (unsigned char*)"") ) {
+    return NULL;
+  }
+
+  node->label = (unsigned char*)"";
+  node->keys = NULL;
+  node->vals = NULL;
+  node->propcount = 0;
+  node->propcap = 0;
+  node->ptr = NULL;
+  node->vrtxdata = NULL;
+  node->next = NULL;
+
+  if ( root ) {
+    while ( root->next ) { root = root->next; }
+    root->next = node;
+  }
+
+  return node;
+}
+
+node_set_data_t* exec_addNodeUpdate(Arena* arena, node_set_data_t* root, Slice* ident, Slice* key, Slice* value)
+{
+  node_set_data_t* node;
+
+  node = arena_alloc(arena, sizeof(node_set_data_t));
+
+  if ( !node || !(node->ident = slice_dup(arena, ident)) ) {
+    return NULL;
+  }
+
+  node->prop = key ? slice_dup(arena, key) : NULL;
+  node->val = value ? slice_dup(arena, value) : NULL;
+
+  if ( (key && !node->prop) || (value && !node->val) ) {
+    return NULL;
+  }
+
+  node->next = NULL;
+
+  if ( root ) {
+    while ( root->next ) { root = root->next; }
+    root->next = node;
+  }
+
+  return node;
+}
+
+edge_set_data_t* exec_addEdgeUpdate(
+  Arena* arena,
+  edge_set_data_t* root, 
+  Slice* label, 
+  Slice* left, 
+  Slice* right
+){
+  edge_set_data_t* edge;
+
+  edge = arena_alloc(arena, sizeof(edge_set_data_t));
+
+  if ( !edge ) {
+    return NULL;
+  }
+
+  edge->label = slice_dup(arena, label);
+  edge->left = slice_dup(arena, left);
+  edge->right = slice_dup(arena, right);
+
+  if ( !edge->label || !edge->left || !edge->right ) {
+    return NULL;
+  }
+
+  edge->next = NULL;
+
+  if ( root ) {
+    while ( root->next ) { root = root->next; }
+    root->next = edge;
+  }
 
-        while ( **i != '"' && j < 1024 ) {
-          str[j++] = *((*i)++);
+  return edge;
+}
 
-          /* backslashes escape quotes */
-          if ( *((*i) - 1) == '\\' ) {
-            str[j - 1] = *((*i)++);
-          }
-        }
+int exec_addLabelToNode(Arena* arena, node_data_t* node, Slice* label) 
+{
+  node->label = slice_dup(arena, label);
 
-        str[j] = 0;
-        (*i)++;
+  return node->label ? 0 : -1;
+}
 
-        token->sym = string;
-        token->data = str;
-      } while (0);
-      break;
-    default:
-      if ( IS_CREATE_TOK(*i) ) {
-        token->sym = create;
-        (*i) += 6;
-      } else if ( IS_SET_TOK(*i) ) {
-        token->sym = set_sym;
-        (*i) += 3;
-      } else if ( IS_AS_TOK(*i) ) {
-        token->sym = as_sym;
-        (*i) += 2;
-      } else if ( IS_RETURN_TOK(*i) ) {
-        token->sym = return_sym;
-        (*i) += 6;
-      } else if ( IS_MATCH_TOK(*i) ) {
-        token->sym = match;
-        (*i) += 5;
-      } else if ( (**i >= 65 && **i <= 90) || (**i >= 97 && **i <= 122) ) {
-        unsigned char* str = malloc(1024);
-        int j = 0;
-
-        while ( ((**i >= 65 && **i <= 90) || (**i >= 97 && **i <= 122)) && j < 1024) {
-          str[j++] = *((*i)++);
-        }
+node_data_t* exec_findNode(node_data_t* root, Slice* ident) 
+{
+  node_data_t* iter;
 
-        str[j] = 0;
+  iter = root;
 
-        token->sym = ident;
-        token->data = str;
-      } else {
-        token = NULL;
-      }
+  while ( iter ) {
+    if ( (int)strlen((char *)iter->ident) == ident->len &&
+      !memcmp(iter->ident, ident->ptr, ident->len) ) {
       break;
+    }
+    iter = iter->next;
   }
-
-  return token;
+  return iter;
 }
 
-typedef struct {
-  /* current token */
-  Token* tok;
+/* -1 when the arena is out of memory */
+int exec_addProperty(Arena* arena, node_data_t* node, Slice* key, Slice* val) 
+{
+  unsigned char **keys, **vals;
+  int index, cap;
 
-  char cmd[10];
+  index = node->propcount;
 
-  /* program pointer */
-  unsigned char** prog;
+  /* grow by doubling, the old arrays are released with the arena */
+  if ( index == node->propcap ) {
+    cap = node->propcap ? node->propcap * 2 : 4;
+    keys = arena_alloc(arena, sizeof(unsigned char*) * cap);
+    vals = arena_alloc(arena, sizeof(unsigned char*) * cap);
+    if ( !keys || !vals ) {
+      return -1;
+    }
+    if ( index ) {
+      memcpy(keys, node->keys, sizeof(unsigned char*) * index);
+      memcpy(vals, node->vals, sizeof(unsigned char*) * index);
+    }
+    node->keys = keys;
+    node->vals = vals;
+    node->propcap = cap;
+  }
 
-  /* current data */
-  unsigned char* cache;
-  /* previous data */
-  unsigned char* prev;
+  node->keys[index] = slice_dup(arena, key);
+  node->vals[index] = slice_dup(arena, val);
 
-  /* for execution */
-  node_data_t *node_root, *node_curr;
-  edge_data_t *edge_root, *edge_curr;
+  if ( !node->keys[index] || !node->vals[index] ) {
+    return -1;
+  }
 
-  /* updating nodes */
-  node_set_data_t *update_node_root, *update_node_curr;
-  edge_set_data_t *update_edge_root, *update_edge_curr;
+  (node->propcount)++;
 
-} __Global;
+  return 0;
+}
 
-/* for error reporting */
-const char* symstr[] = {
-  "(",      ")",       "[",
-  "]",      "{",       "}",
-  ":",      "create",  "match",
-  "ident",  "string",  "set",
-  ",",      "-",       ">",
-  "return", ".",       "=",
-  "as"
-};
+edge_data_t* exec_addEdge(Arena* arena, edge_data_t* root, Slice* ident) 
+{
+  edge_data_t* edge;
 
-void getsym (__Global*);
-void setcmd (__Global*, const char* cmd);
-void error (const char *, const char *);
+  edge = arena_alloc(arena, sizeof(edge_data_t));
 
-int peek (__Global*, Symbol);
-int accept (__Global*, Symbol);
-int expect (__Global*, Symbol);
+  if ( !edge || !(edge->ident = ident ? slice_dup(arena, ident) : (unsigned char*)"") ) {
+    return NULL;
+  }
 
-void _create (__Global*);
-void _match (__Global*);
-void _nodeList (__Global*);
-void _matchNodeList (__Global*);
-void _node (__Global*);
-void _type (__Global*);
-void _data (__Global*);
-void _keyValueList(__Global*);
-void _expr (Graph*, __Global*);
-void _identList (__Global*);
-void _return (__Global*);
-void _set (__Global*);
-void _setList (__Global*);
-void _property (__Global*);
-void _edge (__Global*);
+  edge->label = (unsigned char*)"";
+  edge->node_r = NULL;
+  edge->node_l = NULL;
+  edge->next = NULL;
 
-void error (const char* err, const char* s)
-{
-  fprintf(stderr, "error: %s %s\n", err, s);
-  exit(1);
+  if ( root ) {
+    while ( root->next ) { root = root->next; }
+    root->next = edge;
+  }
+
+  return edge;
 }
 
-void setcmd (__Global* data, const char* cmd)
+void exec_setRightNode(node_data_t* node, edge_data_t* edge) 
 {
-  int len = strlen(cmd);
-  strncpy(data->cmd, cmd, len);
-  data->cmd[len] = 0;
+  edge->node_r = node;
 }
 
-int accept (__Global* data, Symbol s)
+void exec_setLeftNode(node_data_t* node, edge_data_t* edge) 
 {
-  if ( data->tok && data->tok->sym == s ) {
-    if ( data->tok->data ) {
-      if ( data->cache ) {
-        data->prev = data->cache;
-      }
-      data->cache = data->tok->data;
-    }
-    getsym(data);
-    return 1;
-  }
-
-  return 0;
+  edge->node_l = node;
 }
 
-int peek (__Global* data, Symbol s)
+int exec_addLabelToEdge(Arena* arena, edge_data_t* edge, Slice* label) 
 {
-  if ( data->tok && data->tok->sym == s ) {
-    return 1;
-  }
+  edge->label = slice_dup(arena, label);
 
-  return 0;
+  return edge->label ? 0 : -1;
 }
 
-int expect (__Global* data, Symbol s)
+/* edges are printed as nested objects; a vertex that is already being
+   printed further up is cut short so cycles terminate. a row prints at
+   most PRINT_BUDGET vertices in all, past that they are cut short too,
+   or a dense graph would print every path up to PRINT_DEPTH */
+#define PRINT_DEPTH 32
+#define PRINT_BUDGET 1024
+
+/* a value as a string literal the tokenizer reads back the same */
+static void exec_printValue (Output* out, const unsigned char* v)
 {
-  if ( accept(data, s) ) {
-    return 1;
-  }
+  const unsigned char* run = v;
 
-  if ( data->tok ) {
-    error("expect: unexpected symbol", symstr[data->tok->sym]);
-  } else {
-    error("expect: expected symbol", symstr[s]);
+  output_append(out, "\"", 1);
+  for ( ; *v; v++ ) {
+    if ( *v != '"' && *v != '\\' && *v != '\n' ) {
+      continue;
+    }
+    output_append(out, run, v - run);
+    output_append(out, *v == '\n' ? "\\n" : *v == '"' ? "\\\"" : "\\\\", 2);
+    run = v + 1;
   }
-
-  return 0;
+  output_append(out, run, v - run);
+  output_append(out, "\"", 1);
 }
 
-void _edge (__Global* data) 
+/* the k:"v" pairs of a vertex, returns how many were written */
+static unsigned int exec_printProps (Output* out, Vertex* vertex)
 {
-  expect(data, lbrack);
-  expect(data, ident);
-  expect(data, rbrack);
-  expect(data, dash);
-  expect(data, grthan);
+  Property* prop;
+  unsigned int slot, n = 0;
 
-  if ( strncmp(data->cmd, "set", 3) ) {
-     /***/
-    data->edge_curr = exec_addEdge(data->edge_root, NULL);
-    exec_addLabelToEdge(data->edge_curr, data->cache);
-    /***/
-
-    if ( !data->edge_root ) {
-      data->edge_root = data->edge_curr;
+  for ( slot = 0; slot < VERTEX_PROPSLOTS(vertex); slot++ ) {
+    prop = &vertex->props[slot];
+    if ( !prop->key ) {
+      continue;
+    }
+    if ( n++ ) {
+      output_printf(out, ",");
     }
+    output_printf(out, "%s:", sym_name(prop->key));
+    exec_printValue(out, PROPERTY_VAL(prop));
   }
 
-  if ( !strncmp(data->cmd, "create", 6) ) {
-    /* setCurrentNodeAsLeftNodeToCurrentEdge() */
-    exec_setLeftNode(data->node_curr, data->edge_curr);
-    /***/
-  }
+  return n;
 }
 
-void _identList (__Global* data)
+static void exec_printVertex (Graph* g, Output* out, Snapshot* snap, Vertex* vertex, Vertex** path, int depth, unsigned int* budget)
 {
-  expect(data, ident);
+  AdjBlock* block;
+  Csr* c;
+  unsigned int slot, bucket, n;
+  size_t k;
+  int i;
 
-  if ( accept(data, period) ) {
-    expect(data, ident);
-  }
+  for ( i = 0; i < depth && path[i] != vertex; i++ );
 
-  if ( accept(data, comma) ) {
-    _identList(data);
+  if ( i < depth || !*budget ) {
+    output_printf(out, "{}");
+    return;
   }
-}
 
-void _return (__Global* data)
-{
-  if ( accept(data, return_sym) ) {
-    _identList(data);
+  (*budget)--;
+  output_printf(out, "{");
+  path[depth] = vertex;
+  n = exec_printProps(out, vertex);
+  for ( bucket = 0; depth + 1 < PRINT_DEPTH && bucket < vertex->nadj; bucket++ ) {
+    /* a label untouched since the snapshot is read from its csr in one
+       sequential run instead of walking the blocks */
+    if ( (c = snapshot_current(g, snap, vertex->adj[bucket].label)) ) {
+      if ( vertex->id >= c->nvertices ) {
+        continue;
+      }
+      for ( k = c->offsets[vertex->id]; k < c->offsets[vertex->id + 1]; k++ ) {
+        if ( n++ ) {
+          output_printf(out, ",");
+        }
+        output_printf(out, "%s:", sym_name(c->label));
+        exec_printVertex(g, out, snap, graph_vertexById(g, c->targets[k]), path, depth + 1, budget);
+      }
+      continue;
+    }
+    for ( block = vertex->adj[bucket].head; block; block = block->next ) {
+      for ( slot = 0; slot < block->len; slot++ ) {
+        if ( (block->to[slot] & VID_DEAD) || graph_vertexById(g, block->to[slot])->dead ) {
+          continue;
+        }
+        if ( n++ ) {
+          output_printf(out, ",");
+        }
+        output_printf(out, "%s:", sym_name(vertex->adj[bucket].label));
+        exec_printVertex(g, out, snap, graph_vertexById(g, block->to[slot]), path, depth + 1, budget);
+      }
+    }
   }
+  output_printf(out, "}");
 }
 
-void _set (__Global* data)
+/* the caller holds the graph lock. the snapshot is the one the compactor
+   last refreshed, labels written since then are read from the buckets */
+void exec_printData (Graph* g, Output* out, VertexContainer *vertices, int newline)
 {
-  unsigned char *iden, *prop, *val;
-  unsigned char *left, *right, *label;
+  Vertex* path[PRINT_DEPTH];
+  VertexContainer* vc_iter;
+  Snapshot* snap = vertices ? snapshot_peek(g) : NULL;
+  unsigned int budget;
+  vc_iter = vertices;
 
-  if ( accept(data, lparen) ) {
-    expect(data, ident);
-    left = data->cache;
-    expect(data, rparen);
-    expect(data, dash);
-    _edge(data);
-    label = data->cache;
-    expect(data, lparen);
-    expect(data, ident);
-    right = data->cache;
-    expect(data, rparen);
-    data->update_edge_curr = exec_addEdgeUpdate(data->update_edge_root, label, left, right);
-    if ( !data->update_edge_root ) {
-      data->update_edge_root = data->update_edge_curr;
+  while ( vc_iter ) {
+    budget = PRINT_BUDGET;
+    exec_printVertex(g, out, snap, vc_iter->vertex, path, 0, &budget);
+
+    if (newline) {
+      output_printf(out, "\n");
     }
-    return;
-  }
 
-  _property(data);
+    vc_iter = vc_iter->next;
+  }
 
-  iden = data->prev;
-  prop = data->cache;
+  snapshot_release(snap);
+}
 
-  expect(data, equals);
-  expect(data, string);
+/* MATCH (a)-[L]->(b), ... binds every node that takes part in an edge,
+   one row per way to bind them all. a plan starts by scanning an anchor
+   node and then binds one more node per step by expanding an edge from
+   a bound one, or checks an edge whose ends are both bound. rows flow
+   between steps in batches of EXPAND_BATCH */
+#define EXPAND_BATCH 64
 
-  val = data->cache;
+enum { STEP_SCAN, STEP_EXPAND, STEP_CHECK };
 
-  data->update_node_curr = exec_addNodeUpdate(data->update_node_root, iden, prop, val);
+typedef struct {
+  int kind;
+  int from;   /* bound slot an expand or check starts from */
+  int to;     /* slot a scan or expand binds, or the other end of a check */
+  int in;     /* expand over the in edges of from */
+  sym_t label;
+} match_step_t;
+
+/* the rows of a pattern, kept for the SET or DELETE that follows it.
+   a block holds EXPAND_BATCH rows of nnodes vertices, by slot */
+typedef struct row_block row_block_t;
+struct row_block {
+  row_block_t* next;
+  int n;
+  Vertex* v[];
+};
 
-  if ( !data->update_node_root ) {
-    data->update_node_root = data->update_node_curr;
-  }
-}
+typedef struct {
+  node_data_t** nodes;
+  int nnodes;
+  row_block_t *head, *tail;
+} match_rows_t;
 
-void _setList (__Global* data)
+typedef struct {
+  Graph* g;
+  Arena* arena;
+  Output* out;
+  match_rows_t* rows;  /* where rows are kept, or NULL */
+
+  /* slot -> node pattern, in query order */
+  node_data_t** nodes;
+  match_filter_t* filters;
+  VertexContainer** cands;  /* what a scan of the slot binds */
+  int nnodes;
+
+  /* the edges, as slot pairs */
+  int* ends;
+  sym_t* labels;
+  int nedges;
+
+  match_step_t* steps;
+  int nsteps;
+  int anchor;   /* slot the plan has to start from, or -1 */
+
+  /* per step: its output batch, and the buckets of its input rows */
+  Vertex** batches;
+  Adjacency** adj;
+
+  /* per step: the snapshot csr an out expand reads instead of the
+     buckets, when it is current */
+  Snapshot* snap;
+  Csr** csr;
+
+  /* vertices bound in some row, by slot */
+  Bitmap* seen;
+} match_plan_t;
+
+static int match_slot (match_plan_t* p, node_data_t* node)
 {
-  if ( accept(data, set_sym) ) {
-    setcmd(data, "set");
-    _set(data);
-    _setList(data);
+  int i;
+
+  for ( i = 0; i < p->nnodes; i++ ) {
+    if ( p->nodes[i] == node ) {
+      return i;
+    }
   }
-}
 
-void _property (__Global* data)
-{
-  expect(data, ident);
-  expect(data, period);
-  expect(data, ident);
+  return -1;
 }
 
-void _keyValueList (__Global* data)
+/* rows left after an edge step, from the average degree of the label and
+   the share of all vertices the far end matches. a check keeps the rows
+   whose far end happens to be a neighbour */
+static double plan_edge (match_plan_t* p, double rows, sym_t label, int in, int to, int check)
 {
-  expect(data, ident);
-  expect(data, colon);
-  expect(data, string);
-
-  /* addPropertyToCurrentNode(key: data->prev, val: data->cache) */
-  exec_addProperty(data->node_curr, data->prev, data->cache);
-  /***/
+  double n = p->g->nvertices ? p->g->nvertices : 1;
+  double fan = graph_fanout(p->g, label, in);
 
-  if ( accept(data, comma) ) {
-    _keyValueList(data);
+  if ( check ) {
+    return rows * (fan < n ? fan / n : 1);
   }
-}
 
-void _data (__Global* data)
-{
-  expect(data, lbrace);
-  _keyValueList(data);
-  expect(data, rbrace);
+  return rows * fan * (p->filters[to].rows / n);
 }
 
-void _type (__Global* data)
+/* greedy join order from one anchor: each step takes the edge leaving the
+   fewest rows, and a part of the pattern not joined to the rest is
+   started from its cheapest node. returns the summed rows of all steps */
+static double plan_order (match_plan_t* p, int anchor, match_step_t* steps, int* bound, int* placed)
 {
-  expect(data, ident);
-
-  if ( accept(data, as_sym) ) {
-    expect(data, ident);
-    /* addNodeAndSetCurrent(ident: data->prev) */
-    /* addLabelToCurrent(label: data->cache) */
-    data->node_curr = exec_addNode(data->node_root, data->cache);
-    exec_addLabelToNode(data->node_curr, data->prev);
-    /* because the new node created may be the first node created */
-    if ( data->node_curr && !data->node_root ) {
-      data->node_root = data->node_curr;
-    }
-    /***/
-    _data(data);
-  } else if ( peek(data, lbrace) ) {
-    data->node_curr = exec_addNode(data->node_root, NULL);
-    exec_addLabelToNode(data->node_curr, data->cache);
-    /* because the new node created may be the first node created */
-    if ( data->node_curr && !data->node_root ) {
-      data->node_root = data->node_curr;
-    }
-    /***/
-    _data(data);
-  } else {
-    if ( !strncmp(data->cmd, "create", 6) ) {
-      /* setCurrentNode(ident: data->cache) */
-      data->node_curr = exec_findNode(data->node_root, data->cache);
-      if ( !data->node_curr ) {
-        error("unidentified variable", (const char *)data->cache);
+  double rows = p->filters[anchor].rows, cost = rows, r, best;
+  int e, l, t, n = 0, left = p->nedges, pick;
+  match_step_t step, next;
+
+  memset(bound, 0, sizeof(int) * p->nnodes);
+  memset(placed, 0, sizeof(int) * p->nedges);
+
+  steps[n].kind = STEP_SCAN;
+  steps[n++].to = anchor;
+  bound[anchor] = 1;
+
+  while ( left ) {
+    pick = -1;
+    best = 0;
+
+    for ( e = 0; e < p->nedges; e++ ) {
+      l = p->ends[2 * e];
+      t = p->ends[2 * e + 1];
+      if ( placed[e] || (!bound[l] && !bound[t]) ) {
+        continue;
       }
-      /***/
-    } else {
-      data->node_curr = exec_addNode(data->node_root, data->cache);
-      /* because the new node created may be the first node created */
-      if ( data->node_curr && !data->node_root ) {
-        data->node_root = data->node_curr;
+      step.label = p->labels[e];
+      if ( bound[l] && bound[t] ) {
+        step.kind = STEP_CHECK;
+        step.from = l;
+        step.to = t;
+        step.in = 0;
+        r = plan_edge(p, rows, step.label, 0, t, 1);
+      } else {
+        step.kind = STEP_EXPAND;
+        step.in = !bound[l];
+        step.from = step.in ? t : l;
+        step.to = step.in ? l : t;
+        r = plan_edge(p, rows, step.label, step.in, step.to, 0);
       }
-      /***/
+      if ( pick < 0 || r < best ) {
+        pick = e;
+        best = r;
+        next = step;
+      }
+    }
+
+    if ( pick < 0 ) {
+      /* nothing joins what is bound, scan the cheapest loose node */
+      for ( t = 0; t < p->nnodes; t++ ) {
+        if ( !bound[t] && (pick < 0 || p->filters[t].rows < p->filters[pick].rows) ) {
+          pick = t;
+        }
+      }
+      steps[n].kind = STEP_SCAN;
+      steps[n++].to = pick;
+      bound[pick] = 1;
+      rows *= p->filters[pick].rows;
+      cost += rows;
+      continue;
     }
+
+    steps[n++] = next;
+    placed[pick] = 1;
+    bound[next.to] = 1;
+    left--;
+    rows = best;
+    cost += rows;
   }
-}
 
-void _node (__Global* data)
-{
-  expect(data, lparen);
-  _type(data);
-  expect(data, rparen);
+  p->nsteps = n;
+
+  return cost;
 }
 
-void _nodeList (__Global* data)
+/* every node is tried as the anchor, the cheapest order wins */
+static int match_plan (match_plan_t* p)
 {
-  _node(data);
+  match_step_t* trial = arena_alloc(p->arena, sizeof(match_step_t) * (p->nedges + p->nnodes));
+  int* bound = arena_alloc(p->arena, sizeof(int) * p->nnodes);
+  int* placed = arena_alloc(p->arena, sizeof(int) * p->nedges);
+  double cost, best = 0;
+  int a, nsteps = 0;
 
-  if ( accept(data, comma) ) {
-    _nodeList(data);
-    return;
-  }
+  p->steps = arena_alloc(p->arena, sizeof(match_step_t) * (p->nedges + p->nnodes));
 
-  if ( !accept(data, dash) ) {
-    return;
+  if ( !trial || !bound || !placed || !p->steps ) {
+    return -1;
   }
 
-  _edge(data);
-  _node(data);
-
-  /* setCurrentNodeAsRightNodeToCurrentEdge() */
-  exec_setRightNode(data->node_curr, data->edge_curr);
-  /***/
-
-  if ( accept(data, comma) ) {
-    _nodeList(data);
+  for ( a = 0; a < p->nnodes; a++ ) {
+    if ( p->anchor >= 0 && a != p->anchor ) {
+      continue;
+    }
+    cost = plan_order(p, a, trial, bound, placed);
+    if ( !nsteps || cost < best ) {
+      best = cost;
+      nsteps = p->nsteps;
+      memcpy(p->steps, trial, sizeof(match_step_t) * nsteps);
+    }
   }
+
+  p->nsteps = nsteps;
+
+  return 0;
 }
 
-void _matchNodeList (__Global* data)
+/* rows that don't fit the arena are dropped, like result vertices */
+static void match_keep (match_plan_t* p, Vertex** row)
 {
-  _node(data);
+  match_rows_t* r = p->rows;
+  row_block_t* b = r->tail;
 
-  if ( accept(data, comma) ) {
-    _matchNodeList(data);
-    return;
+  if ( !b || b->n == EXPAND_BATCH ) {
+    if ( !(b = arena_alloc(p->arena, sizeof(row_block_t) + sizeof(Vertex*) * EXPAND_BATCH * p->nnodes)) ) {
+      return;
+    }
+    b->next = NULL;
+    b->n = 0;
+    if ( r->tail ) {
+      r->tail->next = b;
+    } else {
+      r->head = b;
+    }
+    r->tail = b;
   }
-}
 
-void _create (__Global* data)
-{
-  setcmd(data, "create");
-  _nodeList(data);
+  memcpy(b->v + (size_t)b->n++ * p->nnodes, row, sizeof(Vertex*) * p->nnodes);
 }
 
-void _match (__Global* data)
+static void match_emit (match_plan_t* p, Vertex** row)
 {
-  setcmd(data, "match");
-  _matchNodeList(data);
-}
+  int i;
 
-void _expr (Graph* g, __Global* data)
-{
-  if ( accept(data, create) ) {
-    _create(data);
-    exec_cmd(g, data->cmd, data->node_root, data->edge_root, data->update_node_root, data->update_edge_root);
+  if ( p->rows ) {
+    match_keep(p, row);
   }
 
-  else if ( accept(data, match) ) {
-    _match(data);
-    exec_cmd(g, data->cmd, data->node_root, data->edge_root, data->update_node_root, data->update_edge_root);
-    _setList(data);
-    if ( strncmp(data->cmd, "match", 5 ) ) {
-      exec_cmd(g, data->cmd, data->node_root, data->edge_root, data->update_node_root, data->update_edge_root);
-    }
-    _return(data);
+  for ( i = 0; i < p->nnodes; i++ ) {
+    output_printf(p->out, i ? ",{" : "{");
+    exec_printProps(p->out, row[i]);
+    output_printf(p->out, "}");
+    bitmap_add(&p->seen[i], row[i]->id);
   }
 
-  else if ( data->tok && data->tok->data ) {
-    fprintf(stderr, "error: unknown command %s\n", (const char *)data->tok->data);
-  }
+  output_printf(p->out, "\n");
 }
 
-void getsym (__Global* data)
+static void match_run (match_plan_t*, int, Vertex**, int);
+
+/* copy a row into the batch of step with slot bound to v, handing the
+   batch on to the next step once it is full */
+static void match_push (match_plan_t* p, int step, int* m, Vertex** row, int slot, Vertex* v)
 {
-  if ( data->tok ) {
-    free(data->tok);
+  Vertex** dst = p->batches + (size_t)(step * EXPAND_BATCH + *m) * p->nnodes;
+
+  memcpy(dst, row, sizeof(Vertex*) * p->nnodes);
+  dst[slot] = v;
+
+  if ( ++(*m) == EXPAND_BATCH ) {
+    match_run(p, step + 1, p->batches + (size_t)step * EXPAND_BATCH * p->nnodes, *m);
+    *m = 0;
   }
-  data->tok = token(data->prog);
 }
 
-void parse (Graph* g, unsigned char* p) 
+static void match_run (match_plan_t* p, int step, Vertex** rows, int n)
 {
-  __Global data;
+  match_step_t* s;
+  Adjacency** adj;
+  VertexContainer* c;
+  Vertex** row;
+  Vertex* v;
+  AdjBlock* b;
+  unsigned int j;
+  size_t k;
+  vid_t id;
+  int i, m = 0;
+
+  if ( step == p->nsteps ) {
+    for ( i = 0; i < n; i++ ) {
+      match_emit(p, rows + (size_t)i * p->nnodes);
+    }
+    return;
+  }
 
-  data.prog = &p;
-  data.tok = NULL;
-  data.cache = NULL;
-  data.prev = NULL;
-  data.node_root = NULL;
-  data.node_curr = NULL;
-  data.edge_root = NULL;
-  data.edge_curr = NULL;
-  data.update_node_root = NULL;
-  data.update_node_curr = NULL;
-  data.update_edge_root = NULL;
-  data.update_edge_curr = NULL;
+  s = &p->steps[step];
+  adj = p->adj + (size_t)step * EXPAND_BATCH;
 
-  memset(data.cmd, 0, 10);
+  switch ( s->kind ) {
+    case STEP_SCAN:
+      for ( i = 0; i < n; i++ ) {
+        for ( c = p->cands[s->to]; c; c = c->next ) {
+          match_push(p, step, &m, rows + (size_t)i * p->nnodes, s->to, c->vertex);
+        }
+      }
+      break;
 
-  getsym(&data);
-  _expr(g, &data);
+    case STEP_CHECK:
+      for ( i = 0; i < n; i++ ) {
+        row = rows + (size_t)i * p->nnodes;
+        if ( graph_hasEdge(p->g, row[s->from], row[s->to], s->label) ) {
+          match_push(p, step, &m, row, s->to, row[s->to]);
+        }
+      }
+      break;
+
+    case STEP_EXPAND:
+      if ( p->csr[step] ) {
+        for ( i = 0; i < n; i++ ) {
+          row = rows + (size_t)i * p->nnodes;
+          id = row[s->from]->id;
+          /* vertices made after the snapshot have no edges in it */
+          if ( id >= p->csr[step]->nvertices ) {
+            continue;
+          }
+          for ( k = p->csr[step]->offsets[id]; k < p->csr[step]->offsets[id + 1]; k++ ) {
+            v = graph_vertexById(p->g, p->csr[step]->targets[k]);
+            if ( match_accept(p->g, &p->filters[s->to], v) ) {
+              match_push(p, step, &m, row, s->to, v);
+            }
+          }
+        }
+        break;
+      }
+      /* find the bucket of every row in the batch first and prefetch its
+         first block, so the walks below don't stall on each source */
+      for ( i = 0; i < n; i++ ) {
+        v = rows[(size_t)i * p->nnodes + s->from];
+        adj[i] = s->in ? graph_vertexInEdges(v, s->label) : graph_vertexEdges(v, s->label);
+        if ( adj[i] && adj[i]->head ) {
+          __builtin_prefetch(adj[i]->head);
+        }
+      }
+      for ( i = 0; i < n; i++ ) {
+        row = rows + (size_t)i * p->nnodes;
+        for ( b = adj[i] ? adj[i]->head : NULL; b; b = b->next ) {
+          if ( b->next ) {
+            __builtin_prefetch(b->next);
+          }
+          for ( j = 0; j < b->len; j++ ) {
+            if ( b->to[j] & VID_DEAD ) {
+              continue;
+            }
+            v = graph_vertexById(p->g, b->to[j]);
+            if ( match_accept(p->g, &p->filters[s->to], v) ) {
+              match_push(p, step, &m, row, s->to, v);
+            }
+          }
+        }
+      }
+      break;
+  }
+
+  if ( m ) {
+    match_run(p, step + 1, p->batches + (size_t)step * EXPAND_BATCH * p->nnodes, m);
+  }
 }
 
-node_data_t* exec_addNode(node_data_t* root, unsigned char* ident) 
+/* plan and run the edges of a match, leaving each node bound to the
+   vertices it took in some row. with a cursor the anchor is walked
+   EXPAND_BATCH vertices at a time from where the last run stopped, and
+   the run stops between two batches once the output is full. with rows
+   every row is kept as well. returns 1 when it stopped early */
+static int exec_matchPattern (Graph* g, Arena* arena, node_data_t* root, edge_data_t* edges, Output* out, Cursor* cur, match_rows_t* rows)
 {
-  int len;
+  match_plan_t p;
+  match_scan_t scan;
+  VertexContainer *head, *tail, *batch = NULL;
+  Vertex* anchors[EXPAND_BATCH];
   node_data_t* node;
+  edge_data_t* e;
+  BitmapIter it;
+  Vertex** row;
+  vid_t id;
+  unsigned int n;
+  int i, empty = 0, stopped = 0;
+
+  p.g = g;
+  p.arena = arena;
+  p.out = out;
+  p.rows = rows;
+  p.nnodes = 0;
+  p.nedges = 0;
+  /* a resumed match keeps the anchor it stopped in, whatever the
+     statistics say now */
+  p.anchor = cur && cur->from ? cur->anchor : -1;
+
+  for ( node = root; node; node = node->next ) {
+    p.nnodes++;
+  }
+
+  for ( e = edges; e; e = e->next ) {
+    p.nedges++;
+  }
 
-  node = malloc(sizeof(node_data_t));
+  p.nodes = arena_alloc(arena, sizeof(node_data_t*) * p.nnodes);
+  p.ends = arena_alloc(arena, sizeof(int) * 2 * p.nedges);
+  p.labels = arena_alloc(arena, sizeof(sym_t) * p.nedges);
 
-  if ( ident ) { 
-    len = nuonStrlen(ident);
-    strncpy((char *)node->ident, (char *)ident, len);
-    node->ident[len] = 0;
-  } else {
-    node->ident[0] = 0;
+  if ( !p.nodes || !p.ends || !p.labels ) {
+    return 0;
   }
 
-  node->next = NULL;
+  /* only the nodes an edge touches take part, in query order */
+  p.nnodes = 0;
 
-  if ( root ) {
-    while ( root->next ) { 
-      if ( ident && !strncmp((const char *)root->ident, (const char *)ident, len) ) {
-        free(node);
-        return root;
+  for ( node = root; node; node = node->next ) {
+    for ( e = edges; e; e = e->next ) {
+      if ( e->node_l == node || e->node_r == node ) {
+        p.nodes[p.nnodes++] = node;
+        break;
       }
-      root = root->next;
     }
-    root->next = node;
   }
 
-  return node;
-}
+  for ( i = 0, e = edges; e; e = e->next, i++ ) {
+    p.ends[2 * i] = match_slot(&p, e->node_l);
+    p.ends[2 * i + 1] = match_slot(&p, e->node_r);
+    /* edges of a label never written can't be matched */
+    empty |= !(p.labels[i] = sym_lookup(e->label));
+  }
 
-node_set_data_t* exec_addNodeUpdate(node_set_data_t* root, unsigned char* ident, unsigned char* key, unsigned char* value)
-{
-  int ilen, klen, vlen;
-  node_set_data_t* node;
+  p.filters = arena_alloc(arena, sizeof(match_filter_t) * p.nnodes);
+  p.cands = arena_alloc(arena, sizeof(VertexContainer*) * p.nnodes);
+  p.seen = arena_alloc(arena, sizeof(Bitmap) * p.nnodes);
+  row = arena_alloc(arena, sizeof(Vertex*) * p.nnodes);
 
-  ilen = nuonStrlen(ident);
-  klen = nuonStrlen(key);
-  vlen = nuonStrlen(value);
+  if ( !p.filters || !p.cands || !p.seen || !row ) {
+    return 0;
+  }
 
-  node = malloc(sizeof(node_set_data_t));
+  for ( i = 0; i < p.nnodes; i++ ) {
+    node = p.nodes[i];
+    node->vrtxdata = NULL;
+    p.cands[i] = NULL;
+    row[i] = NULL;
+    bitmap_init(&p.seen[i]);
+    empty |= match_compile(g, arena, node->label, node->keys, node->vals, node->propcount, &p.filters[i]) != 0;
+  }
 
-  strncpy((char *)node->ident, (char *)ident, ilen);
-  strncpy((char *)node->prop, (char *)key, klen);
-  strncpy((char *)node->val, (char *)value, vlen);
+  if ( empty || match_plan(&p) ) {
+    return 0;
+  }
 
-  node->ident[ilen] = 0;
-  node->prop[klen] = 0;
-  node->val[vlen] = 0;
+  if ( rows ) {
+    rows->nodes = p.nodes;
+    rows->nnodes = p.nnodes;
+  }
 
-  node->next = NULL;
+  p.batches = arena_alloc(arena, sizeof(Vertex*) * p.nsteps * EXPAND_BATCH * p.nnodes);
+  p.adj = arena_alloc(arena, sizeof(Adjacency*) * p.nsteps * EXPAND_BATCH);
+  p.csr = arena_alloc(arena, sizeof(Csr*) * p.nsteps);
 
-  if ( root ) {
-    while ( root->next ) { root = root->next; }
-    root->next = node;
+  if ( !p.batches || !p.adj || !p.csr ) {
+    return 0;
   }
 
-  return node;
-}
-
-edge_set_data_t* exec_addEdgeUpdate(
-  edge_set_data_t* root, 
-  unsigned char* label, 
-  unsigned char* left, 
-  unsigned char* right
-){
-  int len, llen, rlen;
-  edge_set_data_t* edge;
+  /* the first step scans the anchor */
+  if ( cur ) {
+    cur->anchor = p.steps[0].to;
+    node = p.nodes[p.steps[0].to];
+    batch = arena_alloc(arena, sizeof(VertexContainer) * EXPAND_BATCH);
+    if ( !batch || match_scanInit(g, arena, node->propcount ? node->label : NULL, node->keys, node->vals, node->propcount, cur->from, &scan) ) {
+      return 0;
+    }
+  }
 
-  llen = nuonStrlen(left);
-  rlen = nuonStrlen(right);
-  len = nuonStrlen(label);
+  p.snap = snapshot_peek(g);
 
-  edge = malloc(sizeof(edge_set_data_t));
+  for ( i = 0; i < p.nsteps; i++ ) {
+    p.csr[i] = NULL;
+    if ( p.steps[i].kind == STEP_EXPAND && !p.steps[i].in ) {
+      p.csr[i] = snapshot_current(g, p.snap, p.steps[i].label);
+    }
+    if ( p.steps[i].kind == STEP_SCAN && (i || !cur) ) {
+      node = p.nodes[p.steps[i].to];
+      p.cands[p.steps[i].to] = node->propcount
+        ? graph_matchVertices(g, arena, node->label, node->keys, node->vals, node->propcount)
+        : graph_getVertices(g, arena, NULL, NULL, NULL);
+    }
+  }
 
-  strncpy((char *)edge->label, (char *)label, len);
-  strncpy((char *)edge->left, (char *)left, llen);
-  strncpy((char *)edge->right, (char *)right, rlen);
+  if ( !cur ) {
+    match_run(&p, 0, row, 1);
+  }
 
-  edge->left[llen] = 0;
-  edge->right[rlen] = 0;
-  edge->label[len] = 0;
+  while ( cur && !stopped && (n = match_scanRead(g, &scan, anchors, EXPAND_BATCH)) ) {
+    for ( i = 0; i < (int)n; i++ ) {
+      batch[i].vertex = anchors[i];
+      batch[i].next = i + 1 < (int)n ? &batch[i + 1] : NULL;
+    }
+    p.cands[p.steps[0].to] = batch;
+    match_run(&p, 0, row, 1);
+    cur->from = anchors[n - 1]->id + 1;
+    stopped = out->len >= cur->limit;
+  }
 
-  edge->next = NULL;
+  snapshot_release(p.snap);
 
-  if ( root ) {
-    while ( root->next ) { root = root->next; }
-    root->next = edge;
+  for ( i = 0; i < p.nnodes; i++ ) {
+    head = NULL;
+    tail = NULL;
+    bitmap_iterInit(&it, &p.seen[i]);
+    while ( bitmap_iterNext(&it, &id) ) {
+      graph_appendVertex(arena, &head, &tail, graph_vertexById(g, id));
+    }
+    p.nodes[i]->vrtxdata = head;
+    bitmap_free(&p.seen[i]);
   }
 
-  return edge;
+  return stopped;
 }
 
-void exec_addLabelToNode(node_data_t* node, unsigned char* label) 
+/* print the vertices matching a lone node from the cursor on, stopping
+   once the output is full. returns 1 when it stopped early */
+static int exec_matchNode (Graph* g, Arena* arena, node_data_t* node, Output* out, Cursor* cur)
 {
-  int len;
+  Vertex* path[PRINT_DEPTH];
+  Vertex* batch[SCAN_BATCH];
+  match_scan_t scan;
+  Snapshot* snap;
+  unsigned int i, n, budget;
+
+  /* like graph_getVertices, a node without properties takes every vertex */
+  if ( match_scanInit(g, arena, node->propcount ? node->label : NULL, node->keys, node->vals, node->propcount, cur->from, &scan) ) {
+    return 0;
+  }
+
+  snap = snapshot_peek(g);
+
+  while ( (n = match_scanRead(g, &scan, batch, SCAN_BATCH)) ) {
+    for ( i = 0; i < n; i++ ) {
+      budget = PRINT_BUDGET;
+      exec_printVertex(g, out, snap, batch[i], path, 0, &budget);
+      output_printf(out, "\n");
+      if ( out->len >= cur->limit ) {
+        cur->from = batch[i]->id + 1;
+        snapshot_release(snap);
+        return 1;
+      }
+    }
+  }
 
-  len = nuonStrlen(label);
-  strncpy((char *)node->label, (char *)label, len);
-  node->label[len] = 0;
+  snapshot_release(snap);
+
+  return 0;
 }
 
-node_data_t* exec_findNode(node_data_t* root, unsigned char* ident) 
+/* with a cursor the match runs in stages, the pattern and then each lone
+   node, and picks up at the stage and vertex it stopped at. rows, when
+   given, gets the rows of the pattern */
+static void exec_match (Graph* g, Arena* arena, node_data_t* root, edge_data_t* edges, Output* out, Cursor* cur, match_rows_t* rows)
 {
-  int len;
-  node_data_t* iter;
+  node_data_t* node_iter = root;
+  edge_data_t* e;
+  int stage = 1;
 
-  len = nuonStrlen(ident);
-  iter = root;
+  if ( edges && (!cur || !cur->stage) && exec_matchPattern(g, arena, root, edges, out, cur, rows) ) {
+    cur->more = 1;
+    return;
+  }
 
-  while ( iter ) {
-    if ( !strncmp((char *)iter->ident, (char *)ident, len) ) {
-      break;
+  /* the properties of a node are one conjunction, matched in one pass.
+     nodes in an edge were bound by the pattern */
+  for ( ; node_iter; node_iter = node_iter->next, stage++ ) {
+    for ( e = edges; e && e->node_l != node_iter && e->node_r != node_iter; e = e->next );
+    if ( e || (cur && stage < cur->stage) ) {
+      continue;
     }
-    iter = iter->next;
+    if ( cur ) {
+      if ( stage > cur->stage ) {
+        cur->stage = stage;
+        cur->from = 0;
+      }
+      if ( exec_matchNode(g, arena, node_iter, out, cur) ) {
+        cur->more = 1;
+        return;
+      }
+      continue;
+    }
+    if ( !node_iter->propcount ) {
+      node_iter->vrtxdata = graph_getVertices(g, arena, NULL, NULL, NULL);
+    } else {
+      node_iter->vrtxdata = graph_matchVertices(g, arena, node_iter->label, node_iter->keys, node_iter->vals, node_iter->propcount);
+    }
+    exec_printData(g, out, node_iter->vrtxdata, 1);
   }
-  return iter;
 }
 
-void exec_addProperty(node_data_t* node, unsigned char* key, unsigned char* val) 
+/* vertices the match bound to ident */
+static VertexContainer* exec_bound (node_data_t* root, unsigned char* ident)
 {
-  int klen, vlen, index;
+  for ( ; root; root = root->next ) {
+    if ( !strcmp((const char *)root->ident, (const char *)ident) ) {
+      return root->vrtxdata;
+    }
+  }
 
-  klen = nuonStrlen(key);
-  vlen = nuonStrlen(val);
-  index = node->propcount;
+  return NULL;
+}
 
-  strncpy((char *)node->keys[index], (char *)key, klen);
-  strncpy((char *)node->vals[index], (char *)val, vlen);
+static int exec_pairCmp (const void* a, const void* b)
+{
+  Vertex* const* x = a;
+  Vertex* const* y = b;
 
-  node->keys[index][klen] = 0;
-  node->vals[index][vlen] = 0;
+  if ( x[0]->id != y[0]->id ) {
+    return x[0]->id < y[0]->id ? -1 : 1;
+  }
+  if ( x[1]->id != y[1]->id ) {
+    return x[1]->id < y[1]->id ? -1 : 1;
+  }
 
-  (node->propcount)++;
+  return 0;
 }
 
-edge_data_t* exec_addEdge(edge_data_t* root, unsigned char* ident) 
+static int exec_slot (match_rows_t* rows, unsigned char* ident)
 {
-  int len;
-  edge_data_t* edge;
-
-  edge = malloc(sizeof(edge_data_t));
+  int i;
 
-  if ( ident ) {
-    len = nuonStrlen(ident);
-    strncpy((char *)edge->ident, (char *)ident, len);
-    edge->ident[len] = 0;
+  for ( i = 0; rows && i < rows->nnodes; i++ ) {
+    if ( !strcmp((const char *)rows->nodes[i]->ident, (const char *)ident) ) {
+      return i;
+    }
   }
 
-  edge->node_r = NULL;
-  edge->node_l = NULL;
-  edge->next = NULL;
+  return -1;
+}
 
-  if ( root ) {
-    while ( root->next ) { root = root->next; }
-    root->next = edge;
+/* the distinct pairs of vertices left and right are bound to in one row,
+   two Vertex* each, in the arena. when both are nodes of the pattern
+   they come from its rows, otherwise every vertex of one pairs with
+   every vertex of the other, as lone nodes are matched on their own */
+static size_t exec_pairs (Arena* arena, node_data_t* root, match_rows_t* rows, unsigned char* left, unsigned char* right, Vertex*** pairs)
+{
+  VertexContainer *l, *r;
+  row_block_t* b;
+  Vertex** row;
+  size_t n = 0, i, j;
+  int sl = exec_slot(rows, left), sr = exec_slot(rows, right), k;
+
+  if ( sl >= 0 && sr >= 0 ) {
+    for ( b = rows->head; b; b = b->next ) {
+      n += b->n;
+    }
+  } else {
+    for ( l = exec_bound(root, left); l; l = l->next ) {
+      for ( r = exec_bound(root, right); r; r = r->next ) {
+        n++;
+      }
+    }
   }
 
-  return edge;
-}
+  if ( !n || !(*pairs = arena_alloc(arena, sizeof(Vertex*) * 2 * n)) ) {
+    return 0;
+  }
 
-void exec_setRightNode(node_data_t* node, edge_data_t* edge) 
-{
-  edge->node_r = node;
-}
+  if ( sl < 0 || sr < 0 ) {
+    for ( l = exec_bound(root, left), i = 0; l; l = l->next ) {
+      for ( r = exec_bound(root, right); r; r = r->next, i += 2 ) {
+        (*pairs)[i] = l->vertex;
+        (*pairs)[i + 1] = r->vertex;
+      }
+    }
+    return n;
+  }
 
-void exec_setLeftNode(node_data_t* node, edge_data_t* edge) 
-{
-  edge->node_l = node;
-}
+  for ( b = rows->head, i = 0; b; b = b->next ) {
+    for ( k = 0; k < b->n; k++, i += 2 ) {
+      row = b->v + (size_t)k * rows->nnodes;
+      (*pairs)[i] = row[sl];
+      (*pairs)[i + 1] = row[sr];
+    }
+  }
 
-void exec_addLabelToEdge(edge_data_t* edge, unsigned char* label) 
-{
-  int len;
+  /* rows that differ elsewhere repeat a pair */
+  qsort(*pairs, n, sizeof(Vertex*) * 2, exec_pairCmp);
+  for ( i = 0, j = 0; i < n; i++ ) {
+    if ( !j || exec_pairCmp(*pairs + 2 * i, *pairs + 2 * (j - 1)) ) {
+      (*pairs)[2 * j] = (*pairs)[2 * i];
+      (*pairs)[2 * j + 1] = (*pairs)[2 * i + 1];
+      j++;
+    }
+  }
 
-  len = nuonStrlen(label);
-  strncpy((char *)edge->label, (char *)label, len);
-  edge->label[len] = 0;
+  return j;
 }
 
-void exec_printData (VertexContainer *vertices, int newline)
+static void exec_delete (Graph* g, Arena* arena, node_data_t* root, node_set_data_t* nodes, edge_set_data_t* edges, match_rows_t* rows)
 {
-  Property* prop_iter;
-  Edge* edge_iter;
-  VertexContainer* vc_iter, *cont;
-  vc_iter = vertices;
-
-  while ( vc_iter ) {
-    printf("{");
-    prop_iter = vc_iter->vertex->properties;
-    edge_iter = vc_iter->vertex->edges;
-    while ( prop_iter ) {
-      printf("%s:\"%s\"", prop_iter->key, prop_iter->val);
-      if ( prop_iter->next ) {
-        printf(",");
-      }
-      prop_iter = prop_iter->next;
-    }
-    if ( edge_iter ) {
-      printf(",");
-    }
-    while ( edge_iter ) {
-      printf("%s:", edge_iter->label);
-      cont = malloc(sizeof(VertexContainer));
-      cont->vertex = edge_iter->to;
-      cont->next = NULL;
-      //vc_iter = cont;
-      exec_printData(cont, 0);
-      if ( edge_iter->next ) {
-        printf(",");
-      }
-      edge_iter = edge_iter->next;
+  VertexContainer* left;
+  Vertex** pairs;
+  size_t n, i;
+  sym_t label;
+
+  /* edges first, the vertices they join may go next. only the ends bound
+     together in a row lose theirs */
+  for ( ; edges; edges = edges->next ) {
+    if ( !(label = sym_lookup(edges->label)) ) {
+      continue;
     }
-    printf("}");
-
-    if (newline) {
-      printf("\n");
+    n = exec_pairs(arena, root, rows, edges->left, edges->right, &pairs);
+    for ( i = 0; i < n; i++ ) {
+      while ( !graph_vertexRemoveEdge(g, pairs[2 * i], pairs[2 * i + 1], label) );
     }
+  }
 
-    vc_iter = vc_iter->next;
+  for ( ; nodes; nodes = nodes->next ) {
+    for ( left = exec_bound(root, nodes->ident); left; left = left->next ) {
+      graph_deleteVertex(g, left->vertex);
+    }
   }
 }
 
-void exec_cmd (Graph* g, char* cmd, node_data_t* root, edge_data_t* edges, node_set_data_t* uroot, edge_set_data_t* eroot)
+static void exec_update (Graph* g, Arena* arena, char* cmd, node_data_t* root, edge_data_t* edges, node_set_data_t* uroot, edge_set_data_t* eroot, match_rows_t* rows)
 {
-  Vertex *type, *node;
-  VertexContainer *returnData, *leftData, *rightData;
+  Vertex* node;
+  Vertex** pairs;
+  VertexContainer* returnData;
   node_data_t* node_iter = root;
   node_set_data_t* node_set_iter = uroot;
   edge_set_data_t* edge_set_iter = eroot;
   edge_data_t* edge_iter = edges;
-  int count = 0, id;
+  size_t n, i;
+  int count = 0;
 
-  if ( !strncmp(cmd, "match", 5) ) {
-    while ( node_iter ) {
-      count = node_iter->propcount;
-      if ( !count ) {
-        node_iter->vrtxdata = graph_getVertices(g, NULL, NULL, NULL);
-        exec_printData(node_iter->vrtxdata, 1);
-      } else {
-        while (count) {
-          count--;
-          node_iter->vrtxdata = graph_getVertices(g, node_iter->label, node_iter->keys[count], node_iter->vals[count]);
-          exec_printData(node_iter->vrtxdata, 1);
-        }
-      }
-      node_iter = node_iter->next;
-    }
+  if ( !strncmp(cmd, "delete", 6) ) {
+    exec_delete(g, arena, root, uroot, eroot, rows);
     return;
   }
 
   if ( !strncmp(cmd, "set", 3) ) {
+    /* one edge per pair of ends bound together in a row */
     while ( edge_set_iter ) { 
-      node_iter = root;
-      while ( node_iter ) {
-        leftData = NULL;
-        rightData = NULL;
-        if ( !strncmp((const char *)node_iter->ident, 
-          (const char *)edge_set_iter->left, 
-          strlen((const char*)edge_set_iter->left)) ) {
-          leftData = node_iter->vrtxdata;
-        }
-        if ( !strncmp((const char *)node_iter->ident, 
-          (const char *)edge_set_iter->right, 
-          strlen((const char*)edge_set_iter->right)) ) {
-          rightData = node_iter->vrtxdata;
-        }
-        if ( leftData && rightData ) {
-          while ( leftData ) {
-            while ( rightData ) {
-              if (leftData->vertex != rightData->vertex)
-                graph_vertexAddEdge(leftData->vertex, rightData->vertex, edge_set_iter->label);
-              rightData = rightData->next;
-            }
-            leftData = leftData->next;
-          }
-        }
-        node_iter = node_iter->next;
+      n = exec_pairs(arena, root, rows, edge_set_iter->left, edge_set_iter->right, &pairs);
+      for ( i = 0; i < n; i++ ) {
+        if (pairs[2 * i] != pairs[2 * i + 1])
+          graph_vertexAddEdge(g, pairs[2 * i], pairs[2 * i + 1], sym_intern(edge_set_iter->label));
       }
       edge_set_iter = edge_set_iter->next;
     }
@@ -1461,7 +5147,7 @@ void exec_cmd (Graph* g, char* cmd, node_data_t* root, edge_data_t* edges, node_
           strlen((const char*)node_iter->ident)) ) {
           returnData = node_iter->vrtxdata;
           while ( returnData ) {
-            graph_vertexSetProperty(returnData->vertex, node_set_iter->prop, node_set_iter->val);
+            graph_vertexSetProperty(g, returnData->vertex, sym_intern(node_set_iter->prop), node_set_iter->val);
             returnData = returnData->next;
           }
         }
@@ -1473,38 +5159,117 @@ void exec_cmd (Graph* g, char* cmd, node_data_t* root, edge_data_t* edges, node_
   }
 
   while ( node_iter ) {
-    char key[256];
-    type = graph_getVertex(g, node_iter->label);
+    node = graph_addVertex(g);
 
-    if ( !type ) {
-      type = graph_setVertex(g, node_iter->label, NULL);
+    if ( !node ) {
+      return;
     }
 
-    id = type->idx++;
+    node_iter->ptr = node;
 
-    sprintf(key, "%s:%d", node_iter->label, id);
+    if ( *node_iter->label ) {
+      graph_addLabel(g, node, sym_intern(node_iter->label));
+    }
 
-    node = graph_setVertex(g, (unsigned char*)key, NULL);
-    node_iter->ptr = node;
-    graph_vertexAddEdge(type, node, (unsigned char*)"member");
     count = node_iter->propcount;
 
     while (count) {
       count--;
-      graph_vertexSetProperty(node, node_iter->keys[count], node_iter->vals[count]);
+      graph_vertexSetProperty(g, node, sym_intern(node_iter->keys[count]), node_iter->vals[count]);
     }
 
     node = NULL;
-    type = NULL;
 
     node_iter = node_iter->next;
   }
 
   while ( edge_iter ) { 
     if (edge_iter->node_l->ptr != edge_iter->node_r->ptr)
-      graph_vertexAddEdge(edge_iter->node_l->ptr, edge_iter->node_r->ptr, edge_iter->label);
+      graph_vertexAddEdge(g, edge_iter->node_l->ptr, edge_iter->node_r->ptr, sym_intern(edge_iter->label));
     edge_iter = edge_iter->next;
   }
 
   return;
 }
+
+void exec_createIndex (Graph* g, unsigned char* label, unsigned char* key, Output* out)
+{
+  sym_t l = sym_intern(label);
+  sym_t k = sym_intern(key);
+
+  pthread_rwlock_wrlock(&g->lock);
+
+  if ( !l || !k || graph_createIndex(g, l, k) ) {
+    output_printf(out, "error: could not create index %s(%s)\n", label, key);
+  }
+
+  pthread_rwlock_unlock(&g->lock);
+}
+
+void exec_sortEdges (Graph* g, unsigned char* label, Output* out)
+{
+  sym_t l = sym_intern(label);
+
+  pthread_rwlock_wrlock(&g->lock);
+
+  if ( !l || graph_sortEdges(g, l) ) {
+    output_printf(out, "error: could not create index -[%s]->\n", label);
+  }
+
+  pthread_rwlock_unlock(&g->lock);
+}
+
+void exec_cmd (Graph* g, Arena* arena, char* cmd, node_data_t* root, edge_data_t* edges, node_set_data_t* uroot, edge_set_data_t* eroot, Output* out)
+{
+  if ( !strncmp(cmd, "match", 5) ) {
+    graph_lockShared(g, GRAPH_READ);
+    exec_match(g, arena, root, edges, out, NULL, NULL);
+    graph_unlockShared(g);
+    return;
+  }
+
+  /* CREATE only links the vertices it makes, so several can run at once */
+  if ( !strncmp(cmd, "create", 6) ) {
+    graph_lockShared(g, GRAPH_INGEST);
+    exec_update(g, arena, cmd, root, edges, uroot, eroot, NULL);
+    graph_unlockShared(g);
+    return;
+  }
+
+  pthread_rwlock_wrlock(&g->lock);
+  exec_update(g, arena, cmd, root, edges, uroot, eroot, NULL);
+  pthread_rwlock_unlock(&g->lock);
+}
+
+/* MATCH followed by SET and DELETE. with any update the write lock is held
+   from the match on, so nothing changes what it bound before the update
+   runs */
+void exec_matchUpdate (Graph* g, Arena* arena, node_data_t* root, edge_data_t* edges, node_set_data_t* uroot, edge_set_data_t* eroot, node_set_data_t* droot, edge_set_data_t* deroot, Output* out, Cursor* cur)
+{
+  match_rows_t rows;
+
+  /* only a plain match can stop halfway, an update binds everything
+     before it runs */
+  if ( !uroot && !eroot && !droot && !deroot ) {
+    graph_lockShared(g, GRAPH_READ);
+    exec_match(g, arena, root, edges, out, cur, NULL);
+    graph_unlockShared(g);
+    return;
+  }
+
+  memset(&rows, 0, sizeof(rows));
+
+  pthread_rwlock_wrlock(&g->lock);
+
+  exec_match(g, arena, root, edges, out, NULL, &rows);
+
+  if ( uroot || eroot ) {
+    exec_update(g, arena, "set", root, edges, uroot, eroot, &rows);
+  }
+
+  if ( droot || deroot ) {
+    exec_update(g, arena, "delete", root, edges, droot, deroot, &rows);
+  }
+
+  pthread_rwlock_unlock(&g->lock);
+}
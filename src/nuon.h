@@ -31,40 +31,267 @@
 #ifndef _NUON_H
 #define _NUON_H
 
+#include <pthread.h>
+#include <stddef.h>
+
 #define MAX 32
 #define uint64 unsigned long long
 
+#define OUTPUT_BLOCK_SIZE 16384
+
+#define ARENA_BLOCK_SIZE 65536
+
+typedef struct arena Arena;
+typedef struct arena_block ArenaBlock;
+typedef struct buffer Buffer;
+typedef struct output Output;
+typedef struct output_block OutputBlock;
+typedef struct cursor Cursor;
+
+/* bump allocator for the state of a single query, everything is released
+   at once by arena_reset. a zeroed Arena is ready to use */
+struct arena_block {
+  ArenaBlock* next;
+  size_t size;
+  size_t used;
+  size_t pad; /* keeps data 16 byte aligned */
+  unsigned char data[];
+};
+
+struct arena {
+  ArenaBlock* head; /* block being allocated from */
+};
+
+/* contiguous growable buffer */
+struct buffer {
+  unsigned char* data;
+  size_t len;
+  size_t cap;
+};
+
+/* chain of fixed size blocks that query results are written to, drained
+   from the head */
+struct output_block {
+  OutputBlock* next;
+  size_t len; /* bytes written */
+  size_t off; /* bytes already consumed */
+  unsigned char data[OUTPUT_BLOCK_SIZE];
+};
+
+struct output {
+  OutputBlock* head;
+  OutputBlock* tail;
+  OutputBlock* spare; /* drained block kept for reuse */
+  size_t len;         /* bytes not consumed yet */
+};
+
+#define MAP_GROUP 16
+#define MAP_EMPTY 0x80
+#define MAP_DELETED 0xfe
+
 typedef struct map_node map_node_t;
+typedef struct map_index map_index_t;
+typedef struct map_slab map_slab_t;
 typedef struct map map_t;
 
+/* a level is added to a node with probability 1 / 2^MAP_BRANCH_BITS */
+#ifndef MAP_BRANCH_BITS
+#define MAP_BRANCH_BITS 2
+#endif
+
+/* nodes are carved from MAP_SLAB_SIZE slabs in steps of MAP_CLASS bytes,
+   and recycled through a free list per size. larger nodes use malloc */
+#define MAP_SLAB_SIZE 65536
+#define MAP_CLASS 16
+#define MAP_CLASSES 32
+
+/* levels the head starts with, it grows with the list */
+#define MAP_HEAD_LEVELS 4
+
+/* one allocation: the fields, the tower, then the NUL terminated key */
 struct map_node {
-  int height;
-  map_node_t** next;
-  unsigned char* key;
   void* data;
+  uint64 hash;
+  unsigned int klen;
+  int height;
+  map_node_t* next[];
 };
 
+#define MAP_NODE_KEY(n) ((unsigned char *)((n)->next + (n)->height))
+
+struct map_slab {
+  map_slab_t* next;
+};
+
+/* open addressing index over the skip list nodes for point lookups.
+   every slot has a control byte holding the low 7 bits of the hash, or
+   MAP_EMPTY / MAP_DELETED, and control bytes are probed MAP_GROUP at a
+   time (with sse2 when available) */
+struct map_index {
+  unsigned char* ctrl;
+  map_node_t** slots;
+  size_t cap;   /* power of two, multiple of MAP_GROUP */
+  size_t used;  /* live slots plus tombstones */
+  size_t count; /* live slots */
+};
+
+/* skip list kept in key order for scans, plus a hash index */
 struct map {
   int height;
   map_node_t* head;
+  map_index_t index;
+
+  /* node memory */
+  void* free[MAP_CLASSES];
+  map_slab_t* slabs;
+  char* bump;
+  size_t left;
 };
 
 typedef struct graph Graph;
 typedef struct vertex Vertex;
 typedef struct vertexContainer VertexContainer;
 typedef struct property Property;
-typedef struct edge Edge;
+typedef struct adjacency Adjacency;
+typedef struct adj_block AdjBlock;
+typedef struct csr Csr;
+typedef struct snapshot Snapshot;
+typedef struct posting Posting;
+typedef struct prop_index PropIndex;
+typedef struct hll Hll;
+typedef struct label_stats LabelStats;
+typedef struct edge_stats EdgeStats;
+typedef struct bitmap Bitmap;
+typedef struct bitmap_container BitmapContainer;
+typedef struct bitmap_iter BitmapIter;
 
 typedef unsigned long word_t;
+typedef unsigned int vid_t;
+typedef unsigned int sym_t;
+
+#define SYM_NONE 0
+
+/* set on an adjacency entry whose edge was deleted, until compaction
+   drops it. vertex ids stay below it */
+#define VID_DEAD 0x80000000u
+#define SYM_CHUNK_BITS 10
+#define SYM_CHUNK (1 << SYM_CHUNK_BITS)
+#define SYM_CHUNKS 4096
+
+/* the two sides of the graph gate */
+#define GRAPH_READ 0
+#define GRAPH_INGEST 1
+
+#define VERTEX_CHUNK_BITS 12
+#define VERTEX_CHUNK (1 << VERTEX_CHUNK_BITS)
+
+/* bitmap containers switch from an array to a bitset past
+   BITMAP_ARRAY_MAX values, and back once they drop under BITMAP_ARRAY_MIN */
+#define BITMAP_ARRAY_MAX 4096
+#define BITMAP_ARRAY_MIN (BITMAP_ARRAY_MAX / 2)
+#define BITMAP_WORDS 1024
+
+/* vertices with more than PROP_HASHED properties switch from a flat array
+   to an open addressing table on the key */
+#define PROP_INLINE 16
+#define PROP_HASHED 16
+#define PROP_SLOT(k, cap) (((k) * 2654435761u) & ((cap) - 1))
+
+/* compressed set of vertex ids, see bitmap_init */
+struct bitmap_container {
+  unsigned int key;       /* high 16 bits of the values */
+  unsigned int card;
+  unsigned int cap;
+  unsigned short* array;  /* sorted low 16 bits, or NULL */
+  uint64* bits;           /* BITMAP_WORDS words, or NULL */
+};
+
+struct bitmap {
+  BitmapContainer* containers; /* sorted by key */
+  unsigned int len;
+  unsigned int cap;
+};
+
+struct bitmap_iter {
+  const Bitmap* b;
+  unsigned int c;
+  unsigned int i;
+};
 
 struct graph {
-  map_t* vertices;
+  /* vertices are numbered densely from 0 and live in fixed size chunks,
+     so a vertex never moves once created */
+  Vertex** chunks;
+  size_t nchunks;
+  vid_t nvertices;
+  pthread_mutex_t vertexlock;
+
+  /* label id -> members */
+  Bitmap* labels;
+  sym_t nlabels;
+  pthread_mutex_t labellock;
+
+  /* CREATE INDEX ON label(key) */
+  PropIndex* indexes;
+
+  /* bumped by every edge write. stamps[label] is the version of the last
+     write to that label, so a stale snapshot only rebuilds what changed */
+  unsigned long version;
+  unsigned long* stamps;
+  sym_t nstamps;
+  pthread_mutex_t stamplock;
+
+  /* edge labels whose buckets are kept in id order without repeats */
+  Bitmap sorted;
+
+  /* deleted vertices, and vertices with deleted edges left in their
+     buckets, waiting for graph_compact */
+  Bitmap graveyard;
+  Bitmap dirty;
+
+  /* planner statistics, by label and by edge label */
+  LabelStats* lstats;
+  sym_t nlstats;
+  EdgeStats* estats;
+  sym_t nestats;
+  pthread_mutex_t statslock;
+
+  /* latest csr snapshot, swapped under snaplock */
+  Snapshot* snapshot;
+  pthread_mutex_t snaplock;
+
+  /* queries run concurrently on all workers: readers share the graph,
+     writers get it exclusively */
+  pthread_rwlock_t lock;
+
+  /* CREATE shares the graph too, but only with other CREATEs: the gate
+     lets in readers or ingesters, never both, and what ingesters have in
+     common is behind the mutexes above */
+  struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int side;
+    int active;
+    int waiting[2];
+  } gate;
 };
 
 struct vertex {
-  word_t idx;
-  Edge* edges;
-  Property* properties;
+  vid_t id;
+  sym_t label;
+  unsigned int nprops;
+  unsigned int propcap;
+  Property* props;
+
+  /* out and in edges, one bucket per edge label */
+  Adjacency* adj;
+  Adjacency* in;
+  unsigned int nadj;
+  unsigned int nin;
+
+  /* deleted, readers skip it. compaction frees what it holds, the slot
+     itself is never reused */
+  unsigned int dead;
 };
 
 struct vertexContainer {
@@ -72,20 +299,122 @@ struct vertexContainer {
   VertexContainer* next;
 };
 
-struct edge {
-  unsigned char* label;
-  Vertex* to;
-  Vertex* from;
-  Edge* next;
+/* targets of edges stored contiguously. the first block of a bucket is
+   one cache line, each next one doubles up to a page */
+#define ADJ_BLOCK_MIN 12
+#define ADJ_BLOCK_MAX 1020
+
+struct adj_block {
+  AdjBlock* next;
+  unsigned int len;
+  unsigned int cap;
+  vid_t to[];
+};
+
+/* the edges of a vertex in one direction that share a label, appended at
+   the tail. out buckets hold targets, in buckets hold sources. buckets of
+   a sorted label are a single block in id order with no repeats */
+struct adjacency {
+  sym_t label;
+  unsigned int count;
+  AdjBlock* head;
+  AdjBlock* tail;
+};
+
+/* out edges of one label in compressed sparse row form: the targets of
+   vertex v are targets[offsets[v]] up to targets[offsets[v + 1]]. vertices
+   from nvertices on have no edges of the label in this copy */
+struct csr {
+  sym_t label;
+  unsigned long stamp;
+  vid_t nvertices;
+  size_t* offsets;
+  vid_t* targets;
+
+  /* shared between consecutive snapshots until the label changes */
+  int refs;
+};
+
+/* frozen copy of the adjacency, one csr per edge label. it never changes
+   once published and is reference counted, so it can be read without
+   holding the graph lock while writers carry on */
+struct snapshot {
+  unsigned long version;
+  Csr** csr;
+  sym_t ncsr;
+  int refs;
 };
 
+/* properties are stored by value in one array per vertex. values shorter
+   than PROP_INLINE bytes live in the slot itself */
 struct property {
-  unsigned char* key;
-  unsigned char* val;
-  Property* next;
+  sym_t key;
+  unsigned int len;
+  union {
+    unsigned char* ptr;
+    unsigned char buf[PROP_INLINE];
+  } val;
+};
+
+#define PROPERTY_VAL(p) ((p)->len < PROP_INLINE ? (p)->val.buf : (p)->val.ptr)
+
+/* ids of the vertices holding one value of an indexed property, sorted */
+struct posting {
+  vid_t* ids;
+  unsigned int len;
+  unsigned int cap;
+};
+
+/* value -> posting for every vertex with the label that has the key,
+   kept current by graph_vertexSetProperty / graph_vertexRemoveProperty */
+struct prop_index {
+  sym_t label;
+  sym_t key;
+  map_t* values;
+  PropIndex* next;
+
+  /* held by ingesters while adding to values */
+  pthread_mutex_t lock;
+};
+
+/* registers of a hyperloglog sketch are picked by the top HLL_BITS of a
+   hash, 2^10 of them keep the error near 3% */
+#define HLL_BITS 10
+#define HLL_REGS (1 << HLL_BITS)
+
+/* distinct values seen for one key. sketches only grow, so values that
+   were overwritten or deleted still count until a rebuild */
+struct hll {
+  unsigned char regs[HLL_REGS];
+};
+
+/* distinct value sketch per key id, for the vertices whose first label
+   this is. the member count is the label's bitmap */
+struct label_stats {
+  Hll** keys;
+  sym_t nkeys;
+};
+
+/* vertices are counted in bucket b of a histogram when they have
+   2^b to 2^(b+1) - 1 live edges of the label on that side */
+#define DEGREE_BUCKETS 32
+
+struct edge_stats {
+  unsigned long edges;
+  unsigned long out[DEGREE_BUCKETS];
+  unsigned long in[DEGREE_BUCKETS];
 };
 
+/* planner cost of fetching one vertex by id from a posting, relative to
+   testing one vertex of a label scan */
+#define PLAN_SEEK_COST 4
+
+/* slots to walk when iterating a vertex's properties, unused slots have
+   key SYM_NONE */
+#define VERTEX_PROPSLOTS(v) ((v)->propcap > PROP_HASHED ? (v)->propcap : (v)->nprops)
+
 typedef struct token Token;
+typedef struct slice Slice;
 typedef enum symbol Symbol;
 
 enum symbol {
@@ -95,12 +424,20 @@ enum symbol {
   ident,      string,  set_sym,
   comma,      dash,    grthan,
   return_sym, period,  equals,
-  as_sym
+  as_sym,     index_sym, on_sym,
+  delete_sym
+};
+
+/* a piece of the query text, not NUL terminated */
+struct slice {
+  const unsigned char* ptr;
+  int len;
+  int escaped; /* string literal with backslash escapes still in it */
 };
 
 struct token {
   Symbol sym;
-  unsigned char* data;
+  Slice data; /* identifiers and strings only */
 };
 
 typedef struct node_data node_data_t;
@@ -108,18 +445,21 @@ typedef struct edge_data edge_data_t;
 typedef struct node_set_data node_set_data_t;
 typedef struct edge_set_data edge_set_data_t;
 
+/* query state, allocated from the query's arena. strings are NUL
+   terminated and "" when absent */
 struct node_data {
   /* identifier */
-  unsigned char ident[512];
+  unsigned char* ident;
 
   /* node label */
-  unsigned char label[512];
+  unsigned char* label;
 
   /* properties */
-  unsigned char keys[20][512];
-  unsigned char vals[20][512];
+  unsigned char** keys;
+  unsigned char** vals;
 
   int propcount;
+  int propcap;
 
   /* linked list */
   node_data_t* next;
@@ -132,10 +472,10 @@ struct node_data {
 
 struct edge_data {
   /* identifier */
-  unsigned char ident[512];
+  unsigned char* ident;
 
   /* edge label */
-  unsigned char label[512];
+  unsigned char* label;
 
   node_data_t *node_l, *node_r;
 
@@ -144,19 +484,38 @@ struct edge_data {
 };
 
 struct node_set_data {
-  unsigned char ident[512];
-  unsigned char prop[512];
-  unsigned char val[512];
+  unsigned char* ident;
+  unsigned char* prop;
+  unsigned char* val;
   node_set_data_t* next;
 };
 
 struct edge_set_data {
-  unsigned char left[512];
-  unsigned char right[512];
-  unsigned char label[512];
+  unsigned char* left;
+  unsigned char* right;
+  unsigned char* label;
   edge_set_data_t* next;
 };
 
+/* arena api */
+void* arena_alloc (Arena*, size_t);
+void arena_reset (Arena*);
+void arena_free (Arena*);
+
+/* buffer api */
+void buffer_init (Buffer*);
+int buffer_reserve (Buffer*, size_t);
+int buffer_append (Buffer*, const void*, size_t);
+void buffer_consume (Buffer*, size_t);
+void buffer_free (Buffer*);
+
+/* output api */
+void output_init (Output*);
+int output_append (Output*, const void*, size_t);
+int output_printf (Output*, const char*, ...);
+void output_consume (Output*, size_t);
+void output_free (Output*);
+
 /* map api */
 map_t* map_init ();
 int map_set (map_t*, const char*, void*);
@@ -164,21 +523,58 @@ int map_remove (map_t*, const char*);
 void* map_get (map_t*, const char* k);
 void map_iter (map_t *, void (* on_iter)(map_node_t*));
 
+/* symbol api */
+sym_t sym_intern (const unsigned char*);
+sym_t sym_lookup (const unsigned char*);
+const unsigned char* sym_name (sym_t);
+
+/* bitmap api */
+void bitmap_init (Bitmap*);
+void bitmap_free (Bitmap*);
+int bitmap_add (Bitmap*, unsigned int);
+void bitmap_remove (Bitmap*, unsigned int);
+int bitmap_contains (const Bitmap*, unsigned int);
+unsigned int bitmap_count (const Bitmap*);
+void bitmap_iterInit (BitmapIter*, const Bitmap*);
+int bitmap_iterNext (BitmapIter*, unsigned int*);
+unsigned int bitmap_iterRead (BitmapIter*, unsigned int*, unsigned int);
+void bitmap_iterSeek (BitmapIter*, unsigned int);
+
 /* graph api */
-Graph* graph_init (uint64);
-Vertex* graph_setVertex (Graph*, unsigned char*, Vertex*);
-Vertex* graph_getVertex (Graph*, unsigned char*);
-Vertex* graph_vertexInit (void);
-VertexContainer* graph_getVertices (Graph*, unsigned char*, unsigned char*, unsigned char*);
-void graph_removeVertex (Graph*, unsigned char*);
-void graph_vertexAddEdge (Vertex*, Vertex*, unsigned char*);
-void graph_vertexRemoveEdge (Vertex*, unsigned char*);
-void graph_vertexSetProperty (Vertex*, unsigned char*, unsigned char*);
-unsigned char* graph_vertexGetProperty (Vertex*, unsigned char*);
-void graph_vertexRemoveProperty (Vertex*, unsigned char*);
+Graph* graph_init ();
+void graph_lockShared (Graph*, int);
+void graph_unlockShared (Graph*);
+Vertex* graph_addVertex (Graph*);
+Vertex* graph_vertexById (Graph*, vid_t);
+int graph_addLabel (Graph*, Vertex*, sym_t);
+Bitmap* graph_labelMembers (Graph*, sym_t);
+unsigned long graph_labelCount (Graph*, sym_t);
+double graph_distinct (Graph*, sym_t, sym_t);
+double graph_fanout (Graph*, sym_t, int);
+VertexContainer* graph_getVertices (Graph*, Arena*, unsigned char*, unsigned char*, unsigned char*);
+VertexContainer* graph_matchVertices (Graph*, Arena*, unsigned char*, unsigned char**, unsigned char**, int);
+void graph_deleteVertex (Graph*, Vertex*);
+void graph_vertexAddEdge (Graph*, Vertex*, Vertex*, sym_t);
+Adjacency* graph_vertexEdges (Vertex*, sym_t);
+Adjacency* graph_vertexInEdges (Vertex*, sym_t);
+int graph_hasEdge (Graph*, Vertex*, Vertex*, sym_t);
+int graph_vertexRemoveEdge (Graph*, Vertex*, Vertex*, sym_t);
+void graph_vertexSetProperty (Graph*, Vertex*, sym_t, unsigned char*);
+unsigned char* graph_vertexGetProperty (Vertex*, sym_t);
+void graph_vertexRemoveProperty (Graph*, Vertex*, sym_t);
+int graph_createIndex (Graph*, sym_t, sym_t);
+int graph_sortEdges (Graph*, sym_t);
+int graph_compact (Graph*, unsigned int);
+Snapshot* graph_snapshot (Graph*);
+
+/* snapshot api */
+const vid_t* snapshot_edges (Snapshot*, vid_t, sym_t, size_t*);
+void snapshot_release (Snapshot*);
 
 /* tokenizer api */
-Token* token (unsigned char**);
+int token (unsigned char**, Token*);
+int slice_copy (const Slice*, unsigned char*, int);
+unsigned char* slice_dup (Arena*, const Slice*);
 
 /*** Grammar (bnf-ish) ***
 
@@ -207,7 +603,9 @@ NodeList ::=
 
 MatchNodeList ::= 
     Node 
-  | Node "," NodeList
+  | Node Edge Node
+  | Node "," MatchNodeList
+  | Node Edge Node "," MatchNodeList
 
 Create ::=
     "create" NodeList
@@ -243,21 +641,41 @@ Expr ::=
 
 ***************/
 
-/* parser api */
-void parse (Graph*, unsigned char*);
+/* where a MATCH stopped once its output reached limit bytes, so it can be
+   run again to print the rest. a zeroed cursor starts at the beginning,
+   and is ready for the next statement once one finishes */
+struct cursor {
+  size_t limit;
+  int stage;   /* 0 for the pattern, then 1 + the position of a lone node */
+  int anchor;  /* pattern slot the walk started from */
+  vid_t from;  /* first anchor or vertex id not printed yet */
+  int more;    /* the last run stopped early */
+};
+
+/* parser api: runs one query, writing results (or an error) to the buffer.
+   returns 0 on success and -1 if the query was rejected */
+int parse (Graph*, unsigned char*, Output*);
+
+/* like parse, but a MATCH without updates stops once the output reaches
+   the cursor's limit and picks up from the cursor when run again. the
+   graph lock is only held while a run lasts, so writes land in between */
+int parse_resume (Graph*, unsigned char*, Output*, Cursor*);
 
 /* parser execution api */
-edge_data_t* exec_addEdge(edge_data_t*, unsigned char*);
+edge_data_t* exec_addEdge(Arena*, edge_data_t*, Slice*);
 void exec_setRightNode(node_data_t*, edge_data_t*);
 void exec_setLeftNode(node_data_t*, edge_data_t*);
-void exec_addLabelToEdge(edge_data_t*, unsigned char*);
-void exec_cmd (Graph*, char*, node_data_t*, edge_data_t*, node_set_data_t*, edge_set_data_t*);
-void exec_printData (VertexContainer*, int);
-node_data_t* exec_addNode(node_data_t*, unsigned char*);
-void exec_addLabelToNode(node_data_t*, unsigned char*);
-node_data_t* exec_findNode(node_data_t*, unsigned char*);
-void exec_addProperty(node_data_t*, unsigned char*, unsigned char*);
-node_set_data_t* exec_addNodeUpdate(node_set_data_t*, unsigned char*, unsigned char*, unsigned char*);
-edge_set_data_t* exec_addEdgeUpdate(edge_set_data_t*, unsigned char*, unsigned char*, unsigned char*);
+int exec_addLabelToEdge(Arena*, edge_data_t*, Slice*);
+void exec_cmd (Graph*, Arena*, char*, node_data_t*, edge_data_t*, node_set_data_t*, edge_set_data_t*, Output*);
+void exec_matchUpdate (Graph*, Arena*, node_data_t*, edge_data_t*, node_set_data_t*, edge_set_data_t*, node_set_data_t*, edge_set_data_t*, Output*, Cursor*);
+void exec_printData (Graph*, Output*, VertexContainer*, int);
+void exec_createIndex (Graph*, unsigned char*, unsigned char*, Output*);
+void exec_sortEdges (Graph*, unsigned char*, Output*);
+node_data_t* exec_addNode(Arena*, node_data_t*, Slice*);
+int exec_addLabelToNode(Arena*, node_data_t*, Slice*);
+node_data_t* exec_findNode(node_data_t*, Slice*);
+int exec_addProperty(Arena*, node_data_t*, Slice*, Slice*);
+node_set_data_t* exec_addNodeUpdate(Arena*, node_set_data_t*, Slice*, Slice*, Slice*);
+edge_set_data_t* exec_addEdgeUpdate(Arena*, edge_set_data_t*, Slice*, Slice*, Slice*);
 
 #endif
\ No newline at end of file
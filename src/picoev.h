@@ -41,6 +41,8 @@ extern "C" {
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 
 #define PICOEV_IS_INITED (picoev.max_fd != 0)  
@@ -127,6 +129,24 @@ extern "C" {
   /* internal: poll once and call the handlers (defined by each backend) */
   int picoev_poll_once_internal(picoev_loop* loop, int max_wait);
   
+  /* reads from a descriptor, same semantics as read(2) (defined by each
+     backend; completion based backends return data already received) */
+  ssize_t picoev_read(picoev_loop* loop, int fd, void* buf, size_t len);
+  
+  /* writes to a descriptor, same semantics as write(2) (defined by each
+     backend; completion based backends queue the data and may return -1 with
+     errno set to EAGAIN once too much is in flight) */
+  ssize_t picoev_write(picoev_loop* loop, int fd, const void* buf, size_t len);
+  
+  /* gathering variant of picoev_write, same semantics as writev(2) (defined
+     by each backend) */
+  ssize_t picoev_writev(picoev_loop* loop, int fd, const struct iovec* iov,
+			int iovcnt);
+  
+  /* accepts a connection on a listening socket, same semantics as
+     accept(fd, NULL, NULL) (defined by each backend) */
+  int picoev_accept(picoev_loop* loop, int fd);
+  
   /* internal, aligned allocator with address scrambling to avoid cache
      line contention */
   PICOEV_INLINE
@@ -144,7 +164,7 @@ extern "C" {
 			   PICOEV_CACHE_LINE_SIZE);
   }
   
-  /* initializes picoev */
+  /* initializes picoev, must be called once before any loop is created */
   PICOEV_INLINE
   int picoev_init(int max_fd) {
     assert(! PICOEV_IS_INITED);
@@ -314,7 +334,9 @@ extern "C" {
   /* internal function */
   PICOEV_INLINE
   int picoev_init_loop_internal(picoev_loop* loop, int max_timeout) {
-    loop->loop_id = ++picoev.num_loops;
+    /* loops may be created concurrently, one per thread; they share
+       picoev.fds, every descriptor belonging to the loop that added it */
+    loop->loop_id = __sync_add_and_fetch(&picoev.num_loops, 1);
     assert(PICOEV_TOO_MANY_LOOPS);
     if ((loop->timeout.vec_of_vec
 	 = (short*)picoev_memalign((picoev.timeout_vec_of_vec_size
@@ -322,7 +344,7 @@ extern "C" {
 				   * sizeof(short) * PICOEV_TIMEOUT_VEC_SIZE,
 				   &loop->timeout._free_addr, 1))
 	== NULL) {
-      --picoev.num_loops;
+      __sync_sub_and_fetch(&picoev.num_loops, 1);
       return -1;
     }
     loop->timeout.vec = loop->timeout.vec_of_vec
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "picoev.h"
+
+/* build with -DPICOEV_EPOLL_EDGE=1 to register descriptors edge-triggered;
+   handlers must then read / write until EAGAIN before returning */
+#ifndef PICOEV_EPOLL_EDGE
+# define PICOEV_EPOLL_EDGE 0
+#endif
+
+#if PICOEV_EPOLL_EDGE
+# define PICOEV_EPOLL_FLAGS EPOLLET
+#else
+# define PICOEV_EPOLL_FLAGS 0
+#endif
+
+/* next_fd is -1 at the end of the list, shift it unsigned so that stays
+   defined */
+#define BACKEND_BUILD(next_fd, events)	\
+  (((unsigned)(next_fd) << 8) | ((unsigned)(events) & 0xff))
+#define BACKEND_GET_NEXT_FD(backend) ((int)(backend) >> 8)
+#define BACKEND_GET_OLD_EVENTS(backend) ((int)(backend) & 0xff)
+
+typedef struct picoev_loop_epoll_st {
+  picoev_loop loop;
+  int epfd;
+  int changed_fds; /* link list using picoev_fd::_backend, -1 if not changed */
+  struct epoll_event events[1024];
+} picoev_loop_epoll;
+
+picoev_globals picoev;
+
+/* epoll has no changelist, so instead of issuing epoll_ctl on every
+   picoev_set_events() the changes are collected per fd and only the net
+   difference is sent to the kernel right before epoll_wait */
+static void apply_pending_changes(picoev_loop_epoll* loop)
+{
+  struct epoll_event ev;
+  int r;
+  
+  while (loop->changed_fds != -1) {
+    int fd = loop->changed_fds;
+    picoev_fd* changed = picoev.fds + fd;
+    int old_events = BACKEND_GET_OLD_EVENTS(changed->_backend);
+    loop->changed_fds = BACKEND_GET_NEXT_FD(changed->_backend);
+    changed->_backend = -1;
+    if (changed->events == old_events) {
+      continue;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((changed->events & PICOEV_READ) != 0 ? EPOLLIN : 0)
+      | ((changed->events & PICOEV_WRITE) != 0 ? EPOLLOUT : 0)
+      | PICOEV_EPOLL_FLAGS;
+    ev.data.fd = fd;
+    if (changed->events == 0) {
+      r = epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, &ev);
+    } else if (old_events == 0) {
+      r = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+      if (r != 0 && errno == EEXIST) {
+	/* still registered after a picoev_del() without close() */
+	r = epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+      }
+    } else {
+      r = epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    assert(r == 0 || errno == EBADF || errno == ENOENT);
+  }
+}
+
+picoev_loop* picoev_create_loop(int max_timeout)
+{
+  picoev_loop_epoll* loop;
+  
+  /* init parent */
+  assert(PICOEV_IS_INITED);
+  if ((loop = (picoev_loop_epoll*)malloc(sizeof(picoev_loop_epoll)))
+      == NULL) {
+    return NULL;
+  }
+  if (picoev_init_loop_internal(&loop->loop, max_timeout) != 0) {
+    free(loop);
+    return NULL;
+  }
+  
+  /* init epoll */
+  if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    picoev_deinit_loop_internal(&loop->loop);
+    free(loop);
+    return NULL;
+  }
+  loop->changed_fds = -1;
+  
+  loop->loop.now = time(NULL);
+  return &loop->loop;
+}
+
+int picoev_destroy_loop(picoev_loop* _loop)
+{
+  picoev_loop_epoll* loop = (picoev_loop_epoll*)_loop;
+  
+  if (close(loop->epfd) != 0) {
+    return -1;
+  }
+  picoev_deinit_loop_internal(&loop->loop);
+  free(loop);
+  return 0;
+}
+
+int picoev_update_events_internal(picoev_loop* _loop, int fd, int events)
+{
+  picoev_loop_epoll* loop = (picoev_loop_epoll*)_loop;
+  picoev_fd* target = picoev.fds + fd;
+  
+  assert(PICOEV_FD_BELONGS_TO_LOOP(&loop->loop, fd));
+  
+  /* initialize if adding the fd */
+  if ((events & PICOEV_ADD) != 0) {
+    target->_backend = -1;
+  }
+  /* return if nothing to do */
+  if (events == PICOEV_DEL
+      ? target->_backend == -1
+      : (events & PICOEV_READWRITE) == target->events) {
+    return 0;
+  }
+  /* add to changed list if not yet being done */
+  if (target->_backend == -1) {
+    target->_backend = BACKEND_BUILD(loop->changed_fds, target->events);
+    loop->changed_fds = fd;
+  }
+  /* update events */
+  target->events = events & PICOEV_READWRITE;
+  /* apply immediately if is a DELETE, the fd is about to be closed */
+  if ((events & PICOEV_DEL) != 0) {
+    apply_pending_changes(loop);
+  }
+  
+  return 0;
+}
+
+int picoev_poll_once_internal(picoev_loop* _loop, int max_wait)
+{
+  picoev_loop_epoll* loop = (picoev_loop_epoll*)_loop;
+  int nevents, i;
+  
+  apply_pending_changes(loop);
+  
+  nevents = epoll_wait(loop->epfd, loop->events,
+		       sizeof(loop->events) / sizeof(loop->events[0]),
+		       max_wait * 1000);
+  if (nevents == -1) {
+    /* the errors we can only rescue */
+    assert(errno == EINTR);
+    return -1;
+  }
+  for (i = 0; i < nevents; ++i) {
+    struct epoll_event* event = loop->events + i;
+    picoev_fd* target = picoev.fds + event->data.fd;
+    if (loop->loop.loop_id == target->loop_id
+	&& (target->events & PICOEV_READWRITE) != 0) {
+      int revents = ((event->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0
+		     ? PICOEV_READ : 0)
+	| ((event->events & (EPOLLOUT | EPOLLERR)) != 0 ? PICOEV_WRITE : 0);
+      revents &= target->events;
+      if (revents != 0) {
+	(*target->callback)(&loop->loop, event->data.fd, revents,
+			    target->cb_arg);
+      }
+    } else if (loop->loop.loop_id != target->loop_id) {
+      /* deleted without being closed, stop watching it */
+      epoll_ctl(loop->epfd, EPOLL_CTL_DEL, event->data.fd, event);
+    }
+  }
+  
+  return 0;
+}
+
+ssize_t picoev_read(picoev_loop* loop __attribute__((unused)), int fd,
+		    void* buf, size_t len)
+{
+  return read(fd, buf, len);
+}
+
+ssize_t picoev_write(picoev_loop* loop __attribute__((unused)), int fd,
+		     const void* buf, size_t len)
+{
+  return write(fd, buf, len);
+}
+
+ssize_t picoev_writev(picoev_loop* loop __attribute__((unused)), int fd,
+		      const struct iovec* iov, int iovcnt)
+{
+  return writev(fd, iov, iovcnt);
+}
+
+int picoev_accept(picoev_loop* loop __attribute__((unused)), int fd)
+{
+  return accept(fd, NULL, NULL);
+}
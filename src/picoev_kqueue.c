@@ -30,14 +30,18 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/event.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "picoev.h"
 
 #define EV_QUEUE_SZ 128
 
+/* next_fd is -1 at the end of the list, shift it unsigned so that stays
+   defined */
 #define BACKEND_BUILD(next_fd, events)	\
-  ((unsigned)((next_fd << 8) | (events & 0xff)))
+  (((unsigned)(next_fd) << 8) | ((unsigned)(events) & 0xff))
 #define BACKEND_GET_NEXT_FD(backend) ((int)(backend) >> 8)
 #define BACKEND_GET_OLD_EVENTS(backend) ((int)(backend) & 0xff)
 
@@ -207,3 +211,26 @@ int picoev_poll_once_internal(picoev_loop* _loop, int max_wait)
   
   return 0;
 }
+
+ssize_t picoev_read(picoev_loop* loop __attribute__((unused)), int fd,
+		    void* buf, size_t len)
+{
+  return read(fd, buf, len);
+}
+
+ssize_t picoev_write(picoev_loop* loop __attribute__((unused)), int fd,
+		     const void* buf, size_t len)
+{
+  return write(fd, buf, len);
+}
+
+ssize_t picoev_writev(picoev_loop* loop __attribute__((unused)), int fd,
+		      const struct iovec* iov, int iovcnt)
+{
+  return writev(fd, iov, iovcnt);
+}
+
+int picoev_accept(picoev_loop* loop __attribute__((unused)), int fd)
+{
+  return accept(fd, NULL, NULL);
+}
@@ -0,0 +1,954 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* io_uring backend (linux >= 6.0)
+ *
+ * Listening sockets are served by a multishot accept and connected sockets
+ * by a multishot recv that picks its memory from a ring of provided buffers,
+ * so neither needs a syscall per event.  Received buffers stay queued on the
+ * descriptor until picoev_read() copies them out, and picoev_write() only
+ * queues the data; every send is turned into an SQE and everything is
+ * submitted with a single io_uring_enter per picoev_loop_once.  The recv
+ * is cancelled when PICOEV_READ is dropped or URING_MAX_RX_BUFS buffers are
+ * queued on the descriptor, so a peer can't pin the whole buffer ring while
+ * the application isn't reading.  Descriptors
+ * that are not sockets fall back to one-shot poll requests and plain
+ * read(2) / write(2).
+ *
+ * Readiness is reported level-triggered, like the other backends. */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "picoev.h"
+
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_BUF_COUNT 512 /* must be a power of 2 */
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+#define URING_MAX_PENDING_SEND (256 * 1024)
+#define URING_MAX_RX_BUFS 32 /* per descriptor, the recv is cancelled above */
+
+enum {
+  OP_IGNORE = 0,
+  OP_ACCEPT,
+  OP_RECV,
+  OP_POLL,
+  OP_SEND
+};
+
+/* user_data is either (gen, fd, op) or a pointer to a send tagged with
+   OP_SEND in the low bits */
+#define UDATA_BUILD(fd, gen, op)					\
+  (((uint64_t)(gen) << 32) | ((uint64_t)(fd) << 3) | (uint64_t)(op))
+#define UDATA_GET_OP(u) ((int)((u) & 7))
+#define UDATA_GET_FD(u) ((int)(((u) >> 3) & 0x1fffffff))
+#define UDATA_GET_GEN(u) ((unsigned)((u) >> 32))
+
+typedef struct uring_send_st {
+  int fd; /* -1 once orphaned by picoev_del() */
+  char* buf;
+  size_t len;
+  size_t off;
+} uring_send;
+
+typedef struct uring_fd_st {
+  int kind; /* OP_ACCEPT, OP_RECV or OP_POLL */
+  unsigned gen;
+  int armed;
+  int cancelling; /* an ASYNC_CANCEL of the armed request is queued */
+  int poll_mask; /* mask of the armed poll request */
+  int poll_revents;
+  int eof;
+  int err;
+  int dirty;
+  int ready;
+  /* received buffers, linked through picoev_loop_uring::buf_next */
+  int rx_head, rx_tail, rx_count;
+  size_t rx_off;
+  /* accepted descriptors */
+  int* accepted;
+  int accepted_off, accepted_cnt, accepted_cap;
+  /* data queued by picoev_write, and the send being executed */
+  char* tx;
+  size_t tx_len, tx_cap;
+  uring_send* inflight;
+  int send_err;
+} uring_fd;
+
+typedef struct picoev_loop_uring_st {
+  picoev_loop loop;
+  int ring_fd;
+  /* submission queue */
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail;
+  struct io_uring_sqe* sqes;
+  /* completion queue */
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  /* mappings */
+  void* sq_ptr;
+  size_t sq_sz;
+  void* cq_ptr;
+  size_t cq_sz;
+  size_t sqes_sz;
+  /* provided buffers */
+  struct io_uring_buf_ring* br;
+  size_t br_sz;
+  unsigned short br_tail;
+  char* bufs;
+  int buf_next[URING_BUF_COUNT];
+  int buf_len[URING_BUF_COUNT];
+  int buf_free;
+  /* per-fd state and work lists */
+  uring_fd* fds;
+  int* dirty;
+  int num_dirty;
+  int* ready;
+  int num_ready;
+  int* dispatching;
+} picoev_loop_uring;
+
+picoev_globals picoev;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+			      unsigned min_complete, unsigned flags,
+			      void* arg, size_t argsz)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		      arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg,
+				 unsigned nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned sq_unsubmitted(picoev_loop_uring* loop)
+{
+  return loop->sq_local_tail - __atomic_load_n(loop->sq_head,
+					       __ATOMIC_ACQUIRE);
+}
+
+static int submit(picoev_loop_uring* loop, unsigned min_complete,
+		  int max_wait)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = 0;
+  
+  __atomic_store_n(loop->sq_tail, loop->sq_local_tail, __ATOMIC_RELEASE);
+  if (min_complete != 0) {
+    memset(&arg, 0, sizeof(arg));
+    ts.tv_sec = max_wait;
+    ts.tv_nsec = 0;
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    return sys_io_uring_enter(loop->ring_fd, sq_unsubmitted(loop),
+			      min_complete, flags, &arg, sizeof(arg));
+  }
+  return sys_io_uring_enter(loop->ring_fd, sq_unsubmitted(loop), 0,
+			    IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static struct io_uring_sqe* get_sqe(picoev_loop_uring* loop)
+{
+  struct io_uring_sqe* sqe;
+  
+  if (sq_unsubmitted(loop) >= loop->sq_entries) {
+    /* queue is full, flush it without waiting */
+    submit(loop, 0, 0);
+  }
+  sqe = loop->sqes + (loop->sq_local_tail & loop->sq_mask);
+  ++loop->sq_local_tail;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void buf_recycle(picoev_loop_uring* loop, int bid)
+{
+  struct io_uring_buf* buf
+    = &loop->br->bufs[loop->br_tail & (URING_BUF_COUNT - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(loop->bufs + (size_t)bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  ++loop->br_tail;
+  __atomic_store_n(&loop->br->tail, loop->br_tail, __ATOMIC_RELEASE);
+  ++loop->buf_free;
+}
+
+static void mark_dirty(picoev_loop_uring* loop, int fd)
+{
+  if (! loop->fds[fd].dirty) {
+    loop->fds[fd].dirty = 1;
+    loop->dirty[loop->num_dirty++] = fd;
+  }
+}
+
+static void mark_ready(picoev_loop_uring* loop, int fd)
+{
+  if (! loop->fds[fd].ready) {
+    loop->fds[fd].ready = 1;
+    loop->ready[loop->num_ready++] = fd;
+  }
+}
+
+static size_t pending_send(uring_fd* u)
+{
+  return u->tx_len + (u->inflight != NULL
+		      ? u->inflight->len - u->inflight->off : 0);
+}
+
+static int poll_mask_of(int events)
+{
+  return ((events & PICOEV_READ) != 0 ? POLLIN : 0)
+    | ((events & PICOEV_WRITE) != 0 ? POLLOUT : 0);
+}
+
+static void prep_send(picoev_loop_uring* loop, uring_send* send)
+{
+  struct io_uring_sqe* sqe = get_sqe(loop);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = send->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(send->buf + send->off);
+  sqe->len = send->len - send->off;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uint64_t)(uintptr_t)send | OP_SEND;
+}
+
+static void issue_send(picoev_loop_uring* loop, int fd)
+{
+  uring_fd* u = loop->fds + fd;
+  uring_send* send;
+  
+  if ((send = (uring_send*)malloc(sizeof(uring_send))) == NULL) {
+    u->send_err = ENOMEM;
+    return;
+  }
+  send->fd = fd;
+  send->buf = u->tx;
+  send->len = u->tx_len;
+  send->off = 0;
+  u->tx = NULL;
+  u->tx_len = u->tx_cap = 0;
+  u->inflight = send;
+  prep_send(loop, send);
+}
+
+/* stops the multishot recv of fd, its final completion disarms it */
+static void cancel_recv(picoev_loop_uring* loop, int fd)
+{
+  uring_fd* u = loop->fds + fd;
+  struct io_uring_sqe* sqe;
+  
+  if (! u->armed || u->cancelling) {
+    return;
+  }
+  sqe = get_sqe(loop);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = UDATA_BUILD(fd, u->gen, OP_RECV);
+  sqe->user_data = UDATA_BUILD(fd, 0, OP_IGNORE);
+  u->cancelling = 1;
+}
+
+/* arms requests and issues sends that were deferred to the next submit */
+static void apply_pending_changes(picoev_loop_uring* loop)
+{
+  int i, n = loop->num_dirty;
+  
+  loop->num_dirty = 0;
+  for (i = 0; i < n; ++i) {
+    int fd = loop->dirty[i];
+    picoev_fd* target = picoev.fds + fd;
+    uring_fd* u = loop->fds + fd;
+    struct io_uring_sqe* sqe;
+    u->dirty = 0;
+    if (target->loop_id != loop->loop.loop_id) {
+      continue;
+    }
+    if (u->tx_len != 0 && u->inflight == NULL && u->send_err == 0) {
+      issue_send(loop, fd);
+    }
+    if (u->armed || (target->events & PICOEV_READWRITE) == 0) {
+      continue;
+    }
+    switch (u->kind) {
+    case OP_ACCEPT:
+      if ((target->events & PICOEV_READ) == 0) {
+	break;
+      }
+      sqe = get_sqe(loop);
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = fd;
+      sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->user_data = UDATA_BUILD(fd, u->gen, OP_ACCEPT);
+      u->armed = 1;
+      break;
+    case OP_RECV:
+      if ((target->events & PICOEV_READ) == 0 || u->eof || u->err != 0
+	  || u->rx_head != -1) {
+	/* rearmed by picoev_read once the queue is drained */
+	break;
+      }
+      if (loop->buf_free == 0) {
+	/* every buffer is queued somewhere, retry on the next round */
+	mark_dirty(loop, fd);
+	break;
+      }
+      sqe = get_sqe(loop);
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = fd;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = URING_BUF_GROUP;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->user_data = UDATA_BUILD(fd, u->gen, OP_RECV);
+      u->armed = 1;
+      break;
+    case OP_POLL:
+      sqe = get_sqe(loop);
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = fd;
+      sqe->poll32_events = poll_mask_of(target->events);
+      sqe->user_data = UDATA_BUILD(fd, u->gen, OP_POLL);
+      u->poll_mask = sqe->poll32_events;
+      u->armed = 1;
+      break;
+    }
+  }
+}
+
+static void handle_send(picoev_loop_uring* loop, struct io_uring_cqe* cqe)
+{
+  uring_send* send = (uring_send*)(uintptr_t)(cqe->user_data & ~(uint64_t)7);
+  uring_fd* u;
+  
+  if (send->fd == -1 || (u = loop->fds + send->fd)->inflight != send) {
+    /* descriptor was deleted while the send was running */
+    free(send->buf);
+    free(send);
+    return;
+  }
+  if (cqe->res < 0) {
+    u->send_err = -cqe->res;
+  } else if ((send->off += cqe->res) < send->len) {
+    prep_send(loop, send);
+    return;
+  }
+  u->inflight = NULL;
+  if (u->tx_cap == 0) {
+    /* reuse the buffer for the next batch */
+    u->tx = send->buf;
+    u->tx_cap = send->len;
+    u->tx_len = 0;
+  } else {
+    free(send->buf);
+  }
+  free(send);
+  if (u->tx_len != 0) {
+    mark_dirty(loop, (int)(u - loop->fds));
+  }
+  mark_ready(loop, (int)(u - loop->fds));
+}
+
+static void handle_cqe(picoev_loop_uring* loop, struct io_uring_cqe* cqe)
+{
+  int op = UDATA_GET_OP(cqe->user_data), fd, more;
+  uring_fd* u;
+  
+  if (op == OP_IGNORE) {
+    return;
+  }
+  if (op == OP_SEND) {
+    handle_send(loop, cqe);
+    return;
+  }
+  fd = UDATA_GET_FD(cqe->user_data);
+  u = loop->fds + fd;
+  more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+  
+  if (u->gen != UDATA_GET_GEN(cqe->user_data) || u->kind != op
+      || picoev.fds[fd].loop_id != loop->loop.loop_id) {
+    /* stale completion of a descriptor that has been deleted */
+    if ((cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+      buf_recycle(loop, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if (op == OP_ACCEPT && cqe->res >= 0) {
+      close(cqe->res);
+    }
+    return;
+  }
+  if (! more) {
+    u->armed = 0;
+    u->cancelling = 0;
+    mark_dirty(loop, fd);
+  }
+  
+  switch (op) {
+  case OP_ACCEPT:
+    if (cqe->res < 0) {
+      return;
+    }
+    if (u->accepted_off + u->accepted_cnt == u->accepted_cap) {
+      if (u->accepted_off != 0) {
+	memmove(u->accepted, u->accepted + u->accepted_off,
+		sizeof(int) * u->accepted_cnt);
+	u->accepted_off = 0;
+      } else {
+	int cap = u->accepted_cap != 0 ? u->accepted_cap * 2 : 16;
+	int* a = (int*)realloc(u->accepted, sizeof(int) * cap);
+	if (a == NULL) {
+	  close(cqe->res);
+	  return;
+	}
+	u->accepted = a;
+	u->accepted_cap = cap;
+      }
+    }
+    u->accepted[u->accepted_off + u->accepted_cnt++] = cqe->res;
+    break;
+  case OP_RECV:
+    if ((cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+      int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      --loop->buf_free;
+      if (cqe->res <= 0) {
+	buf_recycle(loop, bid);
+      } else {
+	loop->buf_len[bid] = cqe->res;
+	loop->buf_next[bid] = -1;
+	if (u->rx_tail != -1) {
+	  loop->buf_next[u->rx_tail] = bid;
+	} else {
+	  u->rx_head = bid;
+	  u->rx_off = 0;
+	}
+	u->rx_tail = bid;
+	if (++u->rx_count >= URING_MAX_RX_BUFS) {
+	  cancel_recv(loop, fd);
+	}
+      }
+    }
+    if (cqe->res == 0) {
+      u->eof = 1;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS
+	       && cqe->res != -ECANCELED) {
+      u->err = -cqe->res;
+    }
+    break;
+  case OP_POLL:
+    if (cqe->res > 0) {
+      u->poll_revents |= cqe->res;
+    }
+    break;
+  }
+  mark_ready(loop, fd);
+}
+
+static int revents_of(picoev_loop_uring* loop, int fd)
+{
+  picoev_fd* target = picoev.fds + fd;
+  uring_fd* u = loop->fds + fd;
+  int revents = 0;
+  
+  if (target->loop_id != loop->loop.loop_id) {
+    return 0;
+  }
+  if ((target->events & PICOEV_READ) != 0) {
+    switch (u->kind) {
+    case OP_ACCEPT:
+      if (u->accepted_cnt != 0) {
+	revents |= PICOEV_READ;
+      }
+      break;
+    case OP_RECV:
+      if (u->rx_head != -1 || u->eof || u->err != 0) {
+	revents |= PICOEV_READ;
+      }
+      break;
+    case OP_POLL:
+      if ((u->poll_revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+	revents |= PICOEV_READ;
+      }
+      break;
+    }
+  }
+  if ((target->events & PICOEV_WRITE) != 0) {
+    if (u->kind == OP_POLL) {
+      if ((u->poll_revents & (POLLOUT | POLLERR)) != 0) {
+	revents |= PICOEV_WRITE;
+      }
+    } else if (u->send_err != 0 || pending_send(u) < URING_MAX_PENDING_SEND) {
+      revents |= PICOEV_WRITE;
+    }
+  }
+  return revents;
+}
+
+static void fd_reset(picoev_loop_uring* loop, int fd)
+{
+  uring_fd* u = loop->fds + fd;
+  int bid;
+  
+  while ((bid = u->rx_head) != -1) {
+    u->rx_head = loop->buf_next[bid];
+    buf_recycle(loop, bid);
+  }
+  u->rx_tail = -1;
+  u->rx_count = 0;
+  u->rx_off = 0;
+  while (u->accepted_cnt != 0) {
+    close(u->accepted[u->accepted_off++]);
+    --u->accepted_cnt;
+  }
+  u->accepted_off = 0;
+  if (u->inflight != NULL) {
+    /* freed when its (cancelled) completion arrives */
+    u->inflight->fd = -1;
+    u->inflight = NULL;
+  }
+  free(u->tx);
+  u->tx = NULL;
+  u->tx_len = u->tx_cap = 0;
+  u->armed = 0;
+  u->cancelling = 0;
+  u->eof = 0;
+  u->err = 0;
+  u->send_err = 0;
+  u->poll_revents = 0;
+}
+
+picoev_loop* picoev_create_loop(int max_timeout)
+{
+  picoev_loop_uring* loop;
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  unsigned i;
+  
+  /* init parent */
+  assert(PICOEV_IS_INITED);
+  if ((loop = (picoev_loop_uring*)calloc(1, sizeof(picoev_loop_uring)))
+      == NULL) {
+    return NULL;
+  }
+  if (picoev_init_loop_internal(&loop->loop, max_timeout) != 0) {
+    free(loop);
+    return NULL;
+  }
+  loop->ring_fd = -1;
+  
+  /* init the ring */
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+  params.cq_entries = URING_CQ_ENTRIES;
+  if ((loop->ring_fd = sys_io_uring_setup(URING_SQ_ENTRIES, &params)) == -1) {
+    params.flags &= ~IORING_SETUP_COOP_TASKRUN;
+    if ((loop->ring_fd = sys_io_uring_setup(URING_SQ_ENTRIES, &params))
+	== -1) {
+      goto Error;
+    }
+  }
+  loop->sq_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  loop->cq_sz = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+    if (loop->cq_sz > loop->sq_sz) {
+      loop->sq_sz = loop->cq_sz;
+    }
+  }
+  if ((loop->sq_ptr = mmap(NULL, loop->sq_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+			   IORING_OFF_SQ_RING)) == MAP_FAILED) {
+    loop->sq_ptr = NULL;
+    goto Error;
+  }
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+    loop->cq_ptr = loop->sq_ptr;
+  } else if ((loop->cq_ptr = mmap(NULL, loop->cq_sz, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+				  IORING_OFF_CQ_RING)) == MAP_FAILED) {
+    loop->cq_ptr = NULL;
+    goto Error;
+  }
+  loop->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+  if ((loop->sqes = mmap(NULL, loop->sqes_sz, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+			 IORING_OFF_SQES)) == MAP_FAILED) {
+    loop->sqes = NULL;
+    goto Error;
+  }
+  loop->sq_head = (unsigned*)((char*)loop->sq_ptr + params.sq_off.head);
+  loop->sq_tail = (unsigned*)((char*)loop->sq_ptr + params.sq_off.tail);
+  loop->sq_mask = *(unsigned*)((char*)loop->sq_ptr + params.sq_off.ring_mask);
+  loop->sq_entries = params.sq_entries;
+  loop->sq_local_tail = *loop->sq_tail;
+  for (i = 0; i < params.sq_entries; ++i) {
+    ((unsigned*)((char*)loop->sq_ptr + params.sq_off.array))[i] = i;
+  }
+  loop->cq_head = (unsigned*)((char*)loop->cq_ptr + params.cq_off.head);
+  loop->cq_tail = (unsigned*)((char*)loop->cq_ptr + params.cq_off.tail);
+  loop->cq_mask = *(unsigned*)((char*)loop->cq_ptr + params.cq_off.ring_mask);
+  loop->cqes
+    = (struct io_uring_cqe*)((char*)loop->cq_ptr + params.cq_off.cqes);
+  
+  /* register the provided buffer ring */
+  loop->br_sz = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+  if ((loop->br = mmap(NULL, loop->br_sz, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+    loop->br = NULL;
+    goto Error;
+  }
+  if ((loop->bufs = (char*)malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE))
+      == NULL) {
+    goto Error;
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)loop->br;
+  reg.ring_entries = URING_BUF_COUNT;
+  reg.bgid = URING_BUF_GROUP;
+  if (sys_io_uring_register(loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1)
+      != 0) {
+    goto Error;
+  }
+  for (i = 0; i < URING_BUF_COUNT; ++i) {
+    buf_recycle(loop, i);
+  }
+  
+  /* per-fd state */
+  if ((loop->fds = (uring_fd*)calloc(picoev.max_fd, sizeof(uring_fd))) == NULL
+      || (loop->dirty = (int*)malloc(sizeof(int) * picoev.max_fd)) == NULL
+      || (loop->ready = (int*)malloc(sizeof(int) * picoev.max_fd)) == NULL
+      || (loop->dispatching = (int*)malloc(sizeof(int) * picoev.max_fd))
+      == NULL) {
+    goto Error;
+  }
+  for (i = 0; i < (unsigned)picoev.max_fd; ++i) {
+    loop->fds[i].rx_head = loop->fds[i].rx_tail = -1;
+  }
+  
+  loop->loop.now = time(NULL);
+  return &loop->loop;
+  
+ Error:
+  picoev_destroy_loop(&loop->loop);
+  return NULL;
+}
+
+int picoev_destroy_loop(picoev_loop* _loop)
+{
+  picoev_loop_uring* loop = (picoev_loop_uring*)_loop;
+  int i;
+  
+  if (loop->ring_fd != -1 && close(loop->ring_fd) != 0) {
+    return -1;
+  }
+  if (loop->fds != NULL) {
+    for (i = 0; i < picoev.max_fd; ++i) {
+      free(loop->fds[i].accepted);
+      free(loop->fds[i].tx);
+      /* in-flight sends died with the ring */
+      if (loop->fds[i].inflight != NULL) {
+	free(loop->fds[i].inflight->buf);
+	free(loop->fds[i].inflight);
+      }
+    }
+  }
+  if (loop->sqes != NULL) {
+    munmap(loop->sqes, loop->sqes_sz);
+  }
+  if (loop->cq_ptr != NULL && loop->cq_ptr != loop->sq_ptr) {
+    munmap(loop->cq_ptr, loop->cq_sz);
+  }
+  if (loop->sq_ptr != NULL) {
+    munmap(loop->sq_ptr, loop->sq_sz);
+  }
+  if (loop->br != NULL) {
+    munmap(loop->br, loop->br_sz);
+  }
+  free(loop->bufs);
+  free(loop->fds);
+  free(loop->dirty);
+  free(loop->ready);
+  free(loop->dispatching);
+  picoev_deinit_loop_internal(&loop->loop);
+  free(loop);
+  return 0;
+}
+
+int picoev_update_events_internal(picoev_loop* _loop, int fd, int events)
+{
+  picoev_loop_uring* loop = (picoev_loop_uring*)_loop;
+  picoev_fd* target = picoev.fds + fd;
+  uring_fd* u = loop->fds + fd;
+  
+  assert(PICOEV_FD_BELONGS_TO_LOOP(&loop->loop, fd));
+  
+  /* initialize if adding the fd */
+  if ((events & PICOEV_ADD) != 0) {
+    int listening = 0;
+    socklen_t l = sizeof(listening);
+    fd_reset(loop, fd);
+    ++u->gen;
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &l) != 0) {
+      u->kind = OP_POLL;
+    } else {
+      u->kind = listening ? OP_ACCEPT : OP_RECV;
+    }
+  }
+  
+  if ((events & PICOEV_DEL) != 0) {
+    /* cancel everything on the fd before the caller closes it */
+    struct io_uring_sqe* sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = UDATA_BUILD(fd, 0, OP_IGNORE);
+    submit(loop, 0, 0);
+    fd_reset(loop, fd);
+    ++u->gen;
+    target->events = 0;
+    return 0;
+  }
+  
+  if (u->kind == OP_POLL && u->armed
+      && poll_mask_of(events) != u->poll_mask) {
+    /* rearmed with the new mask once the removal completes */
+    struct io_uring_sqe* sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = UDATA_BUILD(fd, u->gen, OP_POLL);
+    sqe->user_data = UDATA_BUILD(fd, 0, OP_IGNORE);
+  }
+  if (u->kind == OP_RECV && (events & PICOEV_READ) == 0) {
+    /* rearmed once PICOEV_READ is back and the queue is drained */
+    cancel_recv(loop, fd);
+  }
+  target->events = events & PICOEV_READWRITE;
+  mark_dirty(loop, fd);
+  mark_ready(loop, fd);
+  
+  return 0;
+}
+
+int picoev_poll_once_internal(picoev_loop* _loop, int max_wait)
+{
+  picoev_loop_uring* loop = (picoev_loop_uring*)_loop;
+  unsigned head, tail;
+  int i, n;
+  
+  apply_pending_changes(loop);
+  
+  /* submit everything queued during the last round and wait */
+  if (submit(loop, loop->num_ready == 0 && max_wait != 0 ? 1 : 0, max_wait)
+      == -1 && errno != ETIME && errno != EBUSY) {
+    /* the errors we can only rescue */
+    assert(errno == EINTR);
+    return -1;
+  }
+  
+  head = *loop->cq_head;
+  tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    handle_cqe(loop, loop->cqes + (head & loop->cq_mask));
+  }
+  __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+  
+  /* dispatch, handlers may add more work to the ready list */
+  n = loop->num_ready;
+  memcpy(loop->dispatching, loop->ready, sizeof(int) * n);
+  loop->num_ready = 0;
+  for (i = 0; i < n; ++i) {
+    int fd = loop->dispatching[i], revents;
+    loop->fds[fd].ready = 0;
+    if ((revents = revents_of(loop, fd)) == 0) {
+      continue;
+    }
+    if (loop->fds[fd].kind == OP_POLL) {
+      loop->fds[fd].poll_revents = 0;
+    }
+    (*picoev.fds[fd].callback)(&loop->loop, fd, revents,
+			       picoev.fds[fd].cb_arg);
+    /* level-triggered: report again next round if still ready */
+    if (loop->fds[fd].kind != OP_POLL && revents_of(loop, fd) != 0) {
+      mark_ready(loop, fd);
+    }
+  }
+  
+  return 0;
+}
+
+ssize_t picoev_read(picoev_loop* _loop, int fd, void* buf, size_t len)
+{
+  picoev_loop_uring* loop = (picoev_loop_uring*)_loop;
+  uring_fd* u = loop->fds + fd;
+  size_t n = 0;
+  
+  if (u->kind != OP_RECV) {
+    return read(fd, buf, len);
+  }
+  while (n < len && u->rx_head != -1) {
+    int bid = u->rx_head;
+    size_t avail = loop->buf_len[bid] - u->rx_off, chunk;
+    chunk = avail < len - n ? avail : len - n;
+    memcpy((char*)buf + n,
+	   loop->bufs + (size_t)bid * URING_BUF_SIZE + u->rx_off, chunk);
+    n += chunk;
+    if ((u->rx_off += chunk) == (size_t)loop->buf_len[bid]) {
+      if ((u->rx_head = loop->buf_next[bid]) == -1) {
+	u->rx_tail = -1;
+	if (! u->armed) {
+	  mark_dirty(loop, fd);
+	}
+      }
+      u->rx_off = 0;
+      --u->rx_count;
+      buf_recycle(loop, bid);
+    }
+  }
+  if (n != 0) {
+    return n;
+  }
+  if (u->err != 0) {
+    errno = u->err;
+    return -1;
+  }
+  if (u->eof) {
+    return 0;
+  }
+  errno = EAGAIN;
+  return -1;
+}
+
+static int tx_append(uring_fd* u, const void* buf, size_t len)
+{
+  if (u->tx_len + len > u->tx_cap) {
+    size_t cap = u->tx_cap != 0 ? u->tx_cap : 4096;
+    char* tx;
+    while (cap < u->tx_len + len) {
+      cap *= 2;
+    }
+    if ((tx = (char*)realloc(u->tx, cap)) == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    u->tx = tx;
+    u->tx_cap = cap;
+  }
+  memcpy(u->tx + u->tx_len, buf, len);
+  u->tx_len += len;
+  return 0;
+}
+
+ssize_t picoev_write(picoev_loop* _loop, int fd, const void* buf, size_t len)
+{
+  struct iovec iov;
+  
+  iov.iov_base = (void*)buf;
+  iov.iov_len = len;
+  return picoev_writev(_loop, fd, &iov, 1);
+}
+
+ssize_t picoev_writev(picoev_loop* _loop, int fd, const struct iovec* iov,
+		      int iovcnt)
+{
+  picoev_loop_uring* loop = (picoev_loop_uring*)_loop;
+  uring_fd* u = loop->fds + fd;
+  ssize_t n = 0;
+  size_t room, len;
+  int i;
+  
+  if (u->kind != OP_RECV) {
+    return writev(fd, iov, iovcnt);
+  }
+  if (u->send_err != 0) {
+    errno = u->send_err;
+    return -1;
+  }
+  if (pending_send(u) >= URING_MAX_PENDING_SEND) {
+    errno = EAGAIN;
+    return -1;
+  }
+  /* gathered into one send, submitted with the next io_uring_enter. only
+     what fits under URING_MAX_PENDING_SEND is copied, the rest is left to
+     the caller as a short write */
+  room = URING_MAX_PENDING_SEND - pending_send(u);
+  for (i = 0; i < iovcnt && room != 0; ++i) {
+    len = iov[i].iov_len < room ? iov[i].iov_len : room;
+    if (tx_append(u, iov[i].iov_base, len) != 0) {
+      if (n == 0) {
+	return -1;
+      }
+      break;
+    }
+    n += len;
+    room -= len;
+  }
+  if (u->inflight == NULL) {
+    mark_dirty(loop, fd);
+  }
+  return n;
+}
+
+int picoev_accept(picoev_loop* _loop, int fd)
+{
+  picoev_loop_uring* loop = (picoev_loop_uring*)_loop;
+  uring_fd* u = loop->fds + fd;
+  
+  if (u->kind != OP_ACCEPT) {
+    return accept(fd, NULL, NULL);
+  }
+  if (u->accepted_cnt == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  fd = u->accepted[u->accepted_off++];
+  if (--u->accepted_cnt == 0) {
+    u->accepted_off = 0;
+  }
+  return fd;
+}
@@ -0,0 +1,163 @@
+/* NUON - arena check
+ *
+ * the bump allocator on its own, then statements whose parse state spans
+ * several arena blocks or holds a single value larger than a block, and a
+ * failed statement followed by a good one on the same arena. on linux a
+ * statement is also run with the address space capped, so the arena
+ * can't take its value and it has to fail cleanly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+#include "../src/nuon.h"
+#include "check.h"
+
+#define NODES 5000
+#define BIG (ARENA_BLOCK_SIZE * 2)
+
+static void arena_blocks ()
+{
+  Arena a;
+  unsigned char *p, *q, *big, *first;
+  int i;
+
+  memset(&a, 0, sizeof(a));
+
+  CHECK((p = arena_alloc(&a, 3)) != NULL);
+  CHECK((q = arena_alloc(&a, 1)) != NULL);
+  CHECK(((size_t)p & 15) == 0 && ((size_t)q & 15) == 0);
+  CHECK(q >= p + 3);
+  first = p;
+
+  /* an oversized request gets a block of its own */
+  CHECK((big = arena_alloc(&a, BIG)) != NULL);
+  memset(big, 0xab, BIG);
+  CHECK(a.head->size >= BIG);
+
+  for ( i = 0; i < 100; i++ ) {
+    CHECK((p = arena_alloc(&a, 1000)) != NULL);
+    memset(p, i, 1000);
+  }
+  CHECK(a.head->next != NULL);
+
+  /* reset keeps only the oldest block and starts it over */
+  arena_reset(&a);
+  CHECK(a.head != NULL && a.head->next == NULL && a.head->used == 0);
+  CHECK(arena_alloc(&a, 3) == first);
+
+  arena_free(&a);
+  CHECK(a.head == NULL);
+}
+
+static size_t run (Graph* g, const char* q, Output* out, int want)
+{
+  OutputBlock* b;
+  size_t len = 0;
+
+  CHECK(parse(g, (unsigned char *)q, out) == want);
+  for ( b = out->head; b; b = b->next ) {
+    len += b->len - b->off;
+  }
+  output_free(out);
+  output_init(out);
+
+  return len;
+}
+
+static void arena_statements ()
+{
+  Graph* g;
+  Output out;
+  char *q, *p;
+  size_t len;
+  int i;
+
+  CHECK((g = graph_init()) != NULL);
+  output_init(&out);
+
+  /* thousands of nodes in one statement */
+  CHECK((q = malloc(NODES * 64)) != NULL);
+  p = q + sprintf(q, "CREATE ");
+  for ( i = 0; i < NODES; i++ ) {
+    p += sprintf(p, "%s(P {name:\"n%d\"})", i ? "," : "", i);
+  }
+  CHECK((size_t)(p - q) > ARENA_BLOCK_SIZE);
+  run(g, q, &out, 0);
+  CHECK(run(g, "MATCH (P {name:\"n4999\"})", &out, 0) == strlen("{name:\"n4999\"}\n"));
+
+  /* one value longer than a block */
+  CHECK((q = realloc(q, BIG + 64)) != NULL);
+  p = q + sprintf(q, "CREATE (B {k:\"big\",v:\"");
+  memset(p, 'x', BIG);
+  strcpy(p + BIG, "\"})");
+  run(g, q, &out, 0);
+  len = run(g, "MATCH (B {k:\"big\"})", &out, 0);
+  CHECK(len > BIG && len < BIG + 64);
+
+  /* a statement that fails halfway leaves the arena usable */
+  q[BIG] = 0;
+  run(g, q, &out, -1);
+  len = run(g, "MATCH (P {name:\"n0\"})", &out, 0);
+  CHECK(len == strlen("{name:\"n0\"}\n"));
+
+  free(q);
+  output_free(&out);
+}
+
+/* the value needs a fresh block the capped process can't map. the
+   statement is rejected with an error and creates nothing */
+static void arena_exhausted ()
+{
+#ifdef __linux__
+  struct rlimit old, low;
+  OutputBlock* b;
+  Graph* g;
+  Output out;
+  char *q, *p;
+
+  CHECK((g = graph_init()) != NULL);
+  output_init(&out);
+
+  CHECK((q = malloc(BIG * 256 + 64)) != NULL);
+  p = q + sprintf(q, "CREATE (H {k:\"huge\",v:\"");
+  memset(p, 'x', BIG * 256);
+  strcpy(p + BIG * 256, "\"})");
+
+  /* room for the error message, made before the cap */
+  output_printf(&out, "-");
+  output_consume(&out, 1);
+
+  CHECK(getrlimit(RLIMIT_AS, &old) == 0);
+  low = old;
+  low.rlim_cur = 1;
+  CHECK(setrlimit(RLIMIT_AS, &low) == 0);
+  CHECK(parse(g, (unsigned char *)q, &out) == -1);
+  CHECK(setrlimit(RLIMIT_AS, &old) == 0);
+
+  b = out.head;
+  CHECK(b && b->len - b->off == strlen("error: out of memory\n"));
+  CHECK(!memcmp(b->data + b->off, "error: out of memory\n", b->len - b->off));
+  output_free(&out);
+  output_init(&out);
+
+  CHECK(run(g, "MATCH (H {k:\"huge\"})", &out, 0) == 0);
+  run(g, "CREATE (H {k:\"small\"})", &out, 0);
+  CHECK(run(g, "MATCH (H {k:\"small\"})", &out, 0) == strlen("{k:\"small\"}\n"));
+
+  free(q);
+  output_free(&out);
+#endif
+}
+
+int main (void)
+{
+  arena_blocks();
+  arena_statements();
+  arena_exhausted();
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+/* NUON - bitmap check
+ *
+ * drives a bitmap and a plain byte per value through the same random adds
+ * and removes, around the array/bitset switch of a container, and checks
+ * they always agree, seeks included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/nuon.h"
+#include "check.h"
+
+#define RANGE (3 << 16)
+#define ROUNDS 200000
+
+static unsigned char model[RANGE];
+
+static int check_same (Bitmap* b, unsigned int n)
+{
+  BitmapIter it;
+  unsigned int v, prev = 0, seen = 0, i, want, from = 0;
+
+  if ( bitmap_count(b) != n ) {
+    fprintf(stderr, "count %u, want %u\n", bitmap_count(b), n);
+    return -1;
+  }
+
+  bitmap_iterInit(&it, b);
+  while ( bitmap_iterNext(&it, &v) ) {
+    if ( v >= RANGE || !model[v] || (seen && v <= prev) ) {
+      fprintf(stderr, "iterated %u out of order or not a member\n", v);
+      return -1;
+    }
+    prev = v;
+    seen++;
+  }
+
+  if ( seen != n ) {
+    fprintf(stderr, "iterated %u, want %u\n", seen, n);
+    return -1;
+  }
+
+  /* a seek lands on the first member at or after the value, also from
+     an iterator already partway through, which never moves back */
+  for ( i = 0; i < RANGE; i += 1021 ) {
+    if ( i % 2 == 0 ) {
+      bitmap_iterInit(&it, b);
+      from = 0;
+    }
+    bitmap_iterSeek(&it, i);
+    for ( want = i > from ? i : from; want < RANGE && !model[want]; want++ );
+    if ( bitmap_iterNext(&it, &v) != (want < RANGE) || (want < RANGE && v != want) ) {
+      fprintf(stderr, "seek to %u found %u, want %u\n", i, v, want);
+      return -1;
+    }
+    from = want + 1;
+  }
+
+  for ( i = 0; i < RANGE; i += 97 ) {
+    if ( bitmap_contains(b, i) != model[i] ) {
+      fprintf(stderr, "contains %u disagrees\n", i);
+      return -1;
+    }
+  }
+
+  for ( i = 0; i < b->len; i++ ) {
+    if ( b->containers[i].bits && b->containers[i].card < BITMAP_ARRAY_MIN ) {
+      fprintf(stderr, "bitset container with %u values\n", b->containers[i].card);
+      return -1;
+    }
+    if ( b->containers[i].array && b->containers[i].card > BITMAP_ARRAY_MAX ) {
+      fprintf(stderr, "array container with %u values\n", b->containers[i].card);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* values land in three containers, each at most SPAN full, so every
+   container crosses both switch points on the way up and down */
+#define SPAN 8192
+
+int main (void)
+{
+  Bitmap b;
+  unsigned int r, v, n = 0, low, high;
+  int phase, add;
+
+  srand(7);
+  bitmap_init(&b);
+
+  /* fill, drain, then churn between the two switch points */
+  for ( phase = 0; phase < 3; phase++ ) {
+    for ( r = 0; r < ROUNDS; r++ ) {
+      v = ((unsigned int)rand() % 3) << 16 | ((unsigned int)rand() % SPAN);
+      if ( phase == 2 ) {
+        low = 3 * (BITMAP_ARRAY_MIN - 256);
+        high = 3 * (BITMAP_ARRAY_MAX + 256);
+        add = n < low || (n < high && rand() % 2);
+      } else {
+        add = phase == 0;
+      }
+      if ( add ) {
+        CHECK(bitmap_add(&b, v) == 0);
+        n += !model[v];
+        model[v] = 1;
+      } else {
+        bitmap_remove(&b, v);
+        n -= model[v];
+        model[v] = 0;
+      }
+      if ( r % 4096 == 0 && check_same(&b, n) ) {
+        return 1;
+      }
+    }
+    if ( check_same(&b, n) ) {
+      return 1;
+    }
+  }
+
+  bitmap_free(&b);
+
+  return 0;
+}
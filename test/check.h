@@ -0,0 +1,20 @@
+/* NUON - test helpers
+ *
+ * a failed CHECK names the file, line and condition and ends the test
+ * binary, so the test target stops at the first failure.
+ */
+
+#ifndef _CHECK_H
+#define _CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(c) do { \
+  if ( !(c) ) { \
+    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #c); \
+    exit(1); \
+  } \
+} while ( 0 )
+
+#endif
@@ -0,0 +1,87 @@
+/* NUON - scripted client check
+ *
+ * runs the queries of a script against an in-process graph and prints
+ * the replies, so `make test` can diff them against the expected output.
+ * statements end with ';' like on the wire, a bare `compact;` runs the
+ * compactor to completion and refreshes the snapshot, the way the
+ * server's background thread does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "../src/nuon.h"
+
+#define SCRIPT_MAX (1 << 20)
+
+static void client_compact (Graph* g)
+{
+  while ( graph_compact(g, 16) );
+  snapshot_release(graph_snapshot(g));
+}
+
+static int client_isCompact (const char* q)
+{
+  while ( isspace((unsigned char)*q) ) q++;
+  if ( strncmp(q, "compact", 7) ) {
+    return 0;
+  }
+  q += 7;
+  while ( isspace((unsigned char)*q) ) q++;
+  return *q == 0;
+}
+
+static void client_flush (Output* out)
+{
+  OutputBlock* b;
+
+  for ( b = out->head; b; b = b->next ) {
+    fwrite(b->data + b->off, 1, b->len - b->off, stdout);
+  }
+  output_free(out);
+  output_init(out);
+}
+
+int main (int argc, char** argv)
+{
+  static char script[SCRIPT_MAX];
+  Graph* g;
+  Output out;
+  FILE* f;
+  size_t n;
+  char *q, *e;
+
+  if ( argc != 2 ) {
+    fprintf(stderr, "usage: %s script\n", argv[0]);
+    return 2;
+  }
+  if ( !(f = fopen(argv[1], "r")) ) {
+    perror(argv[1]);
+    return 2;
+  }
+  n = fread(script, 1, SCRIPT_MAX - 1, f);
+  fclose(f);
+  script[n] = 0;
+
+  if ( !(g = graph_init()) ) {
+    fprintf(stderr, "graph_init failed\n");
+    return 2;
+  }
+  output_init(&out);
+
+  for ( q = script; (e = strchr(q, ';')); q = e + 1 ) {
+    *e = 0;
+    if ( client_isCompact(q) ) {
+      client_compact(g);
+      printf("-- compact\n");
+      continue;
+    }
+    parse(g, (unsigned char*)q, &out);
+    client_flush(&out);
+    printf("--\n");
+  }
+
+  output_free(&out);
+  return 0;
+}
@@ -0,0 +1,165 @@
+/* NUON - cursor check
+ *
+ * matches run through a cursor in pieces of a few kilobytes print the
+ * same rows as when run whole: lone nodes found by a full scan, a label
+ * scan and an index, patterns, and a pattern followed by lone nodes.
+ * writes between two pieces don't disturb the rest of a match, and a
+ * vertex made meanwhile shows up at its end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/nuon.h"
+#include "check.h"
+
+#define N 3000
+#define LIMIT 2048
+
+static Graph* g;
+
+/* the text of out, which is emptied */
+static char* take (Output* out)
+{
+  OutputBlock* b;
+  char* text;
+  size_t len = 0;
+
+  CHECK((text = malloc(out->len + 1)) != NULL);
+  for ( b = out->head; b; b = b->next ) {
+    memcpy(text + len, b->data + b->off, b->len - b->off);
+    len += b->len - b->off;
+  }
+  text[len] = 0;
+  output_free(out);
+  output_init(out);
+
+  return text;
+}
+
+static char* whole (const char* q)
+{
+  Output out;
+
+  output_init(&out);
+  CHECK(parse(g, (unsigned char *)q, &out) == 0);
+
+  return take(&out);
+}
+
+/* runs q piece by piece, calling between after the first one, and
+   returns everything it printed */
+static char* pieces (const char* q, const char* between, int* n)
+{
+  Cursor cur;
+  Output out;
+  char *text, *piece;
+  size_t len = 0;
+
+  memset(&cur, 0, sizeof(cur));
+  cur.limit = LIMIT;
+  output_init(&out);
+  CHECK((text = calloc(1, 1)) != NULL);
+
+  for ( *n = 0; !*n || cur.more; (*n)++ ) {
+    CHECK(parse_resume(g, (unsigned char *)q, &out, &cur) == 0);
+    /* a piece stops soon after it passes the limit */
+    CHECK(!cur.more || (out.len >= LIMIT && out.len < LIMIT * 4));
+    piece = take(&out);
+    CHECK((text = realloc(text, len + strlen(piece) + 1)) != NULL);
+    strcpy(text + len, piece);
+    len += strlen(piece);
+    free(piece);
+    if ( !*n && between ) {
+      free(whole(between));
+    }
+  }
+
+  /* a finished statement leaves the cursor ready for the next */
+  CHECK(cur.stage == 0 && cur.from == 0);
+
+  return text;
+}
+
+static void same (const char* q, int many)
+{
+  char *a, *b;
+  int n;
+
+  a = whole(q);
+  b = pieces(q, NULL, &n);
+  if ( strcmp(a, b) ) {
+    fprintf(stderr, "%s: pieces differ from the whole\n", q);
+    exit(1);
+  }
+  CHECK(!many || n > 4);
+  free(a);
+  free(b);
+}
+
+int main (void)
+{
+  char q[256], *a, *b, *p;
+  int i, n;
+
+  CHECK((g = graph_init()) != NULL);
+
+  free(whole("CREATE INDEX ON P(k)"));
+  for ( i = 0; i < N; i++ ) {
+    snprintf(q, sizeof(q), "CREATE (P as a {name:\"p%d\",k:\"%d\",tag:\"%s\"}),(Q as b {name:\"q%d\"}),"
+             "(P as c {name:\"r%d\",k:\"x\"}),(a)-[KK]->(b),(c)-[KK]->(b)", i, i % 10, i % 3 ? "t" : "u", i, i);
+    free(whole(q));
+  }
+
+  same("MATCH (P)", 1);
+  same("MATCH (P {k:\"3\"})", 1);
+  same("MATCH (P {tag:\"u\"})", 1);
+  same("MATCH (P {k:\"3\",tag:\"u\"}),(Q {name:\"q7\"}),(P {k:\"x\"})", 1);
+  same("MATCH (P {tag:\"u\"}),(P {k:\"3\"}),(P {k:\"x\"})", 1);
+  same("MATCH (P as a {k:\"4\"})-[KK]->(b)", 1);
+  same("MATCH (a)-[KK]->(b), (P as c {k:\"x\"})-[KK]->(b)", 1);
+  same("MATCH (P as a {k:\"5\"})-[KK]->(b), (Q {name:\"q5\"}), (P {k:\"1\",tag:\"u\"})", 1);
+  same("MATCH (P {name:\"nope\"})", 0);
+  same("MATCH (P as a {name:\"nope\"})-[KK]->(b)", 0);
+
+  /* vertices made between two pieces come last, edges made between them
+     are seen by the pieces after */
+  b = pieces("MATCH (P {k:\"x\"})", "CREATE (P as a {name:\"late\",k:\"x\"}),(Q as b {name:\"qlate\"}),(a)-[KK]->(b)", &n);
+  a = whole("MATCH (P {k:\"x\"})");
+  CHECK(n > 4 && strcmp(a, b) == 0);
+  CHECK(strstr(b, "late") != NULL);
+  free(a);
+  free(b);
+
+  b = pieces("MATCH (P as a {k:\"x\"})-[KK]->(b)", "CREATE (P as a {name:\"later\",k:\"x\"}),(Q as b {name:\"qlater\"}),(a)-[KK]->(b)", &n);
+  a = whole("MATCH (P as a {k:\"x\"})-[KK]->(b)");
+  CHECK(n > 4 && strcmp(a, b) == 0);
+  CHECK(strstr(b, "qlater") != NULL);
+  free(a);
+  free(b);
+
+  /* a write that makes the planner favour the other end doesn't move the
+     anchor of a match already under way */
+  for ( i = 0; i < 300; i++ ) {
+    snprintf(q, sizeof(q), "CREATE (A as x {t:\"a\",name:\"a%d\"}),(B as y {t:\"b\",name:\"b%d\"}),(B {t:\"b\"}),(x)-[LL]->(y)", i, i);
+    free(whole(q));
+  }
+  CHECK((p = malloc(N * 16 + 16)) != NULL);
+  strcpy(p, "CREATE ");
+  for ( i = 0; i < N; i++ ) {
+    strcat(p, i ? ",(A {t:\"a\"})" : "(A {t:\"a\"})");
+  }
+  a = whole("MATCH (A as x {t:\"a\"})-[LL]->(B as y {t:\"b\"})");
+  b = pieces("MATCH (A as x {t:\"a\"})-[LL]->(B as y {t:\"b\"})", p, &n);
+  CHECK(n > 1 && strcmp(a, b) == 0);
+  free(a);
+  free(b);
+  free(p);
+
+  /* an update runs whole whatever the cursor says */
+  b = pieces("MATCH (P as a {k:\"7\"}) SET a.seen = \"y\"", NULL, &n);
+  CHECK(n == 1 && strlen(b) > LIMIT);
+  free(b);
+
+  return 0;
+}
@@ -0,0 +1,332 @@
+/* NUON - graph check
+ *
+ * random edge adds, removes and vertex deletes on a plain and a sorted
+ * label, with the compactor run in small budgets in between, checked
+ * against an adjacency matrix: edge existence, bucket contents in both
+ * directions, the csr snapshot, taken again as the graph changes and
+ * held across writes, and the degree statistics. then the label counts
+ * and distinct value estimates the planner reads, and the printing of a
+ * clique, which stays bounded per row.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/nuon.h"
+#include "check.h"
+
+#define N 200
+#define ROUNDS 100000
+
+/* edges a -> b by label, a sorted label holds at most one */
+static int model[2][N][N];
+static sym_t labels[2];
+static int dead[N];
+static int sorted;
+
+static Vertex* vertex (Graph* g, int id)
+{
+  return graph_vertexById(g, (vid_t)id);
+}
+
+/* live entries of the bucket, all of them or those pointing at to */
+static int count (Graph* g, Adjacency* a, int to)
+{
+  AdjBlock* b;
+  unsigned int i;
+  int n = 0;
+
+  for ( b = a ? a->head : NULL; b; b = b->next ) {
+    for ( i = 0; i < b->len; i++ ) {
+      if ( (b->to[i] & VID_DEAD) || graph_vertexById(g, b->to[i])->dead ) {
+        continue;
+      }
+      n += to < 0 || b->to[i] == (vid_t)to;
+    }
+  }
+
+  return n;
+}
+
+static int bucket (int deg)
+{
+  int b = 0;
+
+  while ( deg >>= 1 ) {
+    b++;
+  }
+
+  return b;
+}
+
+static void check_edges (Graph* g, Snapshot* s)
+{
+  const vid_t* t;
+  EdgeStats* es;
+  unsigned long out[DEGREE_BUCKETS], in[DEGREE_BUCKETS], edges;
+  int seen[N], l, a, b, nout, nin;
+  size_t n, i;
+
+  for ( l = 0; l < 2; l++ ) {
+    memset(out, 0, sizeof(out));
+    memset(in, 0, sizeof(in));
+    edges = 0;
+
+    for ( a = 0; a < N; a++ ) {
+      nout = 0;
+      nin = 0;
+      for ( b = 0; b < N; b++ ) {
+        CHECK(graph_hasEdge(g, vertex(g, a), vertex(g, b), labels[l]) == (model[l][a][b] > 0));
+        nout += model[l][a][b];
+        nin += model[l][b][a];
+      }
+      if ( !dead[a] ) {
+        for ( b = 0; b < N; b++ ) {
+          CHECK(count(g, graph_vertexEdges(vertex(g, a), labels[l]), b) == model[l][a][b]);
+        }
+        CHECK(count(g, graph_vertexEdges(vertex(g, a), labels[l]), -1) == nout);
+        CHECK(count(g, graph_vertexInEdges(vertex(g, a), labels[l]), -1) == nin);
+      }
+
+      /* the snapshot holds the same targets as the bucket, in order when
+         the label is sorted */
+      t = snapshot_edges(s, (vid_t)a, labels[l], &n);
+      CHECK(n == (size_t)nout);
+      memset(seen, 0, sizeof(seen));
+      for ( i = 0; i < n; i++ ) {
+        CHECK(t[i] < N && (!l || !sorted || !i || t[i - 1] < t[i]));
+        seen[t[i]]++;
+      }
+      CHECK(memcmp(seen, model[l][a], sizeof(seen)) == 0);
+
+      if ( nout ) {
+        out[bucket(nout)]++;
+      }
+      if ( nin ) {
+        in[bucket(nin)]++;
+      }
+      edges += nout;
+    }
+
+    /* no stats until the label's first edge */
+    if ( labels[l] >= g->nestats ) {
+      CHECK(edges == 0);
+      continue;
+    }
+    es = &g->estats[labels[l]];
+    CHECK(es->edges == edges);
+    for ( i = 0; i < DEGREE_BUCKETS; i++ ) {
+      CHECK(es->out[i] == out[i]);
+      CHECK(es->in[i] == in[i]);
+    }
+  }
+}
+
+/* after a full compaction no bucket holds a marked entry or an empty
+   block */
+static void check_compacted (Graph* g)
+{
+  AdjBlock* b;
+  Adjacency* a;
+  unsigned int i;
+  int l, v;
+
+  while ( graph_compact(g, 64) );
+
+  for ( l = 0; l < 2; l++ ) {
+    for ( v = 0; v < N; v++ ) {
+      if ( dead[v] ) {
+        continue;
+      }
+      a = graph_vertexEdges(vertex(g, v), labels[l]);
+      for ( b = a ? a->head : NULL; b; b = b->next ) {
+        CHECK(b->len != 0);
+        for ( i = 0; i < b->len; i++ ) {
+          CHECK(!(b->to[i] & VID_DEAD));
+        }
+      }
+      CHECK(!a || (a->count == 0) == (a->head == NULL));
+    }
+  }
+}
+
+static void sort_label (Graph* g)
+{
+  int a, b;
+
+  CHECK(graph_sortEdges(g, labels[1]) == 0);
+  sorted = 1;
+  for ( a = 0; a < N; a++ ) {
+    for ( b = 0; b < N; b++ ) {
+      model[1][a][b] = model[1][a][b] > 0;
+    }
+  }
+}
+
+static void edges_random (Graph* g)
+{
+  Snapshot *s, *held = NULL;
+  int r, a, b, l, i, op, held_out = 0;
+  size_t n;
+
+  for ( r = 0; r < ROUNDS; r++ ) {
+    a = rand() % N;
+    b = rand() % N;
+    l = rand() % 2;
+    op = rand() % 100;
+
+    if ( op < 50 ) {
+      graph_vertexAddEdge(g, vertex(g, a), vertex(g, b), labels[l]);
+      if ( !dead[a] && !dead[b] ) {
+        model[l][a][b] = l && sorted ? 1 : model[l][a][b] + 1;
+      }
+    } else if ( op < 90 ) {
+      if ( !dead[a] && !dead[b] && model[l][a][b] ) {
+        CHECK(graph_vertexRemoveEdge(g, vertex(g, a), vertex(g, b), labels[l]) == 0);
+        model[l][a][b]--;
+      } else {
+        CHECK(graph_vertexRemoveEdge(g, vertex(g, a), vertex(g, b), labels[l]) != 0);
+      }
+    } else if ( op < 91 && !dead[a] && rand() % 20 == 0 ) {
+      graph_deleteVertex(g, vertex(g, a));
+      dead[a] = 1;
+      for ( i = 0; i < N; i++ ) {
+        model[0][a][i] = model[0][i][a] = 0;
+        model[1][a][i] = model[1][i][a] = 0;
+      }
+    } else if ( op < 96 ) {
+      graph_compact(g, (unsigned int)(rand() % 8));
+    }
+
+    /* the sorted label is switched over once it already has edges, which
+       drops its repeats */
+    if ( r == ROUNDS / 4 ) {
+      sort_label(g);
+    }
+
+    if ( r % 10000 == 0 ) {
+      CHECK((s = graph_snapshot(g)) != NULL);
+      check_edges(g, s);
+
+      /* an older snapshot is unaffected by later writes */
+      if ( held ) {
+        snapshot_edges(held, 0, labels[0], &n);
+        CHECK(n == (size_t)held_out);
+        snapshot_release(held);
+      }
+      held = s;
+      for ( held_out = 0, i = 0; i < N; i++ ) {
+        held_out += model[0][0][i];
+      }
+    }
+  }
+
+  snapshot_release(held);
+
+  CHECK((s = graph_snapshot(g)) != NULL);
+  check_edges(g, s);
+  snapshot_release(s);
+
+  check_compacted(g);
+
+  CHECK((s = graph_snapshot(g)) != NULL);
+  check_edges(g, s);
+  snapshot_release(s);
+}
+
+/* the sketch is within a few percent at any cardinality */
+static void distinct_estimates ()
+{
+  static const int spread[] = { 10, 1000, 50000 };
+  sym_t label = sym_intern((unsigned char *)"P");
+  sym_t key = sym_intern((unsigned char *)"k");
+  char value[32];
+  double est;
+  Graph* g;
+  Vertex* v;
+  int t, i;
+
+  for ( t = 0; t < 3; t++ ) {
+    CHECK((g = graph_init()) != NULL);
+    for ( i = 0; i < 100000; i++ ) {
+      CHECK((v = graph_addVertex(g)) != NULL);
+      CHECK(graph_addLabel(g, v, label) == 0);
+      snprintf(value, sizeof(value), "v%d", i % spread[t]);
+      graph_vertexSetProperty(g, v, key, (unsigned char *)value);
+    }
+    CHECK(graph_labelCount(g, label) == 100000);
+    est = graph_distinct(g, label, key);
+    CHECK(est > spread[t] * 0.9 && est < spread[t] * 1.1);
+  }
+}
+
+/* every path of a clique up to the print depth is far too many to
+   print, each row stops at a bounded number of vertices */
+static void dense_print ()
+{
+  OutputBlock* b;
+  Graph* g;
+  Output out;
+  char q[4096], *p, *text;
+  size_t len = 0, rows = 0, names;
+  int i, j;
+
+  CHECK((g = graph_init()) != NULL);
+  output_init(&out);
+
+  p = q + sprintf(q, "CREATE ");
+  for ( i = 0; i < 16; i++ ) {
+    p += sprintf(p, "%s(D as %c {name:\"%c\"})", i ? "," : "", 'a' + i, 'a' + i);
+  }
+  for ( i = 0; i < 16; i++ ) {
+    for ( j = 0; j < 16; j++ ) {
+      if ( i != j ) {
+        p += sprintf(p, ",(%c)-[KK]->(%c)", 'a' + i, 'a' + j);
+      }
+    }
+  }
+  CHECK(parse(g, (unsigned char *)q, &out) == 0);
+  CHECK(parse(g, (unsigned char *)"MATCH (D)", &out) == 0);
+
+  CHECK((text = malloc(out.len + 1)) != NULL);
+  for ( b = out.head; b; b = b->next ) {
+    memcpy(text + len, b->data + b->off, b->len - b->off);
+    len += b->len - b->off;
+  }
+  text[len] = 0;
+
+  /* every row has its own budget */
+  for ( p = text; *p; p++, rows++ ) {
+    for ( names = 0; *p != '\n'; p++ ) {
+      names += !strncmp(p, "name:", 5);
+    }
+    CHECK(names > 16 && names <= 1024);
+  }
+  CHECK(rows == 16);
+
+  free(text);
+  output_free(&out);
+}
+
+int main (void)
+{
+  Graph* g;
+  int i;
+
+  srand(7);
+
+  CHECK((g = graph_init()) != NULL);
+
+  for ( i = 0; i < N; i++ ) {
+    CHECK(graph_addVertex(g) != NULL);
+  }
+
+  labels[0] = sym_intern((unsigned char *)"plain");
+  labels[1] = sym_intern((unsigned char *)"sorted");
+
+  edges_random(g);
+  distinct_estimates();
+  dense_print();
+
+  return 0;
+}
@@ -0,0 +1,177 @@
+/* NUON - ingest check
+ *
+ * several threads run CREATE statements into one graph at the same time,
+ * each making an indexed vertex, a second vertex and an edge between
+ * them, while another thread keeps matching. every vertex, label member,
+ * posting and edge has to be there afterwards, and no match may see a
+ * statement half done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../src/nuon.h"
+#include "check.h"
+
+#define WRITERS 4
+#define ITERS 5000
+
+static Graph* g;
+static int done;
+
+static size_t run (const char* q, Output* out, char** text)
+{
+  static __thread char* buf;
+  static __thread size_t cap;
+  OutputBlock* b;
+  size_t len = 0;
+
+  CHECK(parse(g, (unsigned char *)q, out) == 0);
+
+  if ( !buf ) {
+    cap = 4096;
+    CHECK((buf = malloc(cap)) != NULL);
+  }
+
+  for ( b = out->head; b; b = b->next ) {
+    if ( len + b->len - b->off + 1 > cap ) {
+      cap = (len + b->len - b->off + 1) * 2;
+      CHECK((buf = realloc(buf, cap)) != NULL);
+    }
+    memcpy(buf + len, b->data + b->off, b->len - b->off);
+    len += b->len - b->off;
+  }
+  output_free(out);
+  output_init(out);
+
+  if ( text ) {
+    buf[len] = 0;
+    *text = buf;
+  }
+
+  return len;
+}
+
+static size_t lines (const char* s)
+{
+  size_t n = 0;
+
+  while ( (s = strchr(s, '\n')) ) {
+    s++;
+    n++;
+  }
+
+  return n;
+}
+
+static void* writer (void* arg)
+{
+  int w = (int)(size_t)arg, i;
+  char q[512];
+  Output out;
+
+  output_init(&out);
+
+  for ( i = 0; i < ITERS; i++ ) {
+    /* the edge comes last, after b and its properties, so a reader let in
+       halfway would find a without it */
+    snprintf(q, sizeof(q), "CREATE (P as a {t:\"%d\",name:\"p%d_%d\"}),"
+             "(Q as b {name:\"q%d_%d\",ka:\"1\",kb:\"2\",kc:\"3\",kd:\"4\",ke:\"5\",kf:\"6\",kg:\"7\"}),"
+             "(a)-[KK]->(b)", w, w, i, w, i);
+    CHECK(run(q, &out, NULL) == 0);
+  }
+
+  output_free(&out);
+
+  return NULL;
+}
+
+/* a P printed without its edge would be a CREATE seen halfway */
+static void* reader (void* arg)
+{
+  Output out;
+  char* text;
+  char* p;
+  size_t n, last = 0;
+
+  (void)arg;
+  output_init(&out);
+
+  while ( !__sync_add_and_fetch(&done, 0) ) {
+    run("MATCH (P {t:\"0\"})", &out, &text);
+    n = lines(text);
+    CHECK(n >= last && n <= ITERS);
+    last = n;
+    for ( p = text; (p = strchr(p, '\n')); p++ ) {
+      CHECK(strncmp(p - 2, "}}", 2) == 0);
+    }
+  }
+
+  output_free(&out);
+
+  return NULL;
+}
+
+int main (void)
+{
+  pthread_t writers[WRITERS], r;
+  Output out;
+  Adjacency* a;
+  Vertex* v;
+  char q[64];
+  char* text;
+  double d;
+  vid_t id;
+  int i;
+
+  CHECK((g = graph_init()) != NULL);
+  output_init(&out);
+  CHECK(run("CREATE INDEX ON P(t)", &out, NULL) == 0);
+
+  CHECK(pthread_create(&r, NULL, reader, NULL) == 0);
+  for ( i = 0; i < WRITERS; i++ ) {
+    CHECK(pthread_create(&writers[i], NULL, writer, (void *)(size_t)i) == 0);
+  }
+  for ( i = 0; i < WRITERS; i++ ) {
+    CHECK(pthread_join(writers[i], NULL) == 0);
+  }
+  __sync_add_and_fetch(&done, 1);
+  CHECK(pthread_join(r, NULL) == 0);
+
+  CHECK(g->nvertices == 2 * WRITERS * ITERS);
+  CHECK(bitmap_count(graph_labelMembers(g, sym_lookup((unsigned char *)"P"))) == WRITERS * ITERS);
+  CHECK(bitmap_count(graph_labelMembers(g, sym_lookup((unsigned char *)"Q"))) == WRITERS * ITERS);
+
+  /* every P found through the index, each with the one edge it was made
+     with */
+  for ( i = 0; i < WRITERS; i++ ) {
+    snprintf(q, sizeof(q), "MATCH (P {t:\"%d\"})", i);
+    run(q, &out, &text);
+    CHECK(lines(text) == ITERS);
+  }
+
+  /* the statistics saw every statement too */
+  CHECK(graph_labelCount(g, sym_lookup((unsigned char *)"P")) == WRITERS * ITERS);
+  CHECK(g->estats[sym_lookup((unsigned char *)"KK")].edges == WRITERS * ITERS);
+  CHECK(graph_fanout(g, sym_lookup((unsigned char *)"KK"), 0) == 1);
+  d = graph_distinct(g, sym_lookup((unsigned char *)"P"), sym_lookup((unsigned char *)"name"));
+  CHECK(d > WRITERS * ITERS * 0.9 && d < WRITERS * ITERS * 1.1);
+
+  for ( id = 0; id < g->nvertices; id++ ) {
+    v = graph_vertexById(g, id);
+    a = graph_vertexEdges(v, sym_lookup((unsigned char *)"KK"));
+    if ( v->label == sym_lookup((unsigned char *)"P") ) {
+      CHECK(a && a->count == 1);
+      CHECK(graph_vertexById(g, a->head->to[0])->label == sym_lookup((unsigned char *)"Q"));
+    } else {
+      CHECK(!a || a->count == 0);
+      a = graph_vertexInEdges(v, sym_lookup((unsigned char *)"KK"));
+      CHECK(a && a->count == 1);
+    }
+  }
+
+  output_free(&out);
+
+  return 0;
+}
@@ -0,0 +1,204 @@
+/* NUON - wire check
+ *
+ * talks to a running server on the default port: several statements in
+ * one packet, statements split across packets with delimiters inside
+ * string literals, values with escapes printed back as literals, error
+ * replies, and a pipelined batch whose replies pass the server's high
+ * water mark before the client starts reading.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "check.h"
+
+#define PORT 23456
+
+#define ROWS 2000
+#define BATCHES 10
+#define PAD 100
+
+static char* inbuf;
+static size_t inlen, incap;
+
+static int wire_connect ()
+{
+  struct sockaddr_in addr;
+  int fd, on = 1, tries;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  /* the server may still be starting */
+  for ( tries = 0; tries < 50; tries++ ) {
+    CHECK((fd = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+    if ( connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 ) {
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      return fd;
+    }
+    close(fd);
+    usleep(100000);
+  }
+
+  fprintf(stderr, "no server on port %d\n", PORT);
+  exit(1);
+}
+
+static void wire_send (int fd, const char* s, size_t len)
+{
+  ssize_t r;
+
+  while ( len ) {
+    CHECK((r = write(fd, s, len)) > 0);
+    s += r;
+    len -= r;
+  }
+}
+
+/* returns the next reply without its terminating empty line, which stays
+   valid until the next call */
+static char* wire_reply (int fd)
+{
+  static size_t taken;
+  ssize_t r;
+  char* end;
+  char* reply;
+
+  if ( taken ) {
+    memmove(inbuf, inbuf + taken, inlen - taken);
+    inlen -= taken;
+    taken = 0;
+  }
+
+  for ( ;; ) {
+    if ( incap - inlen < 65536 ) {
+      incap = incap ? incap * 2 : 1 << 20;
+      CHECK((inbuf = realloc(inbuf, incap + 1)) != NULL);
+    }
+    /* an empty reply is a lone newline, any other ends in a blank line */
+    if ( inlen && inbuf[0] == '\n' ) {
+      end = inbuf;
+      break;
+    }
+    inbuf[inlen] = 0;
+    if ( (end = strstr(inbuf, "\n\n")) ) {
+      end++;
+      break;
+    }
+    CHECK((r = read(fd, inbuf + inlen, incap - inlen)) > 0);
+    inlen += r;
+  }
+
+  reply = inbuf;
+  *end = 0;
+  taken = end - inbuf + 1;
+
+  return reply;
+}
+
+static void expect (int fd, const char* want)
+{
+  char* got = wire_reply(fd);
+
+  if ( strcmp(got, want) ) {
+    fprintf(stderr, "got \"%s\", want \"%s\"\n", got, want);
+    exit(1);
+  }
+}
+
+static void wire_packets (int fd)
+{
+  const char* q;
+  size_t i;
+
+  /* three statements in one write, replies come back in order */
+  q = "CREATE (W {name:\"a;b\"});"
+      "MATCH (W {name:\"a;b\"});"
+      "MATCH (W {name:\"nope\"});";
+  wire_send(fd, q, strlen(q));
+  expect(fd, "");
+  expect(fd, "{name:\"a;b\"}\n");
+  expect(fd, "");
+
+  /* one byte per write, the escaped quote keeps the literal open */
+  q = "MATCH (W {name:\"c\\\";d\"});MATCH (W {name:\"a;b\"}";
+  for ( i = 0; i < strlen(q); i++ ) {
+    wire_send(fd, q + i, 1);
+  }
+  expect(fd, "");
+
+  /* the tail of a statement completes it */
+  wire_send(fd, ");", 2);
+  expect(fd, "{name:\"a;b\"}\n");
+
+  /* a value with a quote, a backslash and a newline prints as a literal
+     that matches it again, and the newline doesn't end the row */
+  q = "CREATE (W {name:\"c\\\";d\\\\e\\nf\"});"
+      "MATCH (W {name:\"c\\\";d\\\\e\\nf\"});";
+  wire_send(fd, q, strlen(q));
+  expect(fd, "");
+  expect(fd, "{name:\"c\\\";d\\\\e\\nf\"}\n");
+
+  /* errors are replies too */
+  wire_send(fd, "MATCH (;", 8);
+  CHECK(strncmp(wire_reply(fd), "error: ", 7) == 0);
+}
+
+static void wire_pipeline (int fd)
+{
+  char *q, *p, *reply, pad[PAD + 1];
+  size_t lines;
+  int b, i;
+
+  memset(pad, 'x', PAD);
+  pad[PAD] = 0;
+
+  CHECK((q = malloc(ROWS * (PAD + 64))) != NULL);
+  for ( b = 0; b < BATCHES; b++ ) {
+    p = q + sprintf(q, "CREATE ");
+    for ( i = 0; i < ROWS; i++ ) {
+      p += sprintf(p, "%s(X {b:\"%d\",pad:\"%s\"})", i ? "," : "", b, pad);
+    }
+    *p++ = ';';
+    wire_send(fd, q, p - q);
+    expect(fd, "");
+  }
+
+  /* each match replies with about 2MB, well past the high water mark, and
+     nothing is read until every statement is sent */
+  p = q;
+  for ( i = 0; i < 4; i++ ) {
+    p += sprintf(p, "MATCH (X {pad:\"%s\"});", pad);
+  }
+  p += sprintf(p, "MATCH (X {b:\"nope\"});");
+  wire_send(fd, q, p - q);
+
+  for ( i = 0; i < 4; i++ ) {
+    reply = wire_reply(fd);
+    for ( lines = 0; (p = strchr(reply, '\n')); reply = p + 1 ) {
+      lines++;
+    }
+    CHECK(lines == ROWS * BATCHES);
+  }
+  expect(fd, "");
+
+  free(q);
+}
+
+int main (void)
+{
+  int fd = wire_connect();
+
+  wire_packets(fd);
+  wire_pipeline(fd);
+  close(fd);
+
+  return 0;
+}